@@ -1866,6 +1866,16 @@ namespace RenderHeads.Media.AVProVideo
                     {
                         DirectoryInfo d = new DirectoryInfo(selectedDirectory);
                         string[] files = d.GetFiles().Select(x => x.ToString()).ToArray();
+                        string bundleFile = files.FirstOrDefault(x => x.EndsWith(ResultBundle.FILE_NAME));
+                        if (bundleFile != null)  // Binary results (--outputFormat binary/both) hold everything the JSON and XML files do.
+                        {
+                            _clips[windowID].SetEdgeCostFile(bundleFile, _Sphere);
+                            _clips[windowID].SetAllArcsFile(bundleFile);
+                            _clips[windowID].SetValidArcFile(bundleFile);
+                            _clips[windowID].SetExtraCostsFile(bundleFile);
+                            _clips[windowID].SetCutFile(bundleFile);
+                            files = new string[0];
+                        }
                         foreach (string f in files)
                         {
                             Debug.Log("File: " + f);
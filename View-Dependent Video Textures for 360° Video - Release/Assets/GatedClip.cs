@@ -261,6 +261,8 @@ namespace RenderHeads.Media.AVProVideo
         public void Transition(int currentFrame, int curView, MultiplePlayerControl multiMedia, HeadTrack _headtrack)
         {
             int gateFrame = (int)(this.gateTime * multiMedia.Player.Info.GetVideoFrameRate());
+            int forwardTarget = gateFrame - (int)(HeadTrack._LOOP_TRANS_DURATION * multiMedia.Player.Info.GetVideoFrameRate());
+            TransitionTable transitions = sp.GetTransitionTable(gateFrame, sp.jumpImmediately ? forwardTarget : -1);  // Built when the cut was loaded.
 
             if (!isTargetView(curView) && (multiMedia.expectedCurrentFrame == gateFrame || multiMedia.expectedNextFrame == gateFrame) && currentFrame != multiMedia.expectedCurrentFrame && currentFrame != multiMedia.expectedNextFrame)
             {
@@ -273,8 +275,9 @@ namespace RenderHeads.Media.AVProVideo
 
                 if (sp.jumpImmediately && currentFrame < gateFrame - HeadTrack._LOOP_TRANS_DURATION && isTargetView(curView))
                 {
-                    int jumpToFrame = gateFrame - (int)(HeadTrack._LOOP_TRANS_DURATION * multiMedia.Player.Info.GetVideoFrameRate());
-                    if (sp.views[curView].CanJumpTo(currentFrame, jumpToFrame, sp.jumpThreshold))
+                    int jumpToFrame = forwardTarget;
+                    bool canJump = transitions != null ? transitions.CanJumpForward(curView, currentFrame, sp.jumpThreshold) : sp.views[curView].CanJumpTo(currentFrame, jumpToFrame, sp.jumpThreshold);
+                    if (canJump)
                     {
                         float jumpToTime = this.gateTime - HeadTrack._LOOP_TRANS_DURATION;
                         Debug.Log("Frame rate: " + multiMedia.Player.Info.GetVideoFrameRate());
@@ -301,7 +304,20 @@ namespace RenderHeads.Media.AVProVideo
 
             int jumpTo;
             int fromFrame = currentFrame;
-            if (sp.ReachedCutFrame(curView, currentFrame))
+            if (transitions != null)
+            {
+                TransitionTable.Entry next = transitions.Lookup(curView, currentFrame);
+                jumpTo = next.target;
+                if (next.kind == TransitionTable.BACKWARD)
+                {
+                    Debug.Log("Reached cut frame. Jumping to: " + jumpTo);
+                }
+                else if (next.kind == TransitionTable.LATE)
+                {
+                    Debug.LogWarning("ERROR! REACHED DANGER ZONE " + curView + ", " + currentFrame);
+                }
+            }
+            else if (sp.ReachedCutFrame(curView, currentFrame))
             {
                 jumpTo = sp.FindJumpToFrame(curView, currentFrame);
                 Debug.Log("Reached cut frame. Jumping to: " + jumpTo);
@@ -0,0 +1,129 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Text;
+
+namespace RenderHeads.Media.AVProVideo
+{
+    // Reader for the binary graph-cut results (results.vdtb, written with --outputFormat binary). See graphcut/resultbundle.h for the layout.
+    // Only the header, the section table and the requested section are read from disk.
+    public static class ResultBundle
+    {
+        public const string FILE_NAME = "results.vdtb";
+        const uint VERSION = 1;
+        const uint RAGGED_INT32 = 0;
+        const uint RAGGED_FLOAT32 = 1;
+        const uint MATRIX_FLOAT32 = 2;
+
+        struct Section
+        {
+            public string name;
+            public uint type;
+            public int rows;
+            public int cols;
+            public long offset;
+        }
+
+        public static bool IsBundle(string path)
+        {
+            return path.EndsWith(".vdtb");
+        }
+
+        public static bool HasSection(string path, string name)
+        {
+            using (BinaryReader r = new BinaryReader(File.OpenRead(path)))
+            {
+                return ReadSections(r, path).ContainsKey(name);
+            }
+        }
+
+        public static List<List<int>> ReadIntLists(string path, string name)
+        {
+            return ReadLists(path, name, RAGGED_INT32, r => r.ReadInt32());
+        }
+
+        public static List<List<float>> ReadFloatLists(string path, string name)
+        {
+            return ReadLists(path, name, RAGGED_FLOAT32, r => r.ReadSingle());
+        }
+
+        public static float[] ReadMatrix(string path, string name, out int rows, out int cols)
+        {
+            using (BinaryReader r = new BinaryReader(File.OpenRead(path)))
+            {
+                Section s = GetSection(r, path, name, MATRIX_FLOAT32);
+                r.BaseStream.Seek(s.offset, SeekOrigin.Begin);
+                rows = s.rows;
+                cols = s.cols;
+                byte[] bytes = r.ReadBytes(rows * cols * sizeof(float));
+                float[] data = new float[rows * cols];
+                Buffer.BlockCopy(bytes, 0, data, 0, bytes.Length);
+                return data;
+            }
+        }
+
+        static List<List<T>> ReadLists<T>(string path, string name, uint type, Func<BinaryReader, T> readElement)
+        {
+            using (BinaryReader r = new BinaryReader(File.OpenRead(path)))
+            {
+                Section s = GetSection(r, path, name, type);
+                r.BaseStream.Seek(s.offset, SeekOrigin.Begin);
+                long[] offsets = new long[s.rows + 1];
+                for (int i = 0; i <= s.rows; i++)
+                {
+                    offsets[i] = (long)r.ReadUInt64();
+                }
+
+                List<List<T>> lists = new List<List<T>>();
+                for (int i = 0; i < s.rows; i++)
+                {
+                    List<T> list = new List<T>();
+                    for (long j = offsets[i]; j < offsets[i + 1]; j++)
+                    {
+                        list.Add(readElement(r));
+                    }
+                    lists.Add(list);
+                }
+                return lists;
+            }
+        }
+
+        static Section GetSection(BinaryReader r, string path, string name, uint type)
+        {
+            Dictionary<string, Section> sections = ReadSections(r, path);
+            if (!sections.ContainsKey(name) || sections[name].type != type)
+            {
+                throw new InvalidDataException("No section " + name + " of the expected type in " + path);
+            }
+            return sections[name];
+        }
+
+        static Dictionary<string, Section> ReadSections(BinaryReader r, string path)
+        {
+            // BinaryReader is little-endian, like the file.
+            string magic = Encoding.ASCII.GetString(r.ReadBytes(4));
+            uint version = r.ReadUInt32();
+            uint numSections = r.ReadUInt32();
+            r.ReadUInt32();
+            if (magic != "VDTB" || version != VERSION)
+            {
+                throw new InvalidDataException("Not a version " + VERSION + " result bundle: " + path);
+            }
+
+            Dictionary<string, Section> sections = new Dictionary<string, Section>();
+            for (int i = 0; i < numSections; i++)
+            {
+                Section s = new Section();
+                s.name = Encoding.ASCII.GetString(r.ReadBytes(32)).TrimEnd('\0');
+                s.type = r.ReadUInt32();
+                s.rows = (int)r.ReadUInt32();
+                s.cols = (int)r.ReadUInt32();
+                r.ReadUInt32();
+                s.offset = (long)r.ReadUInt64();
+                r.ReadUInt64();  // Size in bytes.
+                sections[s.name] = s;
+            }
+            return sections;
+        }
+    }
+}
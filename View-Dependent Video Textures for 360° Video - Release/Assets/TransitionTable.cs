@@ -0,0 +1,119 @@
+﻿using System;
+using System.Runtime.InteropServices;
+using UnityEngine;
+
+namespace RenderHeads.Media.AVProVideo
+{
+    // Transition table of a gate, from the native vdtransitions plugin (see graphcut/vdtransitions.h; put libvdtransitions in
+    // Assets/Plugins). Answers where to go after each (view, frame) and whether a forward jump is within the threshold without walking
+    // the cut lists or allocating. Create returns null when the plugin is missing, so callers can fall back to the lists.
+    public class TransitionTable : IDisposable
+    {
+        const string LIBRARY = "vdtransitions";
+        public const int CONTINUE = 0;
+        public const int BACKWARD = 1;
+        public const int LATE = 2;
+
+        [StructLayout(LayoutKind.Sequential)]
+        public struct Entry
+        {
+            public int target;
+            public float cost;
+            public int kind;
+            public float forwardCost;
+        }
+
+        [DllImport(LIBRARY)]
+        static extern IntPtr vdt_load(string cutFile, string validFile, string extraCostsFile, int gateFrame);
+        [DllImport(LIBRARY)]
+        static extern int vdt_load_forward_costs(IntPtr table, int view, string costMatrixFile, int forwardTarget);
+        [DllImport(LIBRARY)]
+        static extern void vdt_free(IntPtr table);
+        [DllImport(LIBRARY)]
+        static extern IntPtr vdt_last_error();
+        [DllImport(LIBRARY)]
+        static extern int vdt_num_frames(IntPtr table);
+        [DllImport(LIBRARY)]
+        static extern int vdt_lookup(IntPtr table, int view, int frame, out Entry entry);
+        [DllImport(LIBRARY)]
+        static extern int vdt_can_jump_forward(IntPtr table, int view, int frame, float threshold);
+
+        IntPtr _table;
+
+        TransitionTable(IntPtr table)
+        {
+            _table = table;
+        }
+
+        // Paths are full paths to .json files or to a results.vdtb bundle.
+        public static TransitionTable Create(string cutFile, string validFile, string extraCostsFile, int gateFrame)
+        {
+            try
+            {
+                IntPtr table = vdt_load(cutFile, validFile, extraCostsFile, gateFrame);
+                if (table == IntPtr.Zero)
+                {
+                    Debug.LogWarning("Unable to build the transition table: " + LastError());
+                    return null;
+                }
+                return new TransitionTable(table);
+            }
+            catch (DllNotFoundException)
+            {
+                return null;
+            }
+            catch (EntryPointNotFoundException)
+            {
+                return null;
+            }
+        }
+
+        static string LastError()
+        {
+            return Marshal.PtrToStringAnsi(vdt_last_error());
+        }
+
+        // Filtered costs of jumping from each frame of the view to forwardTarget, from the view's cost matrix file.
+        public bool LoadForwardCosts(int view, string costMatrixFile, int forwardTarget)
+        {
+            if (vdt_load_forward_costs(_table, view, costMatrixFile, forwardTarget) == 0)
+            {
+                Debug.LogWarning("Unable to load the forward costs of view " + view + ": " + LastError());
+                return false;
+            }
+            return true;
+        }
+
+        public int NumFrames()
+        {
+            return vdt_num_frames(_table);
+        }
+
+        public Entry Lookup(int view, int frame)
+        {
+            Entry entry;
+            vdt_lookup(_table, view, frame, out entry);
+            return entry;
+        }
+
+        public bool CanJumpForward(int view, int frame, float threshold)
+        {
+            return vdt_can_jump_forward(_table, view, frame, threshold) != 0;
+        }
+
+        public void Dispose()
+        {
+            if (_table != IntPtr.Zero)
+            {
+                vdt_free(_table);
+                _table = IntPtr.Zero;
+            }
+            GC.SuppressFinalize(this);
+        }
+
+        ~TransitionTable()
+        {
+            Dispose();
+        }
+    }
+}
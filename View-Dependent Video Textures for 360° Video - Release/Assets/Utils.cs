@@ -194,6 +194,30 @@ namespace RenderHeads.Media.AVProVideo
             return (float[])this.cost_matrix[frame].Get().Clone();
         }
 
+        // Filtered costs of this view from a result bundle (section filtered_{view}).
+        public Tuple<float, float> ReadCostMatrixFromBundle(string bundleFile, int viewNumber)
+        {
+            cost_matrix_file = bundleFile;
+
+            int rows, cols;
+            string actualPath = Path.Combine(Application.dataPath, "StreamingAssets", "Editor", bundleFile);
+            float[] data = ResultBundle.ReadMatrix(actualPath, "filtered_" + viewNumber, out rows, out cols);
+            float minCost = float.MaxValue;
+            float maxCost = float.MinValue;
+            cost_matrix = new CostRow[rows];
+            for (int i = 0; i < rows; i++)
+            {
+                cost_matrix[i] = new CostRow(cols);
+                Array.Copy(data, i * cols, cost_matrix[i].row_costs, 0, cols);
+            }
+            for (int i = 0; i < data.Length; i++)
+            {
+                minCost = Mathf.Min(data[i], minCost);
+                maxCost = Mathf.Max(data[i], maxCost);
+            }
+            return Tuple.Create(minCost, maxCost);
+        }
+
         public Tuple<float, float> ReadCostMatrixFile(string newCostMatrixFile)
         {
             cost_matrix_file = newCostMatrixFile;
@@ -362,6 +386,10 @@ namespace RenderHeads.Media.AVProVideo
         [XmlIgnore]
         public GatedClip _component = null;
 
+        private TransitionTable _transitions = null;  // See BuildTransitionTable.
+        private int _transitionsGateFrame = -1;
+        private int _transitionsForwardTarget = -1;
+
         public static StoryPoint ReadFromXML(XmlNode node, GameObject sphere)
         {
             float targetX = float.Parse(node["targetX"].InnerText, CultureInfo.InvariantCulture.NumberFormat);
@@ -483,6 +511,7 @@ namespace RenderHeads.Media.AVProVideo
         public void InitializeViews()
         {
             views = new View[NUM_VIEWS];  // Resetting views.
+            ResetTransitionTable();
             for (int i = 0; i < views.Length; i++)
             {
                 views[i] = new View();
@@ -490,6 +519,15 @@ namespace RenderHeads.Media.AVProVideo
             if (LoopsFolder != "" && Directory.Exists(LoopsFolder))
             {
                 string[] costMatrixFiles = Directory.GetFiles(LoopsFolder);
+                string bundleFile = Path.Combine(LoopsFolder, ResultBundle.FILE_NAME);
+                if (File.Exists(bundleFile) && ResultBundle.HasSection(bundleFile, "filtered_0"))
+                {
+                    for (int i = 0; i < views.Length; i++)
+                    {
+                        views[i].ReadCostMatrixFromBundle(bundleFile, i);
+                    }
+                    costMatrixFiles = new string[0];
+                }
                 foreach (string costMatrixFile in costMatrixFiles)
                 {
                     if (costMatrixFile.EndsWith("_cost_matrices.xml"))
@@ -507,6 +545,7 @@ namespace RenderHeads.Media.AVProVideo
                 }
                 PopulateBackwardArcs();  // Add loop arcs for rendering on timeline.
             }
+            BuildTransitionTable();
         }
 
         public int MinLoopLengthFrames()
@@ -612,6 +651,64 @@ namespace RenderHeads.Media.AVProVideo
             return _component != null;
         }
 
+        // Native lookup table of the cut (see TransitionTable), built by BuildTransitionTable when the cut files or views are loaded. Null
+        // if it was built for another gate frame or forward target, or without a cut or the plugin; callers then use the lists.
+        public TransitionTable GetTransitionTable(int gateFrame, int forwardTarget)
+        {
+            if (gateFrame != _transitionsGateFrame || forwardTarget != _transitionsForwardTarget)
+            {
+                return null;
+            }
+            return _transitions;
+        }
+
+        // Builds the table for the gate frame (and, with jumpImmediately, the forward costs of every view) off the per-frame path, as it
+        // parses the cut files and cost matrices.
+        public void BuildTransitionTable()
+        {
+            ResetTransitionTable();
+            if (!HasCut() || views == null || _Sphere == null)
+            {
+                return;
+            }
+            float fps = _Sphere.GetComponent<HeadTrack>().GetVideoFps();
+            if (fps <= 0f)
+            {
+                return;
+            }
+            int gateFrame = (int)(gateTime * fps);
+            int forwardTarget = jumpImmediately ? gateFrame - (int)(HeadTrack._LOOP_TRANS_DURATION * fps) : -1;
+            string folder = Path.Combine(Application.dataPath, "StreamingAssets", "Editor");
+            _transitions = TransitionTable.Create(Path.Combine(folder, cutFile), Path.Combine(folder, validArcFile), Path.Combine(folder, extraCostsFile), gateFrame);
+            if (_transitions == null)
+            {
+                return;
+            }
+            _transitionsGateFrame = gateFrame;
+            _transitionsForwardTarget = forwardTarget;
+            if (forwardTarget >= 0)
+            {
+                for (int v = 0; v < views.Length; v++)
+                {
+                    if (views[v].cost_matrix != null)
+                    {
+                        _transitions.LoadForwardCosts(v, Path.Combine(folder, views[v].cost_matrix_file), forwardTarget);
+                    }
+                }
+            }
+        }
+
+        private void ResetTransitionTable()
+        {
+            if (_transitions != null)
+            {
+                _transitions.Dispose();
+                _transitions = null;
+            }
+            _transitionsGateFrame = -1;
+            _transitionsForwardTarget = -1;
+        }
+
         public void ReadEdgeCostFile(string newEdgeFile)
         {
             if (newEdgeFile == this.edgeCostMatrixFile)
@@ -625,6 +722,19 @@ namespace RenderHeads.Media.AVProVideo
             string[] cost_matrix_str;
             int rows, cols;
             string actualPath = Path.Combine(Application.dataPath, "StreamingAssets", "Editor", edgeCostMatrixFile);
+            if (ResultBundle.IsBundle(actualPath))
+            {
+                float[] data = ResultBundle.ReadMatrix(actualPath, "edgeCosts", out rows, out cols);
+                edgeCosts = new List<EdgeCostRow>();
+                for (int i = 0; i < rows; i++)
+                {
+                    EdgeCostRow edgeCostRow = new EdgeCostRow();
+                    edgeCostRow.row = new float[cols];
+                    Array.Copy(data, i * cols, edgeCostRow.row, 0, cols);
+                    edgeCosts.Add(edgeCostRow);
+                }
+                return;
+            }
             doc.Load(actualPath);
             foreach (XmlNode node in doc.DocumentElement.ChildNodes)
             {
@@ -671,10 +781,17 @@ namespace RenderHeads.Media.AVProVideo
             
             List<List<int>> rawData;
             string actualPath = Path.Combine(Application.dataPath, "StreamingAssets", "Editor", newAllArcsFile);
-            using (StreamReader r = new StreamReader(actualPath))
+            if (ResultBundle.IsBundle(actualPath))
             {
-                string json = r.ReadToEnd();
-                rawData = JsonConvert.DeserializeObject<List<List<int>>>(json);
+                rawData = ResultBundle.ReadIntLists(actualPath, "allArcs");
+            }
+            else
+            {
+                using (StreamReader r = new StreamReader(actualPath))
+                {
+                    string json = r.ReadToEnd();
+                    rawData = JsonConvert.DeserializeObject<List<List<int>>>(json);
+                }
             }
 
             int count = 0;
@@ -698,13 +815,21 @@ namespace RenderHeads.Media.AVProVideo
             }
             Debug.Log("New valid arc file: " + validArcFile);
             this.validArcFile = validArcFile;
+            ResetTransitionTable();
 
             List<List<int>> rawValidArcs;
             string actualPath = Path.Combine(Application.dataPath, "StreamingAssets", "Editor", validArcFile);
-            using (StreamReader r = new StreamReader(actualPath))
+            if (ResultBundle.IsBundle(actualPath))
+            {
+                rawValidArcs = ResultBundle.ReadIntLists(actualPath, "valid");
+            }
+            else
             {
-                string json = r.ReadToEnd();
-                rawValidArcs = JsonConvert.DeserializeObject<List<List<int>>>(json);
+                using (StreamReader r = new StreamReader(actualPath))
+                {
+                    string json = r.ReadToEnd();
+                    rawValidArcs = JsonConvert.DeserializeObject<List<List<int>>>(json);
+                }
             }
 
             int count = 0;
@@ -717,6 +842,10 @@ namespace RenderHeads.Media.AVProVideo
                 count++;
             }
             validArcs = items;
+            if (views != null)
+            {
+                BuildTransitionTable();
+            }
         }
 
         public void ReadExtraCostsFile(string extraCostsFile)
@@ -727,13 +856,21 @@ namespace RenderHeads.Media.AVProVideo
             }
             Debug.Log("New extra costs file: " + extraCostsFile);
             this.extraCostsFile = extraCostsFile;
+            ResetTransitionTable();
             
             List<List<float>> rawExtraCosts;
             string actualPath = Path.Combine(Application.dataPath, "StreamingAssets", "Editor", extraCostsFile);
-            using (StreamReader r = new StreamReader(actualPath))
+            if (ResultBundle.IsBundle(actualPath))
             {
-                string json = r.ReadToEnd();
-                rawExtraCosts = JsonConvert.DeserializeObject<List<List<float>>>(json);
+                rawExtraCosts = ResultBundle.ReadFloatLists(actualPath, "extraCosts");
+            }
+            else
+            {
+                using (StreamReader r = new StreamReader(actualPath))
+                {
+                    string json = r.ReadToEnd();
+                    rawExtraCosts = JsonConvert.DeserializeObject<List<List<float>>>(json);
+                }
             }
 
             int count = 0;
@@ -746,6 +883,10 @@ namespace RenderHeads.Media.AVProVideo
                 count++;
             }
             extraCosts = items;
+            if (views != null)
+            {
+                BuildTransitionTable();
+            }
         }
 
         public void ReadCutFile(string cutFile)
@@ -756,13 +897,21 @@ namespace RenderHeads.Media.AVProVideo
             }
             Debug.Log("New cut file: " + cutFile);
             this.cutFile = cutFile;
+            ResetTransitionTable();
 
             List<List<int>> rawCut;
             string actualPath = Path.Combine(Application.dataPath, "StreamingAssets", "Editor", cutFile);
-            using (StreamReader r = new StreamReader(actualPath))
+            if (ResultBundle.IsBundle(actualPath))
             {
-                string json = r.ReadToEnd();
-                 rawCut = JsonConvert.DeserializeObject<List<List<int>>>(json);
+                rawCut = ResultBundle.ReadIntLists(actualPath, "cut");
+            }
+            else
+            {
+                using (StreamReader r = new StreamReader(actualPath))
+                {
+                    string json = r.ReadToEnd();
+                     rawCut = JsonConvert.DeserializeObject<List<List<int>>>(json);
+                }
             }
 
             int count = 0;
@@ -782,6 +931,10 @@ namespace RenderHeads.Media.AVProVideo
             {
                 ComputeCutTimeBlocks(v);
             }
+            if (views != null)
+            {
+                BuildTransitionTable();
+            }
         }
 
         public void PopulateBackwardArcs()
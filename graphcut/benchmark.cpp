@@ -0,0 +1,325 @@
+// Benchmark of the graph-cut pipeline on synthetic cost matrices, so the C++ side can be measured without running the preprocessing
+// first. Times each stage of viewdeptextures.cpp separately, on one thread, for every (frames, views) configuration and writes the
+// results as JSON (see --output).
+//
+// Compile like viewdeptextures.cpp, e.g.:
+//   g++ benchmark.cpp graph.cpp maxflow.cpp `pkg-config --cflags --libs opencv` -lcnpy -lz -l boost_program_options -l boost_system -lboost_filesystem -lpthread -o benchmark --std=c++17 -O3
+#define VIEWDEP_NO_MAIN
+#include "viewdeptextures.cpp"
+#include <random>
+
+// Deterministic hash of a frame pair of a view, so any band of rows of a matrix can be generated on its own and stays symmetric.
+uint64_t PairHash(uint64_t view, uint64_t i, uint64_t j) {
+  uint64_t x = view * 0x9E3779B97F4A7C15ULL + min(i, j) * 0xBF58476D1CE4E5B9ULL + max(i, j) * 0x94D049BB133111EBULL;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+// The first rows of a symmetric numFrames x numFrames cost matrix for one view. Frame pairs whose distance is a multiple of the view's
+// loop period (period + 2 * (view % 5)) cost up to loopCost, so there are good backward arcs; everything else costs noiseCost on
+// average. The diagonal is 0.
+Mat SyntheticCostMatrix(int view, int rows, int numFrames, int period, float loopCost, float noiseCost) {
+  Mat m(rows, numFrames, CV_32FC1);
+  int viewPeriod = period + 2 * (view % 5);
+  for (int r = 0; r < rows; r++) {
+    float* row = m.ptr<float>(r);
+    for (int c = 0; c < numFrames; c++) {
+      double u = (PairHash(view, r, c) >> 11) * (1.0 / 9007199254740992.0);  // Uniform in [0, 1).
+      if (r == c) {
+        row[c] = 0;
+      }
+      else if (abs(r - c) % viewPeriod == 0) {
+        row[c] = (float)(u * loopCost);
+      }
+      else {
+        row[c] = (float)((0.5 + u) * noiseCost);
+      }
+    }
+  }
+  return m;
+}
+
+// Wall times of one stage over the repeats.
+struct StageTimes {
+  vector<double> ms;
+
+  void Add(double x) {
+    ms.push_back(x);
+  }
+
+  json ToJson() const {
+    vector<double> sorted = ms;
+    sort(sorted.begin(), sorted.end());
+    return {{"minMs", sorted.front()}, {"medianMs", sorted[sorted.size() / 2]}, {"maxMs", sorted.back()}};
+  }
+};
+
+template <typename F> double TimeMs(F f) {
+  auto start = chrono::steady_clock::now();
+  f();
+  return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+vector<int> ParseList(string s) {
+  vector<int> values;
+  stringstream stream(s);
+  string item;
+  while (getline(stream, item, ',')) {
+    values.push_back(stoi(item));
+  }
+  return values;
+}
+
+// Options of viewdeptextures for one configuration. The ROI covers the same fraction of the yaw views as the default 4..13 of 40.
+variables_map BenchmarkOptions(variables_map vm, int numFrames, int numViews, string outputDir) {
+  int gateFrame = (int)(numFrames * vm["gateFraction"].as<double>());
+  gateFrame = max(1, min(gateFrame, numFrames - 2));
+  int numYaw = numViews / max(1, vm["pitchViews"].as<int>());
+  SetOption(&vm, "gateFrame", gateFrame);
+  SetOption(&vm, "ROIstart", 4 * numYaw / 40);
+  SetOption(&vm, "ROIend", 13 * numYaw / 40);
+  SetOption(&vm, "offscreen", false);
+  SetOption(&vm, "outputDir", outputDir);
+  SetOption(&vm, "writeCosts", false);
+  return vm;
+}
+
+// One configuration: generate, then time every stage repeats times. Matrices are generated for the rows used with --gateRowsOnly (the
+// gate rows plus the rows the filter reads past them); the npy load is timed on loadSamples full matrices and scaled to all views.
+json RunConfiguration(variables_map vm, int numFrames, int numViews) {
+  path outputDir = path(vm["workDir"].as<string>()) / ("f" + to_string(numFrames) + "_v" + to_string(numViews));
+  create_directories(outputDir);
+  vm = BenchmarkOptions(vm, numFrames, numViews, outputDir.string());
+  int gateFrame = vm["gateFrame"].as<int>();
+  int loopDuration = vm["loopDuration"].as<int>();
+  int minLength = vm["minLength"].as<int>();
+  int outputRows = gateFrame + 1;
+  int loadRows = min(numFrames, outputRows + max(loopDuration, 1) - 1);
+  float loopCost = vm["loopCost"].as<float>();
+  float noiseCost = vm["noiseCost"].as<float>();
+  float perceptualThreshold = vm.count("perceptualThreshold") ? vm["perceptualThreshold"].as<float>() : 2 * loopCost * max(loopDuration, 1);
+  int period = vm["loopPeriod"].as<int>();
+  int repeats = max(1, vm["repeats"].as<int>());
+  costmatrix::Encoding encoding;
+  costmatrix::ParseEncoding(vm["costEncoding"].as<string>(), &encoding);  // Checked by main.
+
+  json result = {{"frames", numFrames}, {"views", numViews}, {"pitchViews", max(1, vm["pitchViews"].as<int>())}, {"gateFrame", gateFrame}, {"rows", loadRows}, {"perceptualThreshold", perceptualThreshold}};
+  double bytes = (double)numViews * loadRows * numFrames * sizeof(float);
+  if (bytes > vm["maxBytes"].as<double>()) {
+    result["skipped"] = "cost matrices need " + to_string((long)(bytes / 1e6)) + " MB, over --maxBytes";
+    return result;
+  }
+  if (numViews % max(1, vm["pitchViews"].as<int>()) != 0) {
+    result["skipped"] = "views do not form a grid of --pitchViews rows";
+    return result;
+  }
+
+  vector<Mat> generated(numViews);
+  double generateMs = TimeMs([&]() {
+    for (int v = 0; v < numViews; v++) {
+      generated[v] = SyntheticCostMatrix(v, loadRows, numFrames, period, loopCost, noiseCost);
+    }
+  });
+  result["generateMs"] = generateMs;
+
+  // Full matrices on disk for the load stage.
+  int loadSamples = max(1, min(numViews, vm["loadSamples"].as<int>()));
+  vector<string> samplePaths;
+  for (int v = 0; v < loadSamples; v++) {
+    Mat full = SyntheticCostMatrix(v, numFrames, numFrames, period, loopCost, noiseCost);
+    samplePaths.push_back((outputDir / ("cost_" + to_string(v) + ".npy")).string());
+    npy_save(samplePaths.back(), full.ptr<float>(0), {(size_t)numFrames, (size_t)numFrames});
+  }
+
+  map<string, StageTimes> stages;
+  int numNodes = 0;
+  int numEdges = 0;
+  float totalCost = 0;
+  int numCuts = 0;
+  double costBytes = 0;
+  for (int rep = 0; rep < repeats; rep++) {
+    double loadMs = 0;
+    for (const string& p : samplePaths) {
+      loadMs += TimeMs([&]() {
+        Mat mat = convertDataToMat(ReadCostMatrix(p), "");
+        mat = mat.rowRange(0, loadRows).clone();
+      });
+    }
+    stages["npyLoad"].Add(loadMs / loadSamples * numViews);
+
+    vector<Mat> filtered(numViews);
+    stages["convolveGaussianKernel"].Add(TimeMs([&]() {
+      for (int v = 0; v < numViews; v++) {
+        filtered[v] = generated[v].clone();
+        FilterCostMatrix(&filtered[v], loopDuration, vm["checkSymmetry"].as<bool>(), false);
+        filtered[v] = filtered[v].rowRange(0, outputRows);
+      }
+    }));
+
+    vector<ArcIndex> arcIndices(numViews);
+    stages["BuildArcIndex"].Add(TimeMs([&]() {
+      for (int v = 0; v < numViews; v++) {
+        arcIndices[v] = BuildArcIndex(filtered[v]);
+      }
+    }));
+
+    vector<CostMatrix> costMatrices(numViews);
+    stages["packCostMatrices"].Add(TimeMs([&]() {
+      for (int v = 0; v < numViews; v++) {
+        costMatrices[v] = CostMatrix(filtered[v].ptr<float>(0), filtered[v].step, filtered[v].rows, filtered[v].cols, encoding);
+      }
+    }));
+    filtered.clear();
+    costBytes = 0;
+    for (const CostMatrix& m : costMatrices) {
+      costBytes += m.Bytes();
+    }
+
+    vector<vector<int>> bestArcs;
+    vector<vector<int>> allArcs;
+    stages["FindValidArcs"].Add(TimeMs([&]() {
+      for (int v = 0; v < numViews; v++) {
+        vector<int> allArcsInView;
+        bestArcs.push_back(FindValidArcs(arcIndices[v], perceptualThreshold, minLength, &allArcsInView));
+        allArcs.push_back(allArcsInView);
+      }
+    }));
+
+    GraphType* g = NULL;
+    Mat edgeCosts;
+    stages["SetupGraph"].Add(TimeMs([&]() {
+      g = NewGraph<GraphType>(numViews, vm);
+      edgeCosts = SetupGraph(g, bestArcs, allArcs, costMatrices, gateFrame, vm);
+    }));
+    stages["UpdateEdgeCosts"].Add(TimeMs([&]() {
+      UpdateEdgeCosts(&edgeCosts, vm);
+    }));
+    stages["AssignEdgeCosts"].Add(TimeMs([&]() {
+      AssignEdgeCosts(g, bestArcs, gateFrame, edgeCosts);
+    }));
+    stages["maxflow"].Add(TimeMs([&]() {
+      g->maxflow();
+    }));
+    vector<vector<int>> cut;
+    stages["findCut"].Add(TimeMs([&]() {
+      cut = findCut(g, edgeCosts, bestArcs, allArcs, costMatrices, &totalCost);
+    }));
+    numNodes = g->get_node_num();
+    numEdges = g->get_arc_num() / 2;
+    delete g;
+
+    vector<vector<int>> validArcs;
+    vector<vector<float>> extraCosts;
+    stages["GetValidArcsFromCut"].Add(TimeMs([&]() {
+      GetValidArcsFromCut(cut, allArcs, costMatrices, arcIndices, &validArcs, &extraCosts, perceptualThreshold);
+    }));
+
+    SetOption(&vm, "outputFormat", string("json"));
+    stages["writeResultsJson"].Add(TimeMs([&]() {
+      writeResults(edgeCosts, cut, validArcs, extraCosts, allArcs, costMatrices, vm);
+    }));
+    SetOption(&vm, "outputFormat", string("binary"));
+    stages["writeResultsBinary"].Add(TimeMs([&]() {
+      writeResults(edgeCosts, cut, validArcs, extraCosts, allArcs, costMatrices, vm);
+    }));
+
+    numCuts = 0;
+    for (auto& c : cut) {
+      numCuts += c.size();
+    }
+  }
+
+  for (const string& p : samplePaths) {
+    remove(p);
+  }
+
+  json stagesJson = json::object();
+  double totalMs = 0;
+  for (auto& stage : stages) {
+    stagesJson[stage.first] = stage.second.ToJson();
+    totalMs += stage.second.ToJson()["medianMs"].get<double>();
+  }
+  result["stages"] = stagesJson;
+  result["totalMedianMs"] = totalMs;
+  result["graphNodes"] = numNodes;
+  result["graphEdges"] = numEdges;
+  result["totalCost"] = totalCost;
+  result["cutEdges"] = numCuts;
+  result["costMatrixBytes"] = costBytes;
+  result["peakRssKB"] = PeakRssKB();
+  return result;
+}
+
+int main(int argc, char **argv)
+{
+  options_description desc("Allowed options");
+  desc.add_options()
+  ("help", "Print help message.")
+  ("frames", value<string>()->default_value("200,500,1000,2000,5000"), "Comma-separated frame counts.")
+  ("views", value<string>()->default_value("40,80,160"), "Comma-separated view counts.")
+  ("repeats", value<int>()->default_value(3), "Number of times each stage is timed.")
+  ("output,o", value<string>()->default_value("benchmark.json"), "JSON file the results are written to.")
+  ("workDir", value<string>()->default_value("benchmark_out"), "Directory for the sample .npy files and the written results.")
+  ("loadSamples", value<int>()->default_value(2), "Number of full cost matrices written and read back to time the npy load (scaled to all views).")
+  ("maxBytes", value<double>()->default_value(8e9), "Configurations whose cost matrices need more bytes than this are skipped.")
+  ("gateFraction", value<double>()->default_value(0.5), "Gate frame as a fraction of the number of frames.")
+  ("loopPeriod", value<int>()->default_value(60), "Base period (in frames) of the low-cost backward arcs.")
+  ("loopCost", value<float>()->default_value(100), "Maximum per-frame cost of a frame pair on a loop.")
+  ("noiseCost", value<float>()->default_value(5000), "Average per-frame cost of other frame pairs.")
+  ("perceptualThreshold", value<float>(), "Perceptual threshold. Defaults to 2 * loopCost * loopDuration.")
+  ("loopDuration", value<int>()->default_value(15), "Length of loop in number of frames.")
+  ("minLength", value<int>()->default_value(30), "Minimum length of loop in number of frames.")
+  ("neighbourRadius", value<int>()->default_value(2), "Number of adjacent views on each side, along yaw and along pitch, that a view is tied to in the graph (1 to 4).")
+  ("pitchViews", value<int>()->default_value(1), "Number of pitch rows the views are arranged in (see ViewGrid).")
+  ("checkSymmetry", value<bool>()->default_value(true), "Whether or not to check that each cost matrix is symmetric before filtering.")
+  ("costEncoding", value<string>()->default_value("float32"), "How the filtered cost matrices are kept in memory: float32, float16 or uint16 (see costmatrix.h).")
+  ;
+
+  variables_map vm;
+  store(parse_command_line(argc, argv, desc), vm);
+  notify(vm);
+
+  if (vm.count("help")) {
+    cout << desc << "\n";
+    return 1;
+  }
+
+  costmatrix::Encoding encoding;
+  if (!costmatrix::ParseEncoding(vm["costEncoding"].as<string>(), &encoding)) {
+    cout << "Unknown cost encoding " << vm["costEncoding"].as<string>() << ". Use float32, float16 or uint16. Exiting." << "\n";
+    return 1;
+  }
+
+  json results = json::array();
+  for (int numFrames : ParseList(vm["frames"].as<string>())) {
+    for (int numViews : ParseList(vm["views"].as<string>())) {
+      json result = RunConfiguration(vm, numFrames, numViews);
+      results.push_back(result);
+
+      std::ofstream o(vm["output"].as<string>());
+      o << std::setw(4) << json{{"configurations", results}} << endl;
+    }
+  }
+
+  // Summary table of the median times.
+  cout << endl << "frames\tviews\ttotal ms\tslowest stage" << endl;
+  for (const json& result : results) {
+    cout << result["frames"] << "\t" << result["views"] << "\t";
+    if (result.count("skipped")) {
+      cout << "skipped: " << result["skipped"].get<string>() << endl;
+      continue;
+    }
+    string slowest;
+    double slowestMs = -1;
+    for (auto& stage : result["stages"].items()) {
+      if (stage.value()["medianMs"].get<double>() > slowestMs) {
+        slowestMs = stage.value()["medianMs"].get<double>();
+        slowest = stage.key();
+      }
+    }
+    cout << result["totalMedianMs"].get<double>() << "\t" << slowest << " (" << slowestMs << " ms)" << endl;
+  }
+  cout << "Wrote " << vm["output"].as<string>() << endl;
+  return 0;
+}
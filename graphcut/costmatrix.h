@@ -0,0 +1,388 @@
+// Compact storage of the symmetric per-view cost matrices, in memory (CostMatrix, see --costEncoding of viewdeptextures) and on disk
+// (.vdcm files, written by preprocess.py with --costEncoding). Entries are float32, float16 or uint16 codes with a per-matrix scale
+// (value = code * scale); both 16-bit encodings record the largest error they introduced.
+//
+// File layout: CostMatrixHeader, then the upper triangle of the size x size matrix row by row at dataOffset (row r holds columns
+// r..size-1). Little-endian; the data starts on a 64-byte boundary, so the first rows of a matrix are a prefix of the file.
+#ifndef COSTMATRIX_H
+#define COSTMATRIX_H
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace costmatrix {
+
+const char MAGIC[4] = {'V', 'D', 'C', 'M'};
+const uint32_t VERSION = 1;
+const uint64_t ALIGNMENT = 64;
+const float FLOAT16_MAX = 65504;
+
+enum Encoding : uint32_t {
+  FLOAT32 = 0,
+  FLOAT16 = 1,
+  UINT16 = 2
+};
+
+struct CostMatrixHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t encoding;
+  uint32_t size;
+  float scale;  // UINT16 only.
+  float maxError;  // Largest |stored - original| over all entries.
+  uint64_t dataOffset;
+  uint8_t reserved[32];
+};
+
+static_assert(sizeof(CostMatrixHeader) == 64, "CostMatrixHeader must match the file layout.");
+
+inline bool ParseEncoding(const std::string& name, Encoding* encoding) {
+  if (name == "float32") {
+    *encoding = FLOAT32;
+  }
+  else if (name == "float16") {
+    *encoding = FLOAT16;
+  }
+  else if (name == "uint16") {
+    *encoding = UINT16;
+  }
+  else {
+    return false;
+  }
+  return true;
+}
+
+inline const char* EncodingName(Encoding encoding) {
+  return encoding == FLOAT32 ? "float32" : encoding == FLOAT16 ? "float16" : "uint16";
+}
+
+// IEEE half precision, rounding to nearest even like numpy's float16. Values of 65520 and above become infinity.
+inline uint16_t FloatToHalf(float value) {
+  uint32_t f;
+  memcpy(&f, &value, 4);
+  uint32_t sign = (f >> 16) & 0x8000;
+  f &= 0x7FFFFFFF;
+  if (f > 0x7F800000) {
+    return sign | 0x7E00;  // NaN.
+  }
+  if (f >= 0x477FF000) {
+    return sign | 0x7C00;
+  }
+  if (f < 0x38800000) {  // Subnormal in half precision: units of 2^-24.
+    if (f <= 0x33000000) {
+      return sign;
+    }
+    uint32_t mantissa = (f & 0x7FFFFF) | 0x800000;
+    int shift = 126 - (int)(f >> 23);
+    uint32_t half = mantissa >> shift;
+    uint32_t rest = mantissa & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (half & 1))) {
+      half++;
+    }
+    return sign | half;
+  }
+  uint32_t half = (f >> 13) - ((127 - 15) << 10);
+  uint32_t rest = f & 0x1FFF;
+  if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+    half++;  // May carry into the exponent, which is still correct.
+  }
+  return sign | half;
+}
+
+inline float HalfToFloat(uint16_t h) {
+  uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  uint32_t exponent = (h >> 10) & 0x1F;
+  uint32_t mantissa = h & 0x3FF;
+  if (exponent == 0) {
+    float v = mantissa * (1.0f / 16777216.0f);
+    return sign ? -v : v;
+  }
+  uint32_t f = sign | (exponent == 0x1F ? 0x7F800000 | (mantissa << 13) : ((exponent + 112) << 23) | (mantissa << 13));
+  float v;
+  memcpy(&v, &f, 4);
+  return v;
+}
+
+// Encodes runs of values in one encoding and keeps track of the largest error. For UINT16, maxValue sets the scale; costs are
+// non-negative.
+class Encoder {
+public:
+  Encoder(Encoding encoding, float maxValue) : encoding(encoding), scale(1), maxError(0) {
+    if (encoding == UINT16 && maxValue > 0) {
+      scale = maxValue / 65535;
+    }
+    if (encoding == FLOAT16 && maxValue > FLOAT16_MAX) {
+      throw std::runtime_error("Costs up to " + std::to_string(maxValue) + " do not fit in float16; use uint16.");
+    }
+  }
+
+  void Encode(const float* values, size_t n, float* out) {
+    memcpy(out, values, n * sizeof(float));
+  }
+
+  void Encode(const float* values, size_t n, uint16_t* out) {
+    for (size_t i = 0; i < n; i++) {
+      if (encoding == FLOAT16) {
+        out[i] = FloatToHalf(values[i]);
+      }
+      else {
+        assert(values[i] >= 0);
+        out[i] = (uint16_t)std::min(65535.0f, roundf(values[i] / scale));
+      }
+      maxError = std::max(maxError, fabsf(Decode(out[i]) - values[i]));
+    }
+  }
+
+  float Decode(uint16_t code) const {
+    return encoding == FLOAT16 ? HalfToFloat(code) : code * scale;
+  }
+
+  Encoding encoding;
+  float scale;
+  float maxError;
+};
+
+// The part of a symmetric matrix the graph cut reads, packed: rows [0, rows) of a rows x cols matrix (rows <= cols, e.g. with
+// --gateRowsOnly), row r holding columns 0..r and rows..cols-1. The columns in between are mirrored from the later rows, so an
+// entry (r, c) is available whenever r or c is below rows. Backward arcs (c <= r), which is what arc selection and the extra costs
+// read, are stored as given.
+class CostMatrix {
+public:
+  CostMatrix() : rows(0), cols(0), encoding(FLOAT32), scale(1), maxError(0) {
+  }
+
+  // step is the distance between rows in bytes (e.g. Mat::step).
+  CostMatrix(const float* data, size_t step, int rows, int cols, Encoding encoding) : rows(rows), cols(cols), encoding(encoding), scale(1), maxError(0) {
+    assert(rows <= cols);
+    float maxValue = 0;
+    for (int r = 0; r < rows; r++) {
+      const float* row = (const float*)((const char*)data + r * step);
+      maxValue = std::max(maxValue, *std::max_element(row, row + cols));
+    }
+    Encoder encoder(encoding, maxValue);
+    if (encoding == FLOAT32) {
+      values32.resize(Offset(rows));
+    }
+    else {
+      values16.resize(Offset(rows));
+    }
+    for (int r = 0; r < rows; r++) {
+      const float* row = (const float*)((const char*)data + r * step);
+      size_t offset = Offset(r);
+      if (encoding == FLOAT32) {
+        encoder.Encode(row, r + 1, &values32[offset]);
+        encoder.Encode(row + rows, cols - rows, &values32[offset + r + 1]);
+      }
+      else {
+        encoder.Encode(row, r + 1, &values16[offset]);
+        encoder.Encode(row + rows, cols - rows, &values16[offset + r + 1]);
+      }
+    }
+    scale = encoder.scale;
+    maxError = encoder.maxError;
+  }
+
+  int Rows() const {
+    return rows;
+  }
+
+  int Cols() const {
+    return cols;
+  }
+
+  Encoding GetEncoding() const {
+    return encoding;
+  }
+
+  float MaxError() const {
+    return maxError;
+  }
+
+  size_t Bytes() const {
+    return values32.size() * sizeof(float) + values16.size() * sizeof(uint16_t);
+  }
+
+  float at(int r, int c) const {
+    if (c > r && c < rows) {
+      std::swap(r, c);
+    }
+    assert(r < rows && c < cols);
+    size_t i = Offset(r) + (c <= r ? c : c - rows + r + 1);
+    return encoding == FLOAT32 ? values32[i] : Decode(values16[i]);
+  }
+
+  // Row r, all cols columns.
+  void Row(int r, float* out) const {
+    for (int c = 0; c < cols; c++) {
+      out[c] = at(r, c);
+    }
+  }
+
+private:
+  int rows;
+  int cols;
+  Encoding encoding;
+  float scale;
+  float maxError;
+  std::vector<float> values32;
+  std::vector<uint16_t> values16;
+
+  size_t Offset(int r) const {
+    return (size_t)r * (r + 1) / 2 + (size_t)r * (cols - rows);
+  }
+
+  float Decode(uint16_t code) const {
+    return encoding == FLOAT16 ? HalfToFloat(code) : code * scale;
+  }
+};
+
+inline size_t UpperOffset(size_t size, size_t r) {
+  return r * size - r * (r - 1) / 2;
+}
+
+// Writes a full symmetric size x size matrix (row-major, step bytes between rows). Only the upper triangle is read.
+inline void WriteCostMatrixFile(const std::string& filename, const float* data, size_t step, int size, Encoding encoding) {
+  float maxValue = 0;
+  for (int r = 0; r < size; r++) {
+    const float* row = (const float*)((const char*)data + r * step);
+    maxValue = std::max(maxValue, *std::max_element(row + r, row + size));
+  }
+  Encoder encoder(encoding, maxValue);
+  CostMatrixHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MAGIC, 4);
+  header.version = VERSION;
+  header.encoding = encoding;
+  header.size = size;
+  header.scale = encoder.scale;
+  header.dataOffset = ALIGNMENT;
+
+  std::ofstream o(filename, std::ios::binary);
+  if (!o) {
+    throw std::runtime_error("WriteCostMatrixFile: Unable to open " + filename);
+  }
+  o.write((const char*)&header, sizeof(header));
+  std::vector<float> values32(size);
+  std::vector<uint16_t> values16(size);
+  for (int r = 0; r < size; r++) {
+    const float* row = (const float*)((const char*)data + r * step);
+    if (encoding == FLOAT32) {
+      encoder.Encode(row + r, size - r, values32.data());
+      o.write((const char*)values32.data(), (size - r) * sizeof(float));
+    }
+    else {
+      encoder.Encode(row + r, size - r, values16.data());
+      o.write((const char*)values16.data(), (size - r) * sizeof(uint16_t));
+    }
+  }
+  header.maxError = encoder.maxError;
+  o.seekp(0);
+  o.write((const char*)&header, sizeof(header));
+  o.close();
+  if (!o) {
+    throw std::runtime_error("WriteCostMatrixFile: Failed writing " + filename);
+  }
+}
+
+// Maps a .vdcm file read-only.
+class CostMatrixFile {
+public:
+  explicit CostMatrixFile(const std::string& filename) : addr(NULL), length(0) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("CostMatrixFile: Unable to open " + filename);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      throw std::runtime_error("CostMatrixFile: Unable to stat " + filename);
+    }
+    if ((size_t)st.st_size < sizeof(CostMatrixHeader)) {
+      close(fd);
+      throw std::runtime_error("CostMatrixFile: Not a version " + std::to_string(VERSION) + " cost matrix: " + filename);
+    }
+    length = st.st_size;
+    addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+      addr = NULL;
+      throw std::runtime_error("CostMatrixFile: Unable to map " + filename);
+    }
+
+    header = *(const CostMatrixHeader*)addr;
+    if (memcmp(header.magic, MAGIC, 4) != 0 || header.version != VERSION || header.encoding > UINT16) {
+      Unmap();
+      throw std::runtime_error("CostMatrixFile: Not a version " + std::to_string(VERSION) + " cost matrix: " + filename);
+    }
+    size_t elementSize = header.encoding == FLOAT32 ? sizeof(float) : sizeof(uint16_t);
+    if (header.dataOffset + UpperOffset(header.size, header.size) * elementSize > length) {
+      Unmap();
+      throw std::runtime_error("CostMatrixFile: Truncated cost matrix: " + filename);
+    }
+  }
+
+  ~CostMatrixFile() {
+    Unmap();
+  }
+
+  CostMatrixFile(const CostMatrixFile&) = delete;
+  CostMatrixFile& operator=(const CostMatrixFile&) = delete;
+
+  const CostMatrixHeader& Header() const {
+    return header;
+  }
+
+  int Size() const {
+    return header.size;
+  }
+
+  // Rows [0, rows) of the full matrix into out (step bytes between rows). Only touches the first rows of the file.
+  void ReadRows(int rows, float* out, size_t step) const {
+    assert(rows <= (int)header.size);
+    const char* data = (const char*)addr + header.dataOffset;
+    for (int r = 0; r < rows; r++) {
+      float* row = (float*)((char*)out + r * step);
+      for (int c = 0; c < r; c++) {
+        row[c] = ((const float*)((const char*)out + c * step))[r];
+      }
+      size_t offset = UpperOffset(header.size, r);
+      for (int c = r; c < (int)header.size; c++) {
+        if (header.encoding == FLOAT32) {
+          row[c] = ((const float*)data)[offset + c - r];
+        }
+        else {
+          uint16_t code = ((const uint16_t*)data)[offset + c - r];
+          row[c] = header.encoding == FLOAT16 ? HalfToFloat(code) : code * header.scale;
+        }
+      }
+    }
+  }
+
+private:
+  void* addr;
+  size_t length;
+  CostMatrixHeader header;
+
+  void Unmap() {
+    if (addr != NULL) {
+      munmap(addr, length);
+      addr = NULL;
+    }
+  }
+};
+
+}  // namespace costmatrix
+
+#endif
@@ -0,0 +1,575 @@
+// Maxflow engines besides Graph<float,float,float> (see --maxflowEngine). Each one offers the part of the maxflow-v3.01 Graph interface
+// that graph construction and findCut use: add_node, add_tweights, add_edge, maxflow, what_segment, get_node_num and get_arc_num.
+#ifndef MAXFLOWENGINES_H
+#define MAXFLOWENGINES_H
+
+#include <vector>
+#include <float.h>
+#include <math.h>
+#include <assert.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "graph.h"
+
+// BK on 32-bit integer capacities. Finite capacities are multiplied by a scale and rounded; infinite ones (FLT_MAX) map to INF.
+// Call set_cut_bound with an upper bound on the min cut before adding finite capacities: capacities above it can never be in a
+// min cut, so they are clamped to just above it, and the scale uses the full integer range below INF.
+// Each finite capacity is off by at most 0.5 / scale, so the cut found costs at most (number of cut edges) / scale more than the
+// optimum of the float graph.
+class QuantizedGraph {
+public:
+  typedef Graph<int,int,int> IntGraph;
+  typedef IntGraph::node_id node_id;
+  typedef IntGraph::termtype termtype;
+
+  static const int INF = 1 << 30;
+
+  QuantizedGraph(int nodeNumMax, int edgeNumMax) : g(nodeNumMax, edgeNumMax), scale(0), clamp(0) {
+  }
+
+  void set_cut_bound(float bound) {
+    assert(bound < FLT_MAX);
+    scale = (INF / 4) / (double)std::max(bound, 1.0f);
+    clamp = (INF / 2) / scale;
+  }
+
+  double get_scale() {
+    return scale;
+  }
+
+  node_id add_node(int num = 1) {
+    return g.add_node(num);
+  }
+
+  void add_tweights(node_id i, float capSource, float capSink) {
+    g.add_tweights(i, Quantize(capSource), Quantize(capSink));
+  }
+
+  void add_edge(node_id i, node_id j, float cap, float revCap) {
+    g.add_edge(i, j, Quantize(cap), Quantize(revCap));
+  }
+
+  float maxflow() {
+    return g.maxflow() / scale;
+  }
+
+  termtype what_segment(node_id i) {
+    return g.what_segment(i);
+  }
+
+  int get_node_num() {
+    return g.get_node_num();
+  }
+
+  int get_arc_num() {
+    return g.get_arc_num();
+  }
+
+private:
+  IntGraph g;
+  double scale;
+  double clamp;  // Largest finite capacity kept, before scaling.
+
+  int Quantize(float cap) {
+    if (cap >= FLT_MAX) {
+      return INF;
+    }
+    if (cap == 0) {
+      return 0;
+    }
+    assert(scale > 0);  // set_cut_bound comes before finite capacities.
+    return (int)lround(std::min((double)cap, clamp) * scale);
+  }
+};
+
+// Push-relabel (highest label first, with periodic global relabeling). Edges are collected first and laid out as compressed
+// adjacency arrays in maxflow, so every node's arcs are contiguous. Only the first phase runs (a maximum preflow), which is enough
+// for the min cut: the sink side is everything that can still reach the sink.
+// Infinite capacities (FLT_MAX) become one more than the sum of all finite capacities, so they are never in a finite min cut.
+class PushRelabelGraph {
+public:
+  typedef int node_id;
+  typedef enum { SOURCE = 0, SINK = 1 } termtype;
+
+  PushRelabelGraph(int nodeNumMax, int edgeNumMax) : numNodes(0), constantFlow(0) {
+    tcap.reserve(nodeNumMax);
+    edges.reserve(edgeNumMax);
+  }
+
+  node_id add_node(int num = 1) {
+    node_id first = numNodes;
+    numNodes += num;
+    tcap.resize(numNodes, 0);
+    return first;
+  }
+
+  // Same convention as Graph::add_tweights: only the difference of the terminal capacities is kept.
+  void add_tweights(node_id i, float capSource, float capSink) {
+    double source = capSource;
+    double sink = capSink;
+    if (tcap[i] > 0) {
+      source += tcap[i];
+    }
+    else {
+      sink -= tcap[i];
+    }
+    constantFlow += std::min(source, sink);
+    tcap[i] = source - sink;
+  }
+
+  void add_edge(node_id i, node_id j, float cap, float revCap) {
+    edges.push_back(Edge{i, j, cap, revCap});
+  }
+
+  float maxflow() {
+    Build();
+    Preflow();
+    return CutFromPreflow();
+  }
+
+  termtype what_segment(node_id i) {
+    return sinkSide[i] ? SINK : SOURCE;
+  }
+
+  int get_node_num() {
+    return numNodes;
+  }
+
+  int get_arc_num() {
+    return 2 * edges.size();
+  }
+
+protected:
+  struct Edge {
+    int from;
+    int to;
+    float cap;
+    float revCap;
+  };
+
+  int numNodes;
+  double constantFlow;
+  std::vector<double> tcap;
+  std::vector<Edge> edges;
+  std::vector<char> sinkSide;
+
+  // Compressed adjacency over numNodes + 2 nodes (source, then sink, last).
+  int n;
+  int source;
+  int sink;
+  std::vector<int> firstArc;
+  std::vector<int> head;
+  std::vector<int> sister;
+  std::vector<double> rescap;
+  std::vector<double> excess;
+  std::vector<int> label;
+  std::vector<int> currentArc;
+  std::vector<std::vector<int>> buckets;  // Active nodes by label.
+  int highest;
+
+  void Build() {
+    n = numNodes + 2;
+    source = numNodes;
+    sink = numNodes + 1;
+
+    double finiteTotal = 0;
+    for (const Edge& e : edges) {
+      finiteTotal += (e.cap < FLT_MAX ? e.cap : 0) + (e.revCap < FLT_MAX ? e.revCap : 0);
+    }
+    for (int v = 0; v < numNodes; v++) {
+      finiteTotal += fabs(tcap[v]) < FLT_MAX ? fabs(tcap[v]) : 0;
+    }
+    double infinite = finiteTotal + 1;
+    auto capacity = [infinite](double c) { return c >= FLT_MAX ? infinite : c; };
+
+    firstArc.assign(n + 1, 0);
+    for (const Edge& e : edges) {
+      firstArc[e.from + 1]++;
+      firstArc[e.to + 1]++;
+    }
+    for (int v = 0; v < numNodes; v++) {
+      if (tcap[v] != 0) {
+        firstArc[v + 1]++;
+        firstArc[(tcap[v] > 0 ? source : sink) + 1]++;
+      }
+    }
+    for (int v = 0; v < n; v++) {
+      firstArc[v + 1] += firstArc[v];
+    }
+
+    int m = firstArc[n];
+    head.assign(m, 0);
+    sister.assign(m, 0);
+    rescap.assign(m, 0);
+    std::vector<int> next(firstArc.begin(), firstArc.end() - 1);
+    auto addArcPair = [&](int i, int j, double cap, double revCap) {
+      int a = next[i]++;
+      int b = next[j]++;
+      head[a] = j;
+      head[b] = i;
+      sister[a] = b;
+      sister[b] = a;
+      rescap[a] = cap;
+      rescap[b] = revCap;
+    };
+    for (const Edge& e : edges) {
+      addArcPair(e.from, e.to, capacity(e.cap), capacity(e.revCap));
+    }
+    for (int v = 0; v < numNodes; v++) {
+      if (tcap[v] > 0) {
+        addArcPair(source, v, capacity(tcap[v]), 0);
+      }
+      else if (tcap[v] < 0) {
+        addArcPair(v, sink, capacity(-tcap[v]), 0);
+      }
+    }
+  }
+
+  // Exact distances to the sink in the residual graph (residual(a) is the residual capacity of arc a); nodes that can't reach it
+  // get label n and stay inactive.
+  template <typename Residual> void ComputeLabels(Residual residual) {
+    label.assign(n, n);
+    label[sink] = 0;
+    std::vector<int> queue(1, sink);
+    for (size_t q = 0; q < queue.size(); q++) {
+      int v = queue[q];
+      for (int a = firstArc[v]; a < firstArc[v + 1]; a++) {
+        int u = head[a];
+        if (label[u] == n && u != source && residual(sister[a]) > 0) {
+          label[u] = label[v] + 1;
+          queue.push_back(u);
+        }
+      }
+    }
+  }
+
+  // Sink side of the cut: nodes with a residual path to the sink. Returns the flow of the maximum preflow in rescap and excess.
+  float CutFromPreflow() {
+    ComputeLabels([this](int a) { return rescap[a]; });
+    sinkSide.assign(numNodes, 0);
+    for (int v = 0; v < numNodes; v++) {
+      sinkSide[v] = label[v] < n;
+    }
+    return constantFlow + excess[sink];
+  }
+
+  void SaturateSource() {
+    excess.assign(n, 0);
+    for (int a = firstArc[source]; a < firstArc[source + 1]; a++) {
+      excess[head[a]] += rescap[a];
+      rescap[sister[a]] += rescap[a];
+      rescap[a] = 0;
+    }
+  }
+
+  void GlobalRelabel() {
+    ComputeLabels([this](int a) { return rescap[a]; });
+    for (auto& bucket : buckets) {
+      bucket.clear();
+    }
+    highest = 0;
+    for (int v = 0; v < numNodes; v++) {
+      if (excess[v] > 0 && label[v] < n) {
+        buckets[label[v]].push_back(v);
+        highest = std::max(highest, label[v]);
+      }
+      currentArc[v] = firstArc[v];
+    }
+  }
+
+  void Preflow() {
+    SaturateSource();
+    currentArc.assign(n, 0);
+    buckets.assign(n, std::vector<int>());
+    GlobalRelabel();
+
+    int relabels = 0;
+    while (true) {
+      while (highest > 0 && buckets[highest].empty()) {
+        highest--;
+      }
+      if (buckets[highest].empty()) {
+        break;
+      }
+      int v = buckets[highest].back();
+      buckets[highest].pop_back();
+      if (Discharge(v)) {
+        relabels++;
+      }
+      if (relabels > n) {
+        GlobalRelabel();
+        relabels = 0;
+      }
+    }
+  }
+
+  // Pushes v's excess along admissible arcs; relabels v if it still has excess. Returns whether v was relabeled.
+  bool Discharge(int v) {
+    for (int& a = currentArc[v]; a < firstArc[v + 1]; a++) {
+      int u = head[a];
+      if (rescap[a] > 0 && label[v] == label[u] + 1) {
+        double delta = std::min(excess[v], rescap[a]);
+        rescap[a] -= delta;
+        rescap[sister[a]] += delta;
+        excess[v] -= delta;
+        if (excess[u] == 0 && u != sink && u != source) {
+          buckets[label[u]].push_back(u);
+        }
+        excess[u] += delta;
+        if (excess[v] == 0) {
+          return false;
+        }
+      }
+    }
+
+    int newLabel = n;
+    for (int a = firstArc[v]; a < firstArc[v + 1]; a++) {
+      if (rescap[a] > 0) {
+        newLabel = std::min(newLabel, label[head[a]] + 1);
+      }
+    }
+    label[v] = newLabel;
+    currentArc[v] = firstArc[v];
+    if (newLabel < n) {
+      buckets[newLabel].push_back(v);
+      highest = std::max(highest, newLabel);
+    }
+    return true;
+  }
+};
+
+// Push-relabel that discharges all active nodes of a round in parallel: the synchronous algorithm of Baumstark, Blelloch and Shun
+// ("Efficient Implementation of a Synchronous Parallel Push-Relabel Algorithm", ESA 2015). Within a round, every node pushes and
+// relabels against the labels of the round start; when two active nodes could push to each other, only the one that wins (see Wins)
+// does. Excess pushed to other nodes is applied between rounds, and labels are recomputed after every O(n + m) work. Same build and
+// cut as PushRelabelGraph; set_num_threads picks the threads (all cores by default).
+class ParallelPushRelabelGraph : public PushRelabelGraph {
+public:
+  ParallelPushRelabelGraph(int nodeNumMax, int edgeNumMax) : PushRelabelGraph(nodeNumMax, edgeNumMax), numThreads(std::max(1, (int)std::thread::hardware_concurrency())) {
+  }
+
+  void set_num_threads(int threads) {
+    numThreads = std::max(1, threads);
+  }
+
+  float maxflow() {
+    Build();
+    ParallelPreflow();
+    return CutFromPreflow();
+  }
+
+private:
+  // Threads wait here between the phases of a round.
+  class Barrier {
+  public:
+    explicit Barrier(int count) : count(count), waiting(0), generation(0) {
+    }
+
+    void Wait() {
+      std::unique_lock<std::mutex> lock(m);
+      int g = generation;
+      if (++waiting == count) {
+        waiting = 0;
+        generation++;
+        released.notify_all();
+      }
+      else {
+        released.wait(lock, [&]() { return generation != g; });
+      }
+    }
+
+  private:
+    std::mutex m;
+    std::condition_variable released;
+    int count;
+    int waiting;
+    int generation;
+  };
+
+  int numThreads;
+  std::unique_ptr<std::atomic<double>[]> cap;  // Residual capacities during the rounds; rescap before and after.
+  std::unique_ptr<std::atomic<double>[]> addedExcess;  // Excess received (or, for the nodes of the round, given away) this round.
+  std::unique_ptr<std::atomic<char>[]> discovered;  // Already in the next round's working set.
+  std::vector<int> newLabel;
+  std::vector<int> workingSet;  // Active nodes: excess and a label below n.
+
+  static void AtomicAdd(std::atomic<double>& x, double delta) {
+    double old = x.load(std::memory_order_relaxed);
+    while (!x.compare_exchange_weak(old, old + delta, std::memory_order_relaxed)) {
+    }
+  }
+
+  // Whether v, with label dv, may push to the active node w, with label dw: exactly one of two active nodes wins against the other.
+  static bool Wins(int v, int dv, int w, int dw) {
+    return dv == dw + 1 || dv < dw - 1 || (dv == dw && v < w);
+  }
+
+  bool IsActive(int v) {
+    return v != source && v != sink && excess[v] > 0 && label[v] < n;
+  }
+
+  void Relabel() {
+    ComputeLabels([this](int a) { return cap[a].load(std::memory_order_relaxed); });
+    workingSet.clear();
+    for (int v = 0; v < numNodes; v++) {
+      if (IsActive(v)) {
+        workingSet.push_back(v);
+      }
+    }
+  }
+
+  // Discharges v against the labels of the round start. Nodes that get excess go to found. Returns the number of arcs scanned.
+  long long Discharge(int v, std::vector<int>* found) {
+    double e = excess[v];
+    int d = label[v];
+    long long work = 0;
+    while (e > 0) {
+      int relabel = n;
+      bool skipped = false;
+      for (int a = firstArc[v]; a < firstArc[v + 1] && e > 0; a++) {
+        work++;
+        double c = cap[a].load(std::memory_order_relaxed);
+        if (c <= 0) {
+          continue;
+        }
+        int w = head[a];
+        bool admissible = d == label[w] + 1;
+        if (admissible && IsActive(w) && !Wins(v, label[v], w, label[w])) {
+          skipped = true;
+          continue;
+        }
+        if (admissible) {
+          double delta = std::min(c, e);
+          AtomicAdd(cap[a], -delta);
+          AtomicAdd(cap[sister[a]], delta);
+          AtomicAdd(addedExcess[w], delta);
+          e -= delta;
+          c -= delta;
+          if (w != sink && w != source && !discovered[w].exchange(1)) {
+            found->push_back(w);
+          }
+        }
+        if (c > 0 && label[w] >= d) {
+          relabel = std::min(relabel, label[w] + 1);
+        }
+      }
+      if (e == 0 || skipped) {
+        break;
+      }
+      d = relabel;
+      if (d >= n) {
+        break;
+      }
+    }
+    newLabel[v] = d;
+    AtomicAdd(addedExcess[v], e - excess[v]);
+    if (e > 0 && !discovered[v].exchange(1)) {
+      found->push_back(v);
+    }
+    return work;
+  }
+
+  // Applies the labels and excess of a round; the nodes that got excess and are below n form the next working set.
+  void ApplyRound(std::vector<std::vector<int>>* found) {
+    for (int v : workingSet) {
+      label[v] = newLabel[v];
+      excess[v] += addedExcess[v].exchange(0);
+    }
+    workingSet.clear();
+    for (std::vector<int>& nodes : *found) {
+      for (int v : nodes) {
+        excess[v] += addedExcess[v].exchange(0);
+        discovered[v] = 0;
+        if (label[v] < n) {
+          workingSet.push_back(v);
+        }
+      }
+      nodes.clear();
+    }
+    excess[sink] += addedExcess[sink].exchange(0);
+    excess[source] += addedExcess[source].exchange(0);
+  }
+
+  void ParallelPreflow() {
+    SaturateSource();
+    int m = firstArc[n];
+    cap.reset(new std::atomic<double>[m]);
+    for (int a = 0; a < m; a++) {
+      cap[a] = rescap[a];
+    }
+    addedExcess.reset(new std::atomic<double>[n]);
+    discovered.reset(new std::atomic<char>[n]);
+    for (int v = 0; v < n; v++) {
+      addedExcess[v] = 0;
+      discovered[v] = 0;
+    }
+    newLabel.assign(n, n);
+    Relabel();
+
+    std::vector<std::vector<int>> found(numThreads);
+    std::atomic<size_t> next(0);
+    std::atomic<long long> roundWork(0);
+    bool finished = false;
+    Barrier start(numThreads), end(numThreads);
+    auto discharge = [&](int t) {
+      const size_t chunk = 64;
+      long long work = 0;
+      for (size_t k = next.fetch_add(chunk); k < workingSet.size(); k = next.fetch_add(chunk)) {
+        for (size_t i = k; i < std::min(k + chunk, workingSet.size()); i++) {
+          work += Discharge(workingSet[i], &found[t]);
+        }
+      }
+      roundWork += work;
+    };
+    std::vector<std::thread> threads;
+    for (int t = 1; t < numThreads; t++) {
+      threads.push_back(std::thread([&, t]() {
+        while (true) {
+          start.Wait();
+          if (finished) {
+            return;
+          }
+          discharge(t);
+          end.Wait();
+        }
+      }));
+    }
+
+    long long work = 0;
+    while (true) {
+      if (workingSet.empty()) {
+        // Nothing is active under the current labels; exact labels confirm the preflow is maximum or give new active nodes.
+        Relabel();
+        work = 0;
+        if (workingSet.empty()) {
+          break;
+        }
+      }
+      next = 0;
+      roundWork = 0;
+      start.Wait();
+      discharge(0);
+      end.Wait();
+      ApplyRound(&found);
+      work += roundWork;
+      if (work > 6LL * n + m) {
+        Relabel();
+        work = 0;
+      }
+    }
+    finished = true;
+    start.Wait();
+    for (std::thread& t : threads) {
+      t.join();
+    }
+    for (int a = 0; a < m; a++) {
+      rescap[a] = cap[a];
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,235 @@
+// Per-stage instrumentation, enabled with --profile. A profiler::Scope records the wall time, CPU time of its thread, bytes read and
+// written by its thread (read/write system calls, from /proc/thread-self/io; mmap'd pages are not counted) and the peak RSS when it ends,
+// plus any arguments attached to it (graph size, threshold, ...). Events are exported as Chrome trace events (chrome://tracing or
+// Perfetto) and summarized per stage name.
+//
+// While disabled, a Scope only tests a flag, so scopes can stay in hot paths.
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <nlohmann/json.hpp>
+
+namespace profiler {
+
+struct Event {
+  const char* name;
+  const char* category;
+  int tid;
+  double startUs;  // From the time the profiler was enabled.
+  double durUs;
+  double cpuMs;
+  long readBytes;
+  long writtenBytes;
+  long peakRssKB;
+  std::vector<std::pair<const char*, double>> args;
+};
+
+class Profiler {
+public:
+  static Profiler& Get() {
+    static Profiler profiler;
+    return profiler;
+  }
+
+  // Call once, before any worker threads start.
+  void Enable() {
+    origin = std::chrono::steady_clock::now();
+    enabled = true;
+  }
+
+  bool Enabled() const {
+    return enabled;
+  }
+
+  double NowUs() const {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - origin).count();
+  }
+
+  // Small, stable ids for the trace viewer, in order of first use.
+  int ThreadId() {
+    std::lock_guard<std::mutex> lock(m);
+    auto it = threadIds.find(std::this_thread::get_id());
+    if (it != threadIds.end()) {
+      return it->second;
+    }
+    int id = threadIds.size();
+    threadIds[std::this_thread::get_id()] = id;
+    return id;
+  }
+
+  // Bounds the buffer for long-running processes (the server): once it holds maxEvents, the older half is dropped.
+  void SetMaxEvents(size_t n) {
+    std::lock_guard<std::mutex> lock(m);
+    maxEvents = std::max<size_t>(n, 2);
+  }
+
+  void Record(Event event) {
+    std::lock_guard<std::mutex> lock(m);
+    if (events.size() >= maxEvents) {
+      size_t drop = events.size() / 2;
+      events.erase(events.begin(), events.begin() + drop);
+      dropped += drop;
+    }
+    events.push_back(std::move(event));
+  }
+
+  // Events that started at or after sinceUs (see NowUs), e.g. those of one server request and of any requests solved concurrently.
+  void WriteTrace(const std::string& filename, double sinceUs = 0) {
+    std::lock_guard<std::mutex> lock(m);
+    nlohmann::json traceEvents = nlohmann::json::array();
+    for (const Event& e : events) {
+      if (e.startUs < sinceUs) {
+        continue;
+      }
+      nlohmann::json args = {{"cpuMs", e.cpuMs}, {"readBytes", e.readBytes}, {"writtenBytes", e.writtenBytes}, {"peakRssKB", e.peakRssKB}};
+      for (auto& arg : e.args) {
+        args[arg.first] = arg.second;
+      }
+      traceEvents.push_back({{"name", e.name}, {"cat", e.category}, {"ph", "X"}, {"ts", e.startUs}, {"dur", e.durUs},
+                             {"pid", getpid()}, {"tid", e.tid}, {"args", args}});
+    }
+    std::ofstream o(filename);
+    o << nlohmann::json{{"traceEvents", traceEvents}, {"displayTimeUnit", "ms"}} << std::endl;
+  }
+
+  // One line per stage name, slowest first. Nested stages are included in their parents' times.
+  void PrintSummary(std::ostream& out) {
+    struct Totals {
+      int calls = 0;
+      double wallMs = 0;
+      double maxWallMs = 0;
+      double cpuMs = 0;
+      long readBytes = 0;
+      long writtenBytes = 0;
+      long peakRssKB = 0;
+    };
+    std::lock_guard<std::mutex> lock(m);
+    std::map<std::string, Totals> byName;
+    for (const Event& e : events) {
+      Totals& t = byName[e.name];
+      t.calls++;
+      t.wallMs += e.durUs / 1000;
+      t.maxWallMs = std::max(t.maxWallMs, e.durUs / 1000);
+      t.cpuMs += e.cpuMs;
+      t.readBytes += e.readBytes;
+      t.writtenBytes += e.writtenBytes;
+      t.peakRssKB = std::max(t.peakRssKB, e.peakRssKB);
+    }
+    std::vector<std::pair<std::string, Totals>> rows(byName.begin(), byName.end());
+    std::sort(rows.begin(), rows.end(), [](const std::pair<std::string, Totals>& a, const std::pair<std::string, Totals>& b) { return a.second.wallMs > b.second.wallMs; });
+
+    out << std::left << std::setw(28) << "stage" << std::right << std::setw(7) << "calls" << std::setw(12) << "wall ms" << std::setw(12) << "max ms"
+        << std::setw(12) << "cpu ms" << std::setw(11) << "read MB" << std::setw(11) << "write MB" << std::setw(13) << "peak RSS MB" << std::endl;
+    out << std::fixed << std::setprecision(1);
+    for (auto& row : rows) {
+      const Totals& t = row.second;
+      out << std::left << std::setw(28) << row.first << std::right << std::setw(7) << t.calls << std::setw(12) << t.wallMs << std::setw(12) << t.maxWallMs
+          << std::setw(12) << t.cpuMs << std::setw(11) << t.readBytes / 1e6 << std::setw(11) << t.writtenBytes / 1e6 << std::setw(13) << t.peakRssKB / 1024.0 << std::endl;
+    }
+    out << std::defaultfloat << std::setprecision(6);
+    if (dropped > 0) {
+      out << "(" << dropped << " older events were dropped.)" << std::endl;
+    }
+  }
+
+private:
+  bool enabled = false;
+  std::chrono::steady_clock::time_point origin;
+  std::mutex m;
+  std::vector<Event> events;
+  size_t maxEvents = SIZE_MAX;
+  size_t dropped = 0;
+  std::map<std::thread::id, int> threadIds;
+};
+
+inline double ThreadCpuMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// rchar and wchar of the calling thread; 0 where /proc is unavailable.
+inline void ThreadIoBytes(long* readBytes, long* writtenBytes) {
+  *readBytes = 0;
+  *writtenBytes = 0;
+  FILE* f = fopen("/proc/thread-self/io", "r");
+  if (f == NULL) {
+    return;
+  }
+  char key[32];
+  long value;
+  while (fscanf(f, "%31[^:]: %ld\n", key, &value) == 2) {
+    if (strcmp(key, "rchar") == 0) {
+      *readBytes = value;
+    }
+    else if (strcmp(key, "wchar") == 0) {
+      *writtenBytes = value;
+    }
+  }
+  fclose(f);
+}
+
+// Records the enclosing block as one event. name and category must outlive the profiler (string literals).
+class Scope {
+public:
+  explicit Scope(const char* name, const char* category = "stage") : active(Profiler::Get().Enabled()) {
+    if (!active) {
+      return;
+    }
+    event.name = name;
+    event.category = category;
+    event.tid = Profiler::Get().ThreadId();
+    ThreadIoBytes(&event.readBytes, &event.writtenBytes);
+    event.cpuMs = ThreadCpuMs();
+    event.startUs = Profiler::Get().NowUs();
+  }
+
+  ~Scope() {
+    if (!active) {
+      return;
+    }
+    event.durUs = Profiler::Get().NowUs() - event.startUs;
+    event.cpuMs = ThreadCpuMs() - event.cpuMs;
+    long readBytes, writtenBytes;
+    ThreadIoBytes(&readBytes, &writtenBytes);
+    event.readBytes = readBytes - event.readBytes;
+    event.writtenBytes = writtenBytes - event.writtenBytes;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    event.peakRssKB = usage.ru_maxrss;
+    Profiler::Get().Record(std::move(event));
+  }
+
+  Scope(const Scope&) = delete;
+  Scope& operator=(const Scope&) = delete;
+
+  void Arg(const char* key, double value) {
+    if (active) {
+      event.args.push_back(std::make_pair(key, value));
+    }
+  }
+
+private:
+  bool active;
+  Event event;
+};
+
+}  // namespace profiler
+
+#endif
@@ -0,0 +1,331 @@
+// Versioned binary bundle of graph-cut results, written with --outputFormat binary. Little-endian; every payload starts on a 64-byte
+// boundary so a reader can mmap the file and use the arrays in place.
+//
+// Layout: BundleHeader, numSections BundleSection entries, then the section payloads.
+//   RAGGED_INT32 / RAGGED_FLOAT32 (one list per view): uint64 offsets[rows + 1] in elements, then the elements.
+//   MATRIX_FLOAT32: rows * cols elements, row-major.
+//
+// Sections written by viewdeptextures: "cut", "valid", "extraCosts", "allArcs" (ragged), "edgeCosts" and, with --writeCosts,
+// "filtered_{view}" (matrices).
+#ifndef RESULTBUNDLE_H
+#define RESULTBUNDLE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <stdexcept>
+#include <type_traits>
+#include <functional>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace resultbundle {
+
+const char MAGIC[4] = {'V', 'D', 'T', 'B'};
+const uint32_t VERSION = 1;
+const uint64_t ALIGNMENT = 64;
+
+enum SectionType : uint32_t {
+  RAGGED_INT32 = 0,
+  RAGGED_FLOAT32 = 1,
+  MATRIX_FLOAT32 = 2
+};
+
+struct BundleHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t numSections;
+  uint32_t reserved;
+};
+
+struct BundleSection {
+  char name[32];
+  uint32_t type;
+  uint32_t rows;
+  uint32_t cols;  // 0 for ragged sections.
+  uint32_t reserved;
+  uint64_t offset;  // From the start of the file.
+  uint64_t size;  // In bytes.
+};
+
+static_assert(sizeof(BundleHeader) == 16 && sizeof(BundleSection) == 64, "Bundle structs must match the file layout.");
+
+inline bool IsLittleEndian() {
+  uint16_t one = 1;
+  return *(const char*)&one == 1;
+}
+
+// Collects sections and writes them in one pass. Matrix data is not copied, so it has to stay alive until Write.
+class BundleWriter {
+public:
+  void AddRagged(const std::string& name, const std::vector<std::vector<int>>& lists) {
+    AddRagged(name, RAGGED_INT32, lists);
+  }
+
+  void AddRagged(const std::string& name, const std::vector<std::vector<float>>& lists) {
+    AddRagged(name, RAGGED_FLOAT32, lists);
+  }
+
+  // step is the distance between rows in bytes (e.g. Mat::step).
+  void AddMatrix(const std::string& name, const float* data, int rows, int cols, size_t step) {
+    Pending p = MakeSection(name, MATRIX_FLOAT32, rows, cols, (uint64_t)rows * cols * sizeof(float));
+    p.data = (const char*)data;
+    p.step = step;
+    pending.push_back(p);
+  }
+
+  // Matrix whose rows are produced by row(r, out) while writing (e.g. decoded from a packed matrix), so it never exists in full.
+  void AddMatrix(const std::string& name, int rows, int cols, std::function<void(int, float*)> row) {
+    Pending p = MakeSection(name, MATRIX_FLOAT32, rows, cols, (uint64_t)rows * cols * sizeof(float));
+    p.row = row;
+    pending.push_back(p);
+  }
+
+  // Returns the number of bytes written.
+  uint64_t Write(const std::string& filename) {
+    if (!IsLittleEndian()) {
+      throw std::runtime_error("BundleWriter: Only little-endian hosts are supported.");
+    }
+    BundleHeader header;
+    memcpy(header.magic, MAGIC, 4);
+    header.version = VERSION;
+    header.numSections = pending.size();
+    header.reserved = 0;
+
+    uint64_t offset = Align(sizeof(BundleHeader) + pending.size() * sizeof(BundleSection));
+    for (Pending& p : pending) {
+      p.section.offset = offset;
+      offset = Align(offset + p.section.size);
+    }
+
+    std::ofstream o(filename, std::ios::binary);
+    if (!o) {
+      throw std::runtime_error("BundleWriter: Unable to open " + filename);
+    }
+    o.write((const char*)&header, sizeof(header));
+    for (const Pending& p : pending) {
+      o.write((const char*)&p.section, sizeof(BundleSection));
+    }
+    for (const Pending& p : pending) {
+      Pad(&o, p.section.offset);
+      if (p.section.type == MATRIX_FLOAT32 && p.data == NULL) {
+        std::vector<float> row(p.section.cols);
+        for (uint32_t r = 0; r < p.section.rows; r++) {
+          p.row(r, row.data());
+          o.write((const char*)row.data(), p.section.cols * sizeof(float));
+        }
+      }
+      else if (p.section.type == MATRIX_FLOAT32) {
+        for (uint32_t r = 0; r < p.section.rows; r++) {
+          o.write(p.data + r * p.step, p.section.cols * sizeof(float));
+        }
+      }
+      else {
+        o.write(p.bytes.data(), p.bytes.size());
+      }
+    }
+    Pad(&o, offset);
+    if (!o) {
+      throw std::runtime_error("BundleWriter: Failed writing " + filename);
+    }
+    return offset;
+  }
+
+private:
+  struct Pending {
+    BundleSection section;
+    std::vector<char> bytes;  // Serialized ragged sections.
+    const char* data;  // Matrix sections.
+    size_t step;
+    std::function<void(int, float*)> row;  // Matrix sections without data.
+  };
+
+  std::vector<Pending> pending;
+
+  static uint64_t Align(uint64_t x) {
+    return (x + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+  }
+
+  static void Pad(std::ofstream* o, uint64_t position) {
+    static const char zeros[ALIGNMENT] = {0};
+    uint64_t current = o->tellp();
+    o->write(zeros, position - current);
+  }
+
+  static Pending MakeSection(const std::string& name, uint32_t type, int rows, int cols, uint64_t size) {
+    if (name.size() >= sizeof(BundleSection::name)) {
+      throw std::runtime_error("BundleWriter: Section name too long: " + name);
+    }
+    Pending p;
+    memset(&p.section, 0, sizeof(BundleSection));
+    memcpy(p.section.name, name.c_str(), name.size());
+    p.section.type = type;
+    p.section.rows = rows;
+    p.section.cols = cols;
+    p.section.size = size;
+    p.data = NULL;
+    p.step = 0;
+    return p;
+  }
+
+  template <typename T> void AddRagged(const std::string& name, uint32_t type, const std::vector<std::vector<T>>& lists) {
+    std::vector<uint64_t> offsets(1, 0);
+    for (const std::vector<T>& list : lists) {
+      offsets.push_back(offsets.back() + list.size());
+    }
+    Pending p = MakeSection(name, type, lists.size(), 0, offsets.size() * sizeof(uint64_t) + offsets.back() * sizeof(T));
+    p.bytes.resize(p.section.size);
+    memcpy(p.bytes.data(), offsets.data(), offsets.size() * sizeof(uint64_t));
+    char* elements = p.bytes.data() + offsets.size() * sizeof(uint64_t);
+    for (size_t i = 0; i < lists.size(); i++) {
+      memcpy(elements + offsets[i] * sizeof(T), lists[i].data(), lists[i].size() * sizeof(T));
+    }
+    pending.push_back(p);
+  }
+};
+
+// Maps a bundle read-only. Pointers returned by List and Matrix point into the mapping and are valid for the reader's lifetime.
+class BundleReader {
+public:
+  explicit BundleReader(const std::string& filename) : addr(NULL), length(0) {
+    if (!IsLittleEndian()) {
+      throw std::runtime_error("BundleReader: Only little-endian hosts are supported.");
+    }
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("BundleReader: Unable to open " + filename);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      throw std::runtime_error("BundleReader: Unable to stat " + filename);
+    }
+    length = st.st_size;
+    addr = length > 0 ? mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (addr == MAP_FAILED) {
+      addr = NULL;
+      throw std::runtime_error("BundleReader: Unable to map " + filename);
+    }
+
+    const BundleHeader* header = (const BundleHeader*)addr;
+    if (length < sizeof(BundleHeader) || memcmp(header->magic, MAGIC, 4) != 0) {
+      Unmap();
+      throw std::runtime_error("BundleReader: Not a result bundle: " + filename);
+    }
+    if (header->version != VERSION) {
+      uint32_t version = header->version;
+      Unmap();
+      throw std::runtime_error("BundleReader: Unsupported bundle version " + std::to_string(version) + " in " + filename);
+    }
+    const BundleSection* table = (const BundleSection*)((const char*)addr + sizeof(BundleHeader));
+    if (header->numSections > (length - sizeof(BundleHeader)) / sizeof(BundleSection)) {
+      Unmap();
+      throw std::runtime_error("BundleReader: Truncated section table in " + filename);
+    }
+    for (uint32_t s = 0; s < header->numSections; s++) {
+      if (table[s].offset > length || table[s].size > length - table[s].offset) {
+        std::string name(table[s].name, strnlen(table[s].name, sizeof(table[s].name)));
+        Unmap();
+        throw std::runtime_error("BundleReader: Truncated section " + name + " in " + filename);
+      }
+      sections.push_back(table[s]);
+    }
+  }
+
+  ~BundleReader() {
+    Unmap();
+  }
+
+  BundleReader(const BundleReader&) = delete;
+  BundleReader& operator=(const BundleReader&) = delete;
+
+  const std::vector<BundleSection>& Sections() const {
+    return sections;
+  }
+
+  bool Has(const std::string& name) const {
+    return Find(name) != NULL;
+  }
+
+  // Number of lists (views) in a ragged section.
+  int NumLists(const std::string& name) const {
+    return Get(name).rows;
+  }
+
+  // The i-th list of a ragged section of T (int or float). Its offsets have to be in order and inside the section.
+  template <typename T> const T* List(const std::string& name, int i, size_t* size) const {
+    const BundleSection& s = Get(name);
+    if (s.type != (std::is_integral<T>::value ? RAGGED_INT32 : RAGGED_FLOAT32) || i < 0 || i >= (int)s.rows) {
+      throw std::runtime_error("BundleReader: Bad list request for section " + name);
+    }
+    uint64_t offsetsSize = ((uint64_t)s.rows + 1) * sizeof(uint64_t);
+    if (offsetsSize > s.size) {
+      throw std::runtime_error("BundleReader: Bad list offsets in section " + name);
+    }
+    const uint64_t* offsets = (const uint64_t*)((const char*)addr + s.offset);
+    const T* elements = (const T*)(offsets + s.rows + 1);
+    if (offsets[i] > offsets[i + 1] || offsets[i + 1] > (s.size - offsetsSize) / sizeof(T)) {
+      throw std::runtime_error("BundleReader: Bad list " + std::to_string(i) + " in section " + name);
+    }
+    *size = offsets[i + 1] - offsets[i];
+    return elements + offsets[i];
+  }
+
+  template <typename T> std::vector<std::vector<T>> Lists(const std::string& name) const {
+    std::vector<std::vector<T>> lists(NumLists(name));
+    for (int i = 0; i < (int)lists.size(); i++) {
+      size_t size;
+      const T* list = List<T>(name, i, &size);
+      lists[i].assign(list, list + size);
+    }
+    return lists;
+  }
+
+  const float* Matrix(const std::string& name, int* rows, int* cols) const {
+    const BundleSection& s = Get(name);
+    if (s.type != MATRIX_FLOAT32) {
+      throw std::runtime_error("BundleReader: Section " + name + " is not a matrix.");
+    }
+    *rows = s.rows;
+    *cols = s.cols;
+    return (const float*)((const char*)addr + s.offset);
+  }
+
+private:
+  void* addr;
+  size_t length;
+  std::vector<BundleSection> sections;
+
+  void Unmap() {
+    if (addr != NULL) {
+      munmap(addr, length);
+      addr = NULL;
+    }
+  }
+
+  const BundleSection* Find(const std::string& name) const {
+    for (const BundleSection& s : sections) {
+      if (strncmp(s.name, name.c_str(), sizeof(s.name)) == 0) {
+        return &s;
+      }
+    }
+    return NULL;
+  }
+
+  const BundleSection& Get(const std::string& name) const {
+    const BundleSection* s = Find(name);
+    if (s == NULL) {
+      throw std::runtime_error("BundleReader: No section named " + name);
+    }
+    return *s;
+  }
+};
+
+}  // namespace resultbundle
+
+#endif
@@ -0,0 +1,430 @@
+// Runs many graph-cut jobs (one clip each, with one gate or a batch of gates) as child processes of main, as many at a time as fit in a
+// RAM budget. Each job's peak memory is estimated from the shapes of its cost matrices and its gate frames (see EstimateJobBytes) before
+// it starts; a job only starts once its estimate fits in what the running jobs leave of the budget. A job that finishes writes a
+// completion marker to its output directory, so an interrupted schedule can be run again and only redoes the missing jobs.
+//
+// Compile like viewdeptextures.cpp, e.g.:
+//   g++ scheduler.cpp graph.cpp maxflow.cpp `pkg-config --cflags --libs opencv` -lcnpy -lz -l boost_program_options -l boost_system -lboost_filesystem -lpthread -o scheduler --std=c++17 -O3
+#define VIEWDEP_NO_MAIN
+#include "viewdeptextures.cpp"
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+const char* DONE_MARKER = "job.done.json";
+
+// Options of one job and what EstimateJobBytes needs to know about it.
+struct Job {
+  string name;
+  string outputDir;
+  vector<string> args;  // main's options, as given in the job list. With gates, identifies the job in its completion marker.
+  json gates;  // Batch manifest (see ReadBatchManifest), or null for a single gate.
+  int numViews = 0;
+  int numFrames = 0;
+  int numPitch = 1;
+  double estimatedBytes = 0;
+
+  // Outcome.
+  bool skipped = false;
+  int exitCode = -1;
+  double seconds = 0;
+  long peakRssKB = 0;
+};
+
+string OptionValue(const json& value) {
+  if (value.is_string()) {
+    return value.get<string>();
+  }
+  if (value.is_boolean()) {
+    return value.get<bool>() ? "1" : "0";
+  }
+  return value.dump();
+}
+
+// Job list: either a list of jobs, or {"defaults": {...}, "jobs": [...]} where the defaults apply to every job. A job is an object of
+// main's options (inputDir and outputDir are required) plus an optional "name" and an optional "gates" list, which runs the gates as
+// a --batch manifest instead of a single --gateFrame, e.g.
+//   {"defaults": {"minLength": 30, "gateRowsOnly": true},
+//    "jobs": [{"inputDir": "a-preprocess/costs/", "outputDir": "out/a", "gateFrame": 150, "ROIstart": 35, "ROIend": 5},
+//             {"inputDir": "b-preprocess/costs/", "outputDir": "out/b", "gates": [{"gateFrame": 90}, {"gateFrame": 240}]}]}
+vector<Job> ReadJobList(string filename) {
+  std::ifstream i(filename);
+  if (!i) {
+    throw std::runtime_error("Unable to open job list " + filename + ".");
+  }
+  json list;
+  i >> list;
+  json defaults = json::object();
+  if (list.is_object()) {
+    defaults = list.value("defaults", json::object());
+    list = list.value("jobs", json::array());
+  }
+  if (!list.is_array()) {
+    throw std::runtime_error("Job list " + filename + " must be a list of jobs or an object with a jobs list.");
+  }
+
+  vector<Job> jobs;
+  for (const json& entry : list) {
+    json options = defaults;
+    options.update(entry);
+    if (!options.count("inputDir") || !options.count("outputDir")) {
+      throw std::runtime_error("Job " + entry.dump() + " needs an inputDir and an outputDir.");
+    }
+    Job job;
+    job.outputDir = options["outputDir"].get<string>();
+    job.name = options.count("name") ? options["name"].get<string>() : path(job.outputDir).filename().string();
+    if (options.count("gates")) {
+      job.gates = options["gates"];
+      if (!job.gates.is_array() || job.gates.empty()) {
+        throw std::runtime_error("Job " + job.name + " needs at least one gate in its gates list.");
+      }
+    }
+    else if (!options.count("gateFrame")) {
+      throw std::runtime_error("Job " + job.name + " needs a gateFrame or a gates list.");
+    }
+    for (auto& option : options.items()) {
+      if (option.key() != "name" && option.key() != "gates") {
+        job.args.push_back("--" + option.key());
+        job.args.push_back(OptionValue(option.value()));
+      }
+    }
+    jobs.push_back(job);
+  }
+  return jobs;
+}
+
+// Value of one of main's options for the job, or defaultValue (main's default) if the job leaves it out.
+string JobOption(const Job& job, string key, string defaultValue) {
+  for (size_t a = 0; a + 1 < job.args.size(); a += 2) {
+    if (job.args[a] == "--" + key) {
+      return job.args[a + 1];
+    }
+  }
+  return defaultValue;
+}
+
+bool JobFlag(const Job& job, string key) {
+  string value = JobOption(job, key, "0");
+  return value == "1" || value == "true";
+}
+
+// BK graph storage per node and per arc (two arcs per edge) with float capacities, on a 64-bit build.
+const double GRAPH_NODE_BYTES = 48;
+const double GRAPH_ARC_BYTES = 32;
+// Libraries, the per-frame result vectors and allocator slack.
+const double BASE_BYTES = 64e6;
+
+// Peak memory of main for the job, from the matrix shape and the options (see PreprocessViews and RunBatch):
+// - the packed, filtered cost matrices (only the gate rows and the block right of them with gateRowsOnly), plus their arc indices,
+// - while loading, the dense matrices in flight between the pipeline stages, capped by queueDepth and the number of threads,
+// - afterwards, one graph per gate solved concurrently (times searchThreads when searching for the threshold).
+// Peak is the retained matrices plus the larger of the last two.
+double EstimateJobBytes(const Job& job, int preprocessThreads) {
+  int numViews = job.numViews;
+  int numFrames = job.numFrames;
+  int loopDuration = stoi(JobOption(job, "loopDuration", "15"));
+  bool gateRowsOnly = JobFlag(job, "gateRowsOnly");
+  bool findThreshold = JobFlag(job, "findThreshold");
+  int searchThreads = max(1, stoi(JobOption(job, "searchThreads", "1")));
+  int queueDepth = max(1, stoi(JobOption(job, "queueDepth", "4")));
+  int neighbourRadius = stoi(JobOption(job, "neighbourRadius", "2"));
+  costmatrix::Encoding encoding = costmatrix::FLOAT32;
+  costmatrix::ParseEncoding(JobOption(job, "costEncoding", "float32"), &encoding);
+
+  vector<int> gateFrames;
+  int concurrentGates = 1;
+  if (job.gates.is_array()) {
+    for (const json& gate : job.gates) {
+      gateFrames.push_back(gate.at("gateFrame").get<int>());
+      findThreshold = findThreshold || gate.value("findThreshold", false);
+    }
+    int batchThreads = stoi(JobOption(job, "batchThreads", "0"));
+    concurrentGates = min((int)gateFrames.size(), batchThreads > 0 ? batchThreads : (int)thread::hardware_concurrency());
+  }
+  else {
+    gateFrames.push_back(stoi(JobOption(job, "gateFrame", "0")));
+  }
+  int maxGateFrame = *max_element(gateFrames.begin(), gateFrames.end());
+
+  double keptRows = gateRowsOnly ? min(numFrames, maxGateFrame + 1) : numFrames;
+  double loadRows = gateRowsOnly ? min(numFrames, maxGateFrame + max(loopDuration, 1)) : numFrames;
+  double packedEntries = keptRows * (keptRows + 1) / 2 + keptRows * (numFrames - keptRows);
+  double packedBytes = numViews * packedEntries * (encoding == costmatrix::FLOAT32 ? 4 : 2);
+  // Prefix minima of random rows: ~ln(n) records. Rows with many more (e.g. constant rows) keep their costs instead, at worst the float32
+  // backward triangle; budget for a tenth of those rows.
+  double arcIndexBytes = numViews * keptRows * (12 + 12 * (log(max(2.0, keptRows)) + 1) + 0.1 * 4 * keptRows / 2);
+
+  // Queued views (three queues), plus an input and an output matrix per filter thread and one per arc finder thread.
+  int matricesInFlight = min(numViews, 3 * queueDepth + 3 * preprocessThreads + 1);
+  double loadBytes = matricesInFlight * loadRows * numFrames * sizeof(float);
+
+  ViewGrid grid = {numViews / job.numPitch, job.numPitch};
+  vector<int> offsets;
+  int numNeighbours = ViewNeighbours(grid, max(1, min(4, neighbourRadius)), &offsets).size();
+  int numNodes, numEdges;
+  GraphSize(numViews, maxGateFrame, numNeighbours, &numNodes, &numEdges);
+  double graphBytes = (double)numNodes * GRAPH_NODE_BYTES + 2.0 * numEdges * GRAPH_ARC_BYTES;
+  double solveBytes = concurrentGates * (findThreshold ? searchThreads : 1) * graphBytes;
+
+  return BASE_BYTES + packedBytes + arcIndexBytes + max(loadBytes, solveBytes);
+}
+
+// Completion marker of the job, if it finished with the same options and gates before.
+bool IsDone(const Job& job) {
+  path marker = path(job.outputDir) / DONE_MARKER;
+  if (!exists(marker)) {
+    return false;
+  }
+  std::ifstream i(marker.string());
+  json done;
+  try {
+    i >> done;
+  }
+  catch (const json::exception&) {
+    return false;  // Torn write; redo the job.
+  }
+  return done.value("args", json()) == json(job.args) && done.value("gates", json()) == job.gates;
+}
+
+void WriteDoneMarker(const Job& job) {
+  path marker = path(job.outputDir) / DONE_MARKER;
+  path tmp = marker;
+  tmp += ".tmp";
+  {
+    std::ofstream o(tmp.string());
+    o << std::setw(4) << json{{"args", job.args}, {"gates", job.gates}, {"seconds", job.seconds}, {"peakRssKB", job.peakRssKB}, {"estimatedKB", (long)(job.estimatedBytes / 1024)}} << endl;
+  }
+  rename(tmp, marker);
+}
+
+// Runs main on the job, with its output going to log.txt in the output directory. Sets the exit code, time and peak RSS of the child.
+void RunJob(Job* job, string mainPath, int preprocessThreads) {
+  create_directories(job->outputDir);
+  vector<string> args = {mainPath};
+  args.insert(args.end(), job->args.begin(), job->args.end());
+  if (job->gates.is_array()) {
+    path manifest = path(job->outputDir) / "gates.json";
+    std::ofstream o(manifest.string());
+    o << std::setw(4) << job->gates << endl;
+    args.push_back("--batch");
+    args.push_back(manifest.string());
+  }
+  if (stoi(JobOption(*job, "preprocessThreads", "0")) == 0) {
+    args.push_back("--preprocessThreads");  // Share the cores with the other running jobs.
+    args.push_back(to_string(preprocessThreads));
+  }
+  vector<char*> argv;
+  for (string& arg : args) {
+    argv.push_back(&arg[0]);
+  }
+  argv.push_back(NULL);
+
+  string logPath = (path(job->outputDir) / "log.txt").string();
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, logPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+
+  auto start = chrono::steady_clock::now();
+  pid_t pid;
+  int error = posix_spawn(&pid, mainPath.c_str(), &actions, NULL, argv.data(), environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (error != 0) {
+    job->exitCode = 127;
+    return;
+  }
+  int status;
+  struct rusage usage;
+  wait4(pid, &status, 0, &usage);
+  job->seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  job->peakRssKB = usage.ru_maxrss;
+  job->exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+// MemAvailable from /proc/meminfo, or 0.
+double AvailableBytes() {
+  std::ifstream i("/proc/meminfo");
+  string key;
+  double kB;
+  string unit;
+  while (i >> key >> kB >> unit) {
+    if (key == "MemAvailable:") {
+      return kB * 1024;
+    }
+  }
+  return 0;
+}
+
+// Pending jobs, largest estimate first, and the memory reserved by the running ones. A worker takes the largest pending job that fits
+// in the rest of the budget; a job over the whole budget only runs alone.
+struct Schedule {
+  mutex m;
+  condition_variable changed;
+  vector<Job*> pending;
+  double budgetBytes;
+  double reservedBytes = 0;
+  int running = 0;
+  int finished = 0;
+  int total = 0;
+
+  // Blocks until a job fits; NULL once none are left.
+  Job* Take() {
+    unique_lock<mutex> lock(m);
+    while (true) {
+      if (pending.empty()) {
+        return NULL;
+      }
+      for (auto it = pending.begin(); it != pending.end(); it++) {
+        if (reservedBytes + (*it)->estimatedBytes <= budgetBytes || running == 0) {
+          Job* job = *it;
+          pending.erase(it);
+          reservedBytes += job->estimatedBytes;
+          running++;
+          cout << "Started " << job->name << " (estimated " << job->estimatedBytes / 1e6 << " MB; " << running << " running, " << reservedBytes / 1e6 << " of " << budgetBytes / 1e6 << " MB reserved)." << endl;
+          return job;
+        }
+      }
+      changed.wait(lock);
+    }
+  }
+
+  void Finish(Job* job) {
+    lock_guard<mutex> lock(m);
+    reservedBytes -= job->estimatedBytes;
+    running--;
+    finished++;
+    cout << "[" << finished << "/" << total << "] " << job->name;
+    if (job->exitCode == 0) {
+      cout << " done in " << job->seconds << " s. Peak RSS " << job->peakRssKB / 1024.0 << " MB (estimated " << job->estimatedBytes / 1e6 << " MB)." << endl;
+    }
+    else {
+      cout << " failed with exit code " << job->exitCode << ", see " << (path(job->outputDir) / "log.txt").string() << endl;
+    }
+    changed.notify_all();
+  }
+};
+
+json JobToJson(const Job& job) {
+  json report = {{"name", job.name}, {"outputDir", job.outputDir}, {"views", job.numViews}, {"frames", job.numFrames}, {"estimatedKB", (long)(job.estimatedBytes / 1024)}};
+  if (job.skipped) {
+    report["status"] = "done before";
+  }
+  else {
+    report["status"] = job.exitCode == 0 ? "done" : "failed";
+    report["exitCode"] = job.exitCode;
+    report["seconds"] = job.seconds;
+    report["peakRssKB"] = job.peakRssKB;
+  }
+  return report;
+}
+
+int main(int argc, char **argv)
+{
+  options_description desc("Allowed options");
+  desc.add_options()
+  ("help", "Print help message.")
+  ("jobs,J", value<string>(), "JSON job list. See ReadJobList for the format.")
+  ("main", value<string>()->default_value("./main"), "Path of the viewdeptextures executable.")
+  ("memoryBudget", value<double>()->default_value(0), "RAM budget in MB shared by the running jobs. 0 uses 80% of the available memory.")
+  ("memoryMargin", value<double>()->default_value(1.1), "Factor applied to every job's estimated peak memory. The summary lists the estimate and the measured peak RSS of each job to calibrate it.")
+  ("workers", value<int>()->default_value(0), "Maximum number of jobs running at once. 0 uses the number of cores.")
+  ("force", value<bool>()->default_value(false), "Whether or not to rerun jobs whose completion marker says they are done.")
+  ("dryRun", value<bool>()->default_value(false), "Whether or not to only print the estimates, without running anything.")
+  ("summary", value<string>()->default_value("schedule.json"), "JSON file the outcome of every job is written to.")
+  ;
+
+  variables_map vm;
+  store(parse_command_line(argc, argv, desc), vm);
+  notify(vm);
+
+  if (vm.count("help")) {
+    cout << desc << "\n";
+    return 1;
+  }
+
+  if (vm.count("jobs") == 0) {
+    cout << "Need to specify a job list. Exiting." << "\n";
+    return 1;
+  }
+
+  int numCores = max(1, (int)thread::hardware_concurrency());
+  int numWorkers = vm["workers"].as<int>() > 0 ? vm["workers"].as<int>() : numCores;
+  double budgetBytes = vm["memoryBudget"].as<double>() > 0 ? vm["memoryBudget"].as<double>() * 1e6 : 0.8 * AvailableBytes();
+  if (budgetBytes <= 0) {
+    cout << "Unable to read the available memory; set --memoryBudget. Exiting." << "\n";
+    return 1;
+  }
+
+  // Bad job lists, missing inputs and unreadable cost matrices stop the run before any job starts.
+  vector<Job> jobs;
+  int preprocessThreads;
+  Schedule schedule;
+  schedule.budgetBytes = budgetBytes;
+  try {
+    jobs = ReadJobList(vm["jobs"].as<string>());
+    numWorkers = min(numWorkers, max(1, (int)jobs.size()));
+    preprocessThreads = max(1, numCores / numWorkers);
+
+    for (Job& job : jobs) {
+      string inputDir = JobOption(job, "inputDir", "");
+      vector<string> files = GetNumpyFiles(inputDir);
+      if (files.empty()) {
+        throw std::runtime_error("No cost matrices in " + inputDir + " for job " + job.name + ".");
+      }
+      int rows;
+      CostMatrixShape(files[0], &rows, &job.numFrames);
+      job.numViews = files.size();
+      job.numPitch = stoi(JobOption(job, "pitchViews", "0"));
+      if (job.numPitch == 0) {
+        job.numPitch = CountPitchViews(files);
+      }
+      job.estimatedBytes = vm["memoryMargin"].as<double>() * EstimateJobBytes(job, preprocessThreads);
+
+      job.skipped = !vm["force"].as<bool>() && IsDone(job);
+      cout << job.name << ": " << job.numViews << " views x " << job.numFrames << " frames, estimated peak " << job.estimatedBytes / 1e6 << " MB" << (job.skipped ? ", done before." : ".") << endl;
+      if (job.estimatedBytes > budgetBytes && !job.skipped) {
+        cout << "Warning: " << job.name << " is estimated over the budget of " << budgetBytes / 1e6 << " MB and will run alone." << endl;
+      }
+      if (!job.skipped) {
+        schedule.pending.push_back(&job);
+      }
+    }
+  }
+  catch (const std::exception& e) {
+    cout << e.what() << " Exiting." << endl;
+    return 1;
+  }
+  sort(schedule.pending.begin(), schedule.pending.end(), [](const Job* a, const Job* b) { return a->estimatedBytes > b->estimatedBytes; });
+  schedule.total = schedule.pending.size();
+  cout << schedule.total << " of " << jobs.size() << " jobs to run on " << numWorkers << " workers within " << budgetBytes / 1e6 << " MB." << endl;
+
+  if (!vm["dryRun"].as<bool>()) {
+    vector<thread> workers;
+    for (int w = 0; w < numWorkers; w++) {
+      workers.push_back(thread([&]() {
+        for (Job* job = schedule.Take(); job != NULL; job = schedule.Take()) {
+          RunJob(job, vm["main"].as<string>(), preprocessThreads);
+          if (job->exitCode == 0) {
+            WriteDoneMarker(*job);
+          }
+          schedule.Finish(job);
+        }
+      }));
+    }
+    for (auto& w : workers) {
+      w.join();
+    }
+  }
+
+  int numFailed = 0;
+  json reports = json::array();
+  for (const Job& job : jobs) {
+    reports.push_back(JobToJson(job));
+    numFailed += !job.skipped && job.exitCode != 0 && !vm["dryRun"].as<bool>();
+  }
+  std::ofstream o(vm["summary"].as<string>());
+  o << std::setw(4) << json{{"budgetKB", (long)(budgetBytes / 1024)}, {"workers", numWorkers}, {"jobs", reports}} << endl;
+  cout << "Wrote " << vm["summary"].as<string>() << ". " << numFailed << " jobs failed." << endl;
+  return numFailed > 0 ? 1 : 0;
+}
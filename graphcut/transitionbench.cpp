@@ -0,0 +1,148 @@
+// Microbenchmark of the runtime transition table (vdtransitions.h) against walking the cut lists the way the player did
+// (List.Contains, FindIndex and Max in GatedClip.Transition). Replays every (view, frame) of a gate in a random view order, checks
+// that both give the same transition and prints the mean and worst time per frame of each.
+//
+// Compile together with the library source, e.g.:
+//   g++ transitionbench.cpp vdtransitions.cpp -lboost_program_options -o transitionbench --std=c++17 -O3
+#include "vdtransitions.h"
+#include <boost/program_options.hpp>
+#include <nlohmann/json.hpp>
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <stdio.h>
+
+using namespace std;
+using namespace boost::program_options;
+using namespace nlohmann;
+
+// The lookup of GatedClip.Transition, on the lists.
+vdt_transition WalkLists(const vector<vector<int>>& cut, const vector<vector<int>>& valid, const vector<vector<float>>& extraCosts, int view, int frame) {
+  const vector<int>& frames = cut[view];
+  if (frames.empty()) {
+    return vdt_transition{frame + 1, 0, VDT_CONTINUE, 0};
+  }
+  auto it = find(frames.begin(), frames.end(), frame);
+  if (it != frames.end()) {
+    int index = it - frames.begin();
+    return vdt_transition{valid[view][index], extraCosts[view][index], VDT_BACKWARD, 0};
+  }
+  int lastCut = *max_element(frames.begin(), frames.end());
+  if (frame > lastCut) {
+    int index = find(frames.begin(), frames.end(), lastCut) - frames.begin();
+    return vdt_transition{valid[view][index], extraCosts[view][index], VDT_LATE, 0};
+  }
+  return vdt_transition{frame + 1, 0, VDT_CONTINUE, 0};
+}
+
+// Cut of a long synthetic gate: the last cutLength frames before the gate of every view loop back by loopLength frames.
+void SyntheticCut(int numViews, int gateFrame, int cutLength, int loopLength, vector<vector<int>>* cut, vector<vector<int>>* valid, vector<vector<float>>* extraCosts) {
+  for (int v = 0; v < numViews; v++) {
+    vector<int> frames, targets;
+    vector<float> costs;
+    int first = max(loopLength, gateFrame - cutLength - v % 7);
+    for (int f = first; f <= gateFrame; f++) {
+      frames.push_back(f);
+      targets.push_back(f - loopLength);
+      costs.push_back(0);
+    }
+    cut->push_back(frames);
+    valid->push_back(targets);
+    extraCosts->push_back(costs);
+  }
+}
+
+template <typename T> vector<vector<T>> ReadJson(string filename) {
+  std::ifstream i(filename);
+  json j;
+  i >> j;
+  return j.get<vector<vector<T>>>();
+}
+
+int main(int argc, char **argv)
+{
+  options_description desc("Allowed options");
+  desc.add_options()
+  ("help", "Print help message.")
+  ("resultsDir", value<string>(), "Directory with cut.json, valid.json and extraCosts.json of a gate. Without it, a synthetic gate is used.")
+  ("gateFrame,G", value<int>()->default_value(5000), "Gate frame.")
+  ("views", value<int>()->default_value(40), "Number of views of the synthetic gate.")
+  ("cutLength", value<int>()->default_value(2000), "Number of cut frames per view of the synthetic gate.")
+  ("repeats", value<int>()->default_value(10), "Number of passes over all (view, frame) pairs.")
+  ;
+
+  variables_map vm;
+  store(parse_command_line(argc, argv, desc), vm);
+  notify(vm);
+
+  if (vm.count("help")) {
+    cout << desc << "\n";
+    return 1;
+  }
+
+  int gateFrame = vm["gateFrame"].as<int>();
+  vector<vector<int>> cut, valid;
+  vector<vector<float>> extraCosts;
+  vdt_table* table;
+  if (vm.count("resultsDir")) {
+    string dir = vm["resultsDir"].as<string>() + "/";
+    cut = ReadJson<int>(dir + "cut.json");
+    valid = ReadJson<int>(dir + "valid.json");
+    extraCosts = ReadJson<float>(dir + "extraCosts.json");
+    table = vdt_load((dir + "cut.json").c_str(), (dir + "valid.json").c_str(), (dir + "extraCosts.json").c_str(), gateFrame);
+  }
+  else {
+    SyntheticCut(vm["views"].as<int>(), gateFrame, vm["cutLength"].as<int>(), 60, &cut, &valid, &extraCosts);
+    string dir = "transitionbench_";
+    std::ofstream((dir + "cut.json").c_str()) << json(cut);
+    std::ofstream((dir + "valid.json").c_str()) << json(valid);
+    std::ofstream((dir + "extraCosts.json").c_str()) << json(extraCosts);
+    table = vdt_load((dir + "cut.json").c_str(), (dir + "valid.json").c_str(), (dir + "extraCosts.json").c_str(), gateFrame);
+  }
+  if (table == NULL) {
+    cout << "Unable to load the gate: " << vdt_last_error() << ". Exiting." << "\n";
+    return 1;
+  }
+  int numViews = vdt_num_views(table);
+  int numFrames = vdt_num_frames(table);
+  cout << numViews << " views x " << numFrames << " frames." << endl;
+
+  // Same order for both, so the caches see the same access pattern.
+  vector<pair<int, int>> queries;
+  mt19937 rng(1);
+  for (int f = 0; f < numFrames; f++) {
+    queries.push_back(make_pair((int)(rng() % numViews), f));
+  }
+
+  double tableNs = 0, listNs = 0, tableMaxNs = 0, listMaxNs = 0;
+  int mismatches = 0;
+  long checksum = 0;
+  for (int r = 0; r < vm["repeats"].as<int>(); r++) {
+    for (auto& q : queries) {
+      auto start = chrono::steady_clock::now();
+      vdt_transition t;
+      vdt_lookup(table, q.first, q.second, &t);
+      auto middle = chrono::steady_clock::now();
+      vdt_transition expected = WalkLists(cut, valid, extraCosts, q.first, q.second);
+      auto end = chrono::steady_clock::now();
+
+      double ns = chrono::duration<double, nano>(middle - start).count();
+      tableNs += ns;
+      tableMaxNs = max(tableMaxNs, ns);
+      ns = chrono::duration<double, nano>(end - middle).count();
+      listNs += ns;
+      listMaxNs = max(listMaxNs, ns);
+      mismatches += t.target != expected.target || t.kind != expected.kind || t.cost != expected.cost;
+      checksum += t.target + expected.target;
+    }
+  }
+  double lookups = (double)vm["repeats"].as<int>() * queries.size();
+  printf("table: %.1f ns per frame, worst %.0f ns\n", tableNs / lookups, tableMaxNs);
+  printf("lists: %.1f ns per frame, worst %.0f ns\n", listNs / lookups, listMaxNs);
+  printf("%d mismatches (checksum %ld)\n", mismatches, checksum);
+  vdt_free(table);
+  return mismatches > 0 ? 1 : 0;
+}
@@ -0,0 +1,256 @@
+// Headless checks of the runtime transition table (vdtransitions.h): loading from .json files and from a result bundle, lookups
+// against the list search of the player (StoryPoint.ReachedCutFrame, FindJumpToFrame and PastLastCutFrame in Utils.cs, as used by
+// GatedClip.Transition), frames and views outside the table, forward costs, and the error returns for missing or corrupt files.
+// Prints every failed check and exits with 1 if there was one.
+//
+// Compile together with the library source, e.g.:
+//   g++ transitiontest.cpp vdtransitions.cpp -o transitiontest --std=c++17 -O3
+#include "vdtransitions.h"
+#include "resultbundle.h"
+#include <nlohmann/json.hpp>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace nlohmann;
+
+int numChecks = 0;
+int numFailed = 0;
+
+void Check(bool ok, const string& what) {
+  numChecks++;
+  if (!ok) {
+    numFailed++;
+    cout << "FAILED: " << what << endl;
+  }
+}
+
+// Ports of the StoryPoint methods (Utils.cs) that GatedClip.Transition used before the table.
+bool ReachedCutFrame(const vector<vector<int>>& cut, int view, int frame) {
+  if (cut.empty()) {
+    return false;
+  }
+  return find(cut[view].begin(), cut[view].end(), frame) != cut[view].end();
+}
+
+bool PastLastCutFrame(const vector<vector<int>>& cut, int view, int frame) {
+  if (cut.empty()) {
+    return false;
+  }
+  return frame > *max_element(cut[view].begin(), cut[view].end());
+}
+
+int FindCutIndex(const vector<vector<int>>& cut, int view, int frame) {
+  return find(cut[view].begin(), cut[view].end(), frame) - cut[view].begin();
+}
+
+int FindJumpToFrame(const vector<vector<int>>& cut, const vector<vector<int>>& valid, int view, int frame) {
+  return valid[view][FindCutIndex(cut, view, frame)];
+}
+
+// The decision of GatedClip.Transition before the gate, for a view whose cut is not empty (views with an empty cut are target
+// views, which Transition returns early for).
+vdt_transition ExpectedTransition(const vector<vector<int>>& cut, const vector<vector<int>>& valid, const vector<vector<float>>& extraCosts, int view, int frame) {
+  if (ReachedCutFrame(cut, view, frame)) {
+    return vdt_transition{FindJumpToFrame(cut, valid, view, frame), extraCosts[view][FindCutIndex(cut, view, frame)], VDT_BACKWARD, 0};
+  }
+  if (PastLastCutFrame(cut, view, frame)) {
+    int lastCutFrame = *max_element(cut[view].begin(), cut[view].end());
+    return vdt_transition{FindJumpToFrame(cut, valid, view, lastCutFrame), extraCosts[view][FindCutIndex(cut, view, lastCutFrame)], VDT_LATE, 0};
+  }
+  return vdt_transition{frame + 1, 0, VDT_CONTINUE, 0};
+}
+
+void WriteFile(const string& filename, const string& contents) {
+  std::ofstream o(filename, ios::binary);
+  o << contents;
+}
+
+// Filtered cost matrix in the OpenCV FileStorage layout that viewdeptextures writes to {view}_cost_matrices.xml.
+void WriteCostMatrixXml(const string& filename, const vector<vector<float>>& matrix) {
+  std::ofstream o(filename);
+  o << "<?xml version=\"1.0\"?>\n<opencv_storage>\n<filtered_costs type_id=\"opencv-matrix\">\n  <rows>" << matrix.size() << "</rows>\n  <cols>"
+    << matrix[0].size() << "</cols>\n  <dt>f</dt>\n  <data>\n";
+  for (const vector<float>& row : matrix) {
+    for (float value : row) {
+      o << "    " << value;
+    }
+    o << "\n";
+  }
+  o << "  </data></filtered_costs>\n</opencv_storage>\n";
+}
+
+bool SameTransition(const vdt_transition& a, const vdt_transition& b) {
+  return a.target == b.target && a.cost == b.cost && a.kind == b.kind;
+}
+
+bool SameTables(const vdt_table* a, const vdt_table* b) {
+  if (vdt_num_views(a) != vdt_num_views(b) || vdt_num_frames(a) != vdt_num_frames(b)) {
+    return false;
+  }
+  for (int v = 0; v < vdt_num_views(a); v++) {
+    for (int f = 0; f < vdt_num_frames(a); f++) {
+      vdt_transition ta, tb;
+      vdt_lookup(a, v, f, &ta);
+      vdt_lookup(b, v, f, &tb);
+      if (!SameTransition(ta, tb) || !(ta.forwardCost == tb.forwardCost || (isinf(ta.forwardCost) && isinf(tb.forwardCost)))) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+int main()
+{
+  char dirTemplate[] = "/tmp/transitiontest_XXXXXX";
+  if (mkdtemp(dirTemplate) == NULL) {
+    cout << "Unable to create a temporary directory. Exiting." << "\n";
+    return 1;
+  }
+  string dir = string(dirTemplate) + "/";
+
+  // Gate at frame 12. View 0 is a target view (empty cut). View 1 has unordered cut frames, a repeated frame (the first occurrence
+  // wins, like FindIndex) and a pause (target == frame). View 2 ends its cut before the gate frame, so frames after it are late.
+  int gateFrame = 12;
+  vector<vector<int>> cut = {{}, {10, 12, 11, 12, 9}, {3, 5, 4}};
+  vector<vector<int>> valid = {{}, {2, 4, 11, 7, 1}, {0, 1, 2}};
+  vector<vector<float>> extraCosts = {{}, {0, 0.5f, 0, 3, 0}, {1.25f, 0, 2}};
+  WriteFile(dir + "cut.json", json(cut).dump());
+  WriteFile(dir + "valid.json", json(valid).dump());
+  WriteFile(dir + "extraCosts.json", json(extraCosts).dump());
+
+  // The same gate as a bundle, with the filtered cost matrices of views 1 and 2 (rows past them are +inf in the table).
+  vector<vector<float>> filtered1(10, vector<float>(14)), filtered2(13, vector<float>(14));
+  for (int r = 0; r < 13; r++) {
+    for (int c = 0; c < 14; c++) {
+      if (r < 10) {
+        filtered1[r][c] = r * 100 + c + 0.25f;
+      }
+      filtered2[r][c] = r + c * 0.5f;
+    }
+  }
+  vector<float> flat1, flat2;
+  for (auto& row : filtered1) {
+    flat1.insert(flat1.end(), row.begin(), row.end());
+  }
+  for (auto& row : filtered2) {
+    flat2.insert(flat2.end(), row.begin(), row.end());
+  }
+  resultbundle::BundleWriter writer;
+  writer.AddRagged("cut", cut);
+  writer.AddRagged("valid", valid);
+  writer.AddRagged("extraCosts", extraCosts);
+  writer.AddMatrix("filtered_1", flat1.data(), 10, 14, 14 * sizeof(float));
+  writer.AddMatrix("filtered_2", flat2.data(), 13, 14, 14 * sizeof(float));
+  string bundle = dir + "results.vdtb";
+  writer.Write(bundle);
+  WriteCostMatrixXml(dir + "1_cost_matrices.xml", filtered1);
+  WriteCostMatrixXml(dir + "2_cost_matrices.xml", filtered2);
+
+  // Loading.
+  vdt_table* table = vdt_load((dir + "cut.json").c_str(), (dir + "valid.json").c_str(), (dir + "extraCosts.json").c_str(), gateFrame);
+  Check(table != NULL, string("vdt_load from .json files: ") + vdt_last_error());
+  vdt_table* bundleTable = vdt_load(bundle.c_str(), bundle.c_str(), bundle.c_str(), gateFrame);
+  Check(bundleTable != NULL, string("vdt_load from a bundle: ") + vdt_last_error());
+  if (table == NULL || bundleTable == NULL) {
+    cout << numChecks << " checks, " << numFailed << " failed." << endl;
+    return 1;
+  }
+  Check(vdt_num_views(table) == 3, "3 views");
+  Check(vdt_num_frames(table) == gateFrame + 1, "frames 0..gateFrame");
+  Check(SameTables(table, bundleTable), "the .json and bundle tables are the same");
+
+  // Lookups against the list search.
+  for (int v = 1; v < 3; v++) {
+    for (int f = 0; f <= gateFrame; f++) {
+      vdt_transition t;
+      int found = vdt_lookup(table, v, f, &t);
+      vdt_transition expected = ExpectedTransition(cut, valid, extraCosts, v, f);
+      Check(found == 1 && SameTransition(t, expected), "view " + to_string(v) + ", frame " + to_string(f) + ": got " + to_string(t.target) + " (kind " + to_string(t.kind) + "), expected " + to_string(expected.target) + " (kind " + to_string(expected.kind) + ")");
+    }
+  }
+  vdt_transition t;
+  vdt_lookup(table, 1, 12, &t);
+  Check(t.kind == VDT_BACKWARD && t.target == 4 && t.cost == 0.5f, "repeated cut frame takes its first arc");
+  vdt_lookup(table, 1, 11, &t);
+  Check(t.kind == VDT_BACKWARD && t.target == 11, "pause arc");
+  vdt_lookup(table, 2, 8, &t);
+  Check(t.kind == VDT_LATE && t.target == 1 && t.cost == 0, "late frame takes the last cut frame's arc");
+  for (int f = 0; f <= gateFrame; f++) {
+    vdt_lookup(table, 0, f, &t);
+    Check(t.kind == VDT_CONTINUE && t.target == f + 1, "target view continues at frame " + to_string(f));
+  }
+
+  // Outside the table.
+  vector<pair<int, int>> outside = {{1, -1}, {1, gateFrame + 1}, {1, 100000}, {-1, 3}, {3, 3}};
+  for (auto& q : outside) {
+    vdt_transition o;
+    int found = vdt_lookup(table, q.first, q.second, &o);
+    Check(found == 0 && o.kind == VDT_CONTINUE && o.target == q.second + 1 && isinf(o.forwardCost), "view " + to_string(q.first) + ", frame " + to_string(q.second) + " is outside the table");
+  }
+  vdt_lookup(NULL, 0, 0, &t);
+  Check(t.kind == VDT_CONTINUE && vdt_num_views(NULL) == 0 && vdt_num_frames(NULL) == 0, "NULL table");
+
+  // Forward costs, from the .xml files and from the bundle.
+  int forwardTarget = 6;
+  vdt_lookup(table, 1, 0, &t);
+  Check(isinf(t.forwardCost) && !vdt_can_jump_forward(table, 1, 0, 1e30f), "no forward costs before they are loaded");
+  Check(vdt_load_forward_costs(table, 1, (dir + "1_cost_matrices.xml").c_str(), forwardTarget) == 1, string("forward costs of view 1 from .xml: ") + vdt_last_error());
+  Check(vdt_load_forward_costs(table, 2, (dir + "2_cost_matrices.xml").c_str(), forwardTarget) == 1, string("forward costs of view 2 from .xml: ") + vdt_last_error());
+  Check(vdt_load_forward_costs(bundleTable, 1, bundle.c_str(), forwardTarget) == 1, string("forward costs of view 1 from the bundle: ") + vdt_last_error());
+  Check(vdt_load_forward_costs(bundleTable, 2, bundle.c_str(), forwardTarget) == 1, string("forward costs of view 2 from the bundle: ") + vdt_last_error());
+  for (int f = 0; f <= gateFrame; f++) {
+    vdt_lookup(table, 1, f, &t);
+    Check(f < 10 ? t.forwardCost == filtered1[f][forwardTarget] : isinf(t.forwardCost), "forward cost of view 1, frame " + to_string(f));
+    vdt_lookup(table, 2, f, &t);
+    Check(t.forwardCost == filtered2[f][forwardTarget], "forward cost of view 2, frame " + to_string(f));
+  }
+  Check(SameTables(table, bundleTable), "the .json and bundle tables are the same with forward costs");
+  Check(vdt_can_jump_forward(table, 2, 4, filtered2[4][forwardTarget]) && !vdt_can_jump_forward(table, 2, 4, filtered2[4][forwardTarget] - 0.01f), "vdt_can_jump_forward compares with the threshold");
+  Check(!vdt_can_jump_forward(table, 1, 11, 1e30f), "no forward jump past the cost matrix");
+
+  // Errors.
+  WriteFile(dir + "corrupt.json", "[[1, 2], [3");
+  WriteFile(dir + "short.json", json(vector<vector<int>>{{1}, {2}}).dump());
+  WriteFile(dir + "corrupt.vdtb", "VDTB not a bundle");
+  WriteFile(dir + "empty.vdtb", "");
+  WriteFile(dir + "truncated.xml", "<opencv_storage><filtered_costs><rows>10</rows><cols>14</cols><data>1 2 3</data></filtered_costs></opencv_storage>");
+  vector<vector<string>> badInputs = {
+    {dir + "missing.json", dir + "valid.json", dir + "extraCosts.json"},
+    {dir + "cut.json", dir + "corrupt.json", dir + "extraCosts.json"},
+    {dir + "cut.json", dir + "valid.json", dir + "short.json"},
+    {dir + "missing.vdtb", dir + "missing.vdtb", dir + "missing.vdtb"},
+    {dir + "corrupt.vdtb", dir + "corrupt.vdtb", dir + "corrupt.vdtb"},
+    {dir + "empty.vdtb", dir + "empty.vdtb", dir + "empty.vdtb"}};
+  for (auto& files : badInputs) {
+    vdt_table* bad = vdt_load(files[0].c_str(), files[1].c_str(), files[2].c_str(), gateFrame);
+    Check(bad == NULL && string(vdt_last_error()) != "", "vdt_load fails on " + files[0] + ", " + files[1] + ", " + files[2]);
+    vdt_free(bad);
+  }
+  vector<pair<int, string>> badCosts = {{1, dir + "missing_cost_matrices.xml"}, {1, dir + "truncated.xml"}, {1, dir + "corrupt.vdtb"}, {0, bundle},
+                                        {3, dir + "1_cost_matrices.xml"}, {-1, dir + "1_cost_matrices.xml"}};
+  for (auto& bad : badCosts) {
+    Check(vdt_load_forward_costs(table, bad.first, bad.second.c_str(), forwardTarget) == 0 && string(vdt_last_error()) != "", "vdt_load_forward_costs fails for view " + to_string(bad.first) + " of " + bad.second);
+  }
+  Check(vdt_load_forward_costs(table, 1, (dir + "1_cost_matrices.xml").c_str(), 14) == 0, "forward target outside the cost matrix");
+  Check(vdt_load_forward_costs(NULL, 0, (dir + "1_cost_matrices.xml").c_str(), forwardTarget) == 0, "vdt_load_forward_costs on a NULL table");
+  vdt_lookup(table, 1, 4, &t);
+  Check(t.forwardCost == filtered1[4][forwardTarget], "failed loads keep the forward costs");
+
+  vdt_free(table);
+  vdt_free(bundleTable);
+  for (const char* name : {"cut.json", "valid.json", "extraCosts.json", "results.vdtb", "1_cost_matrices.xml", "2_cost_matrices.xml", "corrupt.json",
+                           "short.json", "corrupt.vdtb", "empty.vdtb", "truncated.xml"}) {
+    unlink((dir + name).c_str());
+  }
+  rmdir(dirTemplate);
+  cout << numChecks << " checks, " << numFailed << " failed." << endl;
+  return numFailed > 0 ? 1 : 0;
+}
@@ -0,0 +1,208 @@
+// Runtime transition table of a gate (see vdtransitions.h): a dense numViews x numFrames array of vdt_transition, built from the cut,
+// valid arcs and extra costs written by viewdeptextures. Gives the same decisions as walking the lists in GatedClip.Transition
+// (ReachedCutFrame, FindJumpToFrame, PastLastCutFrame) and View.CanJumpTo, in O(1) per frame.
+//
+// Only needs nlohmann/json; no OpenCV. Compile as a shared library, e.g.:
+//   g++ vdtransitions.cpp -shared -fPIC -fvisibility=hidden -o libvdtransitions.so --std=c++17 -O3
+// (-o libvdtransitions.dylib on Mac) and copy it to Assets/Plugins of the Unity project.
+#include "vdtransitions.h"
+#include "resultbundle.h"
+#include <stdlib.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <nlohmann/json.hpp>
+
+using namespace std;
+
+struct vdt_table {
+  int numViews;
+  int numFrames;
+  vector<vdt_transition> entries;  // Row-major by view.
+};
+
+namespace {
+
+thread_local string lastError;
+
+bool IsBundle(const string& filename) {
+  return filename.size() >= 5 && filename.compare(filename.size() - 5, 5, ".vdtb") == 0;
+}
+
+// One list per view, from a .json file or the named section of a bundle.
+template <typename T> vector<vector<T>> ReadLists(const string& filename, const string& section) {
+  if (IsBundle(filename)) {
+    return resultbundle::BundleReader(filename).Lists<T>(section);
+  }
+  std::ifstream i(filename);
+  if (!i) {
+    throw std::runtime_error("Unable to open " + filename);
+  }
+  nlohmann::json j;
+  i >> j;
+  return j.get<vector<vector<T>>>();
+}
+
+// Column of a filtered cost matrix for the first numRows rows, from an OpenCV FileStorage .xml file (<rows>, <cols> and row-major
+// <data>, as written by viewdeptextures) or the filtered_{view} section of a bundle. Rows past the matrix are +inf.
+vector<float> ReadCostColumn(const string& filename, int view, int column, int numRows) {
+  vector<float> values(numRows, INFINITY);
+  if (IsBundle(filename)) {
+    resultbundle::BundleReader reader(filename);
+    int rows, cols;
+    const float* data = reader.Matrix("filtered_" + to_string(view), &rows, &cols);
+    if (column < 0 || column >= cols) {
+      throw std::runtime_error("Forward target " + to_string(column) + " is outside the cost matrix in " + filename);
+    }
+    for (int r = 0; r < min(rows, numRows); r++) {
+      values[r] = data[(size_t)r * cols + column];
+    }
+    return values;
+  }
+
+  std::ifstream i(filename);
+  if (!i) {
+    throw std::runtime_error("Unable to open " + filename);
+  }
+  stringstream buffer;
+  buffer << i.rdbuf();
+  string xml = buffer.str();
+  auto tagValue = [&](const string& tag) {
+    size_t start = xml.find("<" + tag + ">");
+    if (start == string::npos) {
+      throw std::runtime_error("No <" + tag + "> in " + filename);
+    }
+    return start + tag.size() + 2;
+  };
+  int rows = atoi(xml.c_str() + tagValue("rows"));
+  int cols = atoi(xml.c_str() + tagValue("cols"));
+  if (column < 0 || column >= cols) {
+    throw std::runtime_error("Forward target " + to_string(column) + " is outside the cost matrix in " + filename);
+  }
+  const char* p = xml.c_str() + tagValue("data");
+  size_t lastIndex = (size_t)min(rows, numRows) * cols;
+  for (size_t index = 0; index < lastIndex; index++) {
+    char* end;
+    float value = strtof(p, &end);
+    if (end == p) {
+      throw std::runtime_error("Truncated <data> in " + filename);
+    }
+    p = end;
+    if (index % cols == (size_t)column) {
+      values[index / cols] = value;
+    }
+  }
+  return values;
+}
+
+vdt_table* Build(const vector<vector<int>>& cut, const vector<vector<int>>& valid, const vector<vector<float>>& extraCosts, int gateFrame) {
+  if (cut.size() != valid.size() || cut.size() != extraCosts.size()) {
+    throw std::runtime_error("cut, valid and extraCosts have different numbers of views.");
+  }
+  int lastFrame = gateFrame;
+  for (size_t v = 0; v < cut.size(); v++) {
+    if (cut[v].size() != valid[v].size() || cut[v].size() != extraCosts[v].size()) {
+      throw std::runtime_error("cut, valid and extraCosts of view " + to_string(v) + " have different lengths.");
+    }
+    for (int frame : cut[v]) {
+      if (frame < 0) {
+        throw std::runtime_error("Negative cut frame in view " + to_string(v) + ".");
+      }
+      lastFrame = max(lastFrame, frame);
+    }
+  }
+
+  vdt_table* table = new vdt_table();
+  table->numViews = cut.size();
+  table->numFrames = lastFrame + 1;
+  table->entries.resize((size_t)table->numViews * table->numFrames);
+  for (int v = 0; v < table->numViews; v++) {
+    vdt_transition* row = &table->entries[(size_t)v * table->numFrames];
+    for (int f = 0; f < table->numFrames; f++) {
+      row[f] = vdt_transition{f + 1, 0, VDT_CONTINUE, INFINITY};
+    }
+    if (cut[v].empty()) {  // View satisfies the gate condition.
+      continue;
+    }
+    // Backwards, so the first occurrence of a frame wins, like FindIndex.
+    for (int i = cut[v].size() - 1; i >= 0; i--) {
+      row[cut[v][i]] = vdt_transition{valid[v][i], extraCosts[v][i], VDT_BACKWARD, INFINITY};
+    }
+    int lastCut = *max_element(cut[v].begin(), cut[v].end());
+    for (int f = lastCut + 1; f < table->numFrames; f++) {
+      row[f] = row[lastCut];
+      row[f].kind = VDT_LATE;
+    }
+  }
+  return table;
+}
+
+}  // namespace
+
+extern "C" {
+
+vdt_table* vdt_load(const char* cutFile, const char* validFile, const char* extraCostsFile, int gateFrame) {
+  try {
+    return Build(ReadLists<int>(cutFile, "cut"), ReadLists<int>(validFile, "valid"), ReadLists<float>(extraCostsFile, "extraCosts"), gateFrame);
+  }
+  catch (const std::exception& e) {
+    lastError = e.what();
+    return NULL;
+  }
+}
+
+int vdt_load_forward_costs(vdt_table* table, int view, const char* costMatrixFile, int forwardTarget) {
+  if (table == NULL || view < 0 || view >= table->numViews) {
+    lastError = "vdt_load_forward_costs: No view " + to_string(view) + " in the table.";
+    return 0;
+  }
+  try {
+    vector<float> costs = ReadCostColumn(costMatrixFile, view, forwardTarget, table->numFrames);
+    vdt_transition* row = &table->entries[(size_t)view * table->numFrames];
+    for (int f = 0; f < table->numFrames; f++) {
+      row[f].forwardCost = costs[f];
+    }
+    return 1;
+  }
+  catch (const std::exception& e) {
+    lastError = e.what();
+    return 0;
+  }
+}
+
+void vdt_free(vdt_table* table) {
+  delete table;
+}
+
+const char* vdt_last_error(void) {
+  return lastError.c_str();
+}
+
+int vdt_num_views(const vdt_table* table) {
+  return table == NULL ? 0 : table->numViews;
+}
+
+int vdt_num_frames(const vdt_table* table) {
+  return table == NULL ? 0 : table->numFrames;
+}
+
+int vdt_lookup(const vdt_table* table, int view, int frame, vdt_transition* out) {
+  if (table == NULL || view < 0 || view >= table->numViews || frame < 0 || frame >= table->numFrames) {
+    *out = vdt_transition{frame + 1, 0, VDT_CONTINUE, INFINITY};
+    return 0;
+  }
+  *out = table->entries[(size_t)view * table->numFrames + frame];
+  return 1;
+}
+
+int vdt_can_jump_forward(const vdt_table* table, int view, int frame, float threshold) {
+  vdt_transition t;
+  vdt_lookup(table, view, frame, &t);
+  return t.forwardCost <= threshold;
+}
+
+}  // extern "C"
@@ -0,0 +1,67 @@
+/* C interface of the runtime transition table (libvdtransitions, see vdtransitions.cpp), for the Unity player (TransitionTable.cs) and
+ * other native hosts. The table is built once from the graph-cut outputs of a gate; afterwards every lookup is an array access, so it
+ * can run every frame without allocating.
+ *
+ * The lookups (vdt_lookup, vdt_can_jump_forward, vdt_num_views and vdt_num_frames) are safe to call concurrently on the same table.
+ * vdt_load_forward_costs changes its entries, so it must not run concurrently with anything else on that table. Functions that can
+ * fail return NULL or 0 and leave a message in vdt_last_error (per thread). */
+#ifndef VDTRANSITIONS_H
+#define VDTRANSITIONS_H
+
+#include <stdint.h>
+
+#if defined(_WIN32)
+#define VDT_API __declspec(dllexport)
+#else
+#define VDT_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* What the player does after showing a frame of a view. */
+enum {
+  VDT_CONTINUE = 0,  /* Play the next frame. */
+  VDT_BACKWARD = 1,  /* Cut frame: jump back along the valid arc (target == frame means pause there). */
+  VDT_LATE = 2       /* Past the view's last cut frame (a missed update): take the last cut frame's arc. */
+};
+
+typedef struct {
+  int32_t target;     /* Frame to play next. */
+  float cost;         /* Extra cost of the arc (extraCosts.json; 0 when within the perceptual threshold). 0 for VDT_CONTINUE. */
+  int32_t kind;       /* VDT_CONTINUE, VDT_BACKWARD or VDT_LATE. */
+  float forwardCost;  /* Filtered cost of jumping from this frame to the forward target, or +inf if not loaded. */
+} vdt_transition;
+
+typedef struct vdt_table vdt_table;
+
+/* Builds the table of a gate from its cut, valid arcs and extra costs. Each path is a .json file or a results.vdtb bundle (the same
+ * bundle can be passed three times). Frames 0..max(gateFrame, last cut frame) are covered. Returns NULL on error. */
+VDT_API vdt_table* vdt_load(const char* cutFile, const char* validFile, const char* extraCostsFile, int gateFrame);
+
+/* Fills the forward costs of one view: the filtered cost of jumping from each frame to forwardTarget (the frame a "jump immediately"
+ * gate skips to). costMatrixFile is the view's {view}_cost_matrices.xml or a results.vdtb bundle with a filtered_{view} section.
+ * Returns 0 on error. */
+VDT_API int vdt_load_forward_costs(vdt_table* table, int view, const char* costMatrixFile, int forwardTarget);
+
+VDT_API void vdt_free(vdt_table* table);
+
+VDT_API const char* vdt_last_error(void);
+
+VDT_API int vdt_num_views(const vdt_table* table);
+
+VDT_API int vdt_num_frames(const vdt_table* table);
+
+/* Transition after frame of view. Outside the table, returns 0 and sets out to VDT_CONTINUE to frame + 1 with an infinite
+ * forward cost. */
+VDT_API int vdt_lookup(const vdt_table* table, int view, int frame, vdt_transition* out);
+
+/* Whether the forward cost from frame of view is within threshold. */
+VDT_API int vdt_can_jump_forward(const vdt_table* table, int view, int frame, float threshold);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -11,6 +11,27 @@
 #include <float.h>
 #include <limits>
 #include <nlohmann/json.hpp>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <sstream>
+#include <condition_variable>
+#include <deque>
+#include <climits>
+#include <set>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <atomic>
+#include <exception>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "resultbundle.h"
+#include "maxflowengines.h"
+#include "profiler.h"
+#include "costmatrix.h"
 #define INFINITE_D (numeric_limits<float>::max())
 
 using namespace std;
@@ -19,10 +40,70 @@ using namespace cv;
 using namespace boost::program_options;
 using namespace boost::filesystem;
 using namespace nlohmann;
+using costmatrix::CostMatrix;
 
 
 typedef Graph<float,float,float> GraphType;
 
+// One line of progress output, written whole when it goes out of scope: e.g. LogLine() << "Gate " << name;. Gates of a batch, server
+// requests and the preprocessing pipeline log from their own threads, and their lines must not interleave.
+class LogLine {
+public:
+  ~LogLine() {
+    static mutex m;
+    lock_guard<mutex> lock(m);
+    cout << line.str() << endl;
+  }
+
+  template <typename T> LogLine& operator<<(const T& value) {
+    line << value;
+    return *this;
+  }
+
+private:
+  ostringstream line;
+};
+
+// Blocking queue with a fixed capacity, used between the stages of the per-view preprocessing pipeline.
+template <typename T> class BoundedQueue {
+public:
+  BoundedQueue(int capacity) : capacity(capacity), closed(false) {}
+  
+  void push(T item) {
+    unique_lock<mutex> lock(m);
+    notFull.wait(lock, [this]() { return items.size() < capacity; });
+    items.push_back(std::move(item));
+    notEmpty.notify_one();
+  }
+  
+  // Returns false once the queue is closed and drained.
+  bool pop(T* item) {
+    unique_lock<mutex> lock(m);
+    notEmpty.wait(lock, [this]() { return !items.empty() || closed; });
+    if (items.empty()) {
+      return false;
+    }
+    *item = std::move(items.front());
+    items.pop_front();
+    notFull.notify_one();
+    return true;
+  }
+  
+  void close() {
+    lock_guard<mutex> lock(m);
+    closed = true;
+    notEmpty.notify_all();
+  }
+  
+private:
+  int capacity;
+  bool closed;
+  deque<T> items;
+  mutex m;
+  condition_variable notEmpty;
+  condition_variable notFull;
+};
+
 void writeAllArcsJson(vector<vector<int>> allArcs, variables_map vm) {
   string outputDir = vm["outputDir"].as<string>();
   path outputPath = outputDir / "allArcs.json";
@@ -43,7 +124,7 @@ void writeAllArcsJson(vector<vector<int>> allArcs, variables_map vm) {
 }
 
 void InvertTarget(int* x1, int* x2, int numViewingDirection) {
-  cout << "INVERSE GATE! BEFORE: " << *x1 << " to " << *x2 << endl;
+  LogLine() << "INVERSE GATE! BEFORE: " << *x1 << " to " << *x2;
   int originalX1 = *x1;
   *x1 = *x2 + 1;
   *x2 = originalX1 - 1;
@@ -54,23 +135,55 @@ void InvertTarget(int* x1, int* x2, int numViewingDirection) {
   if (*x2 < 0) {
     *x2 = *x2 + numViewingDirection;
   }
-  cout << "INVERSE GATE! After: " << *x1 << " and " << *x2 << endl;
+  LogLine() << "INVERSE GATE! After: " << *x1 << " and " << *x2;
 }
 
-Mat SetupGraph(GraphType* g, const vector<vector<int>>& bestArcs, const vector<vector<int>>& allArcs, const vector<Mat>& costMatrices, int gateFrame, variables_map vm)
-{
-  assert(bestArcs.size() == costMatrices.size()); // Number of viewing directions.
-  assert(bestArcs[0].size() == costMatrices[0].rows); // Number of (total) frames in each viewing direction.
-  int numRawFrames = gateFrame + 2; // Only creating nodes for frames up to gate frame + 1 (so cutting on gate frame is also possible).
+// Views form a grid of numPitch rows of numYaw views, ordered by pitch, then yaw: view = pitch * numYaw + yaw. Yaw wraps around, pitch
+// does not. A single pitch row is the original ring of views.
+struct ViewGrid {
+  int numYaw;
+  int numPitch;
+};
 
-  int numFrames = numRawFrames + numRawFrames - 1;  // Number of nodes per viewing direction, including buffer nodes.
-  int numViewingDirection = bestArcs.size();
-  int numNodes = numFrames * bestArcs.size();  // Total number of nodes in the graph
+ViewGrid GetViewGrid(int numViews, variables_map vm) {
+  ViewGrid grid;
+  grid.numPitch = max(1, vm["pitchViews"].as<int>());
+  grid.numYaw = numViews / grid.numPitch;
+  assert(grid.numYaw * grid.numPitch == numViews);
+  return grid;
+}
+
+// Neighbours of every view within radius steps along each axis: yaw +1, -1, +2, -2, ... (wrapping around), then pitch +1, -1, ...
+// (where they exist). The neighbours of view v are neighbours[(*offsets)[v]] to neighbours[(*offsets)[v + 1] - 1].
+vector<int> ViewNeighbours(ViewGrid grid, int radius, vector<int>* offsets) {
+  vector<int> neighbours;
+  offsets->assign(1, 0);
+  for (int pitch = 0; pitch < grid.numPitch; pitch++) {
+    for (int yaw = 0; yaw < grid.numYaw; yaw++) {
+      for (int d = 1; d <= radius; d++) {
+        neighbours.push_back(pitch * grid.numYaw + (yaw + d) % grid.numYaw);
+        neighbours.push_back(pitch * grid.numYaw + ((yaw - d) % grid.numYaw + grid.numYaw) % grid.numYaw);
+      }
+      for (int d = 1; d <= radius; d++) {
+        if (pitch + d < grid.numPitch) {
+          neighbours.push_back((pitch + d) * grid.numYaw + yaw);
+        }
+        if (pitch - d >= 0) {
+          neighbours.push_back((pitch - d) * grid.numYaw + yaw);
+        }
+      }
+      offsets->push_back(neighbours.size());
+    }
+  }
+  return neighbours;
+}
+
+// Whether each view satisfies the gate condition. ROIstart and ROIend are yaw indices and apply to every pitch row.
+vector<bool> GateViews(ViewGrid grid, variables_map vm) {
   int x1 = vm["ROIstart"].as<int>();
   int x2 = vm["ROIend"].as<int>();
-  
   if (vm["offscreen"].as<bool>()) {
-    InvertTarget(&x1, &x2, numViewingDirection);
+    InvertTarget(&x1, &x2, grid.numYaw);
   }
   
   int x3 = 10000000;
@@ -78,35 +191,54 @@ Mat SetupGraph(GraphType* g, const vector<vector<int>>& bestArcs, const vector<v
   if (x1 > x2) {
     x3 = 0;
     x4 = x2;
-    x2 = numViewingDirection - 1;
-  }
-
-  g -> add_node(numNodes);
-  
-  Mat edgeCosts(numViewingDirection, numRawFrames - 1, CV_32FC1);
-  
-  // First add all the infinite weights from s and to t.
-  int count = 0;
-  for (int s = 0; s < numNodes; s += numFrames) {
-    count ++;
-    g -> add_tweights( s,   /* capacities */  INFINITE_D, 0 );
+    x2 = grid.numYaw - 1;
   }
-  assert(count == numViewingDirection);
   
-  count = 0;
-  for (int t = numFrames - 1; t < numNodes; t += numFrames) {
-    count++;
-    g -> add_tweights( t,   /* capacities */  0, INFINITE_D);
+  vector<bool> inGate(grid.numYaw * grid.numPitch);
+  for (int v = 0; v < inGate.size(); v++) {
+    int yaw = v % grid.numYaw;
+    inGate[v] = (yaw >= x1 && yaw <= x2) || (yaw >= x3 && yaw <= x4);
   }
+  return inGate;
+}
+
+long PeakRssKB() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;  // Kilobytes on Linux.
+}
+
+// Exact node and edge counts of the graph for numViews views, frames up to gateFrame + 1 and numNeighbours neighbour links in total
+// (see ViewNeighbours), so the graph can be allocated once.
+void GraphSize(int numViews, int gateFrame, int numNeighbours, int* numNodes, int* numEdges) {
+  int numRawFrames = gateFrame + 2;
+  int numFrames = numRawFrames + numRawFrames - 1;
+  *numNodes = numViews * numFrames;
+  *numEdges = (numViews * 2 + numNeighbours) * (numRawFrames - 1);  // Buffer edge, edge to the next frame and neighbour edges per frame.
+}
+
+template <typename G> G* NewGraph(int numViews, variables_map vm) {
+  vector<int> offsets;
+  int numNeighbours = ViewNeighbours(GetViewGrid(numViews, vm), vm["neighbourRadius"].as<int>(), &offsets).size();
+  int numNodes, numEdges;
+  GraphSize(numViews, vm["gateFrame"].as<int>(), numNeighbours, &numNodes, &numEdges);
+  return new G(numNodes, numEdges);
+}
+
+// Raw buffer edge costs (before heuristics) for frames up to the gate frame. Cost determined by bestArcs.
+Mat ComputeBufferEdgeCosts(const vector<vector<int>>& bestArcs, const vector<vector<int>>& allArcs, const vector<CostMatrix>& costMatrices, int gateFrame, variables_map vm)
+{
+  int numRawFrames = gateFrame + 2; // Only creating nodes for frames up to gate frame + 1 (so cutting on gate frame is also possible).
+  int numViewingDirection = bestArcs.size();
+  vector<bool> inGate = GateViews(GetViewGrid(numViewingDirection, vm), vm);
   
-  assert(count == numViewingDirection);
+  Mat edgeCosts(numViewingDirection, numRawFrames - 1, CV_32FC1);
   
-  // Add edges between adjacent frames. Cost determined by bestArcs.
   for (int row = 0; row < numViewingDirection; row++) {
     for (int f = 0; f < numRawFrames - 1; f++) {
       float edgeCost;
       int bestArc = bestArcs[row][f];
-      if ((row >= x1 && row <= x2) || (row >= x3 && row <= x4)) {  // If view satisfies gate condition
+      if (inGate[row]) {  // If view satisfies gate condition
         if (f == numRawFrames - 2) {
           edgeCost = 0;
         }
@@ -116,46 +248,81 @@ Mat SetupGraph(GraphType* g, const vector<vector<int>>& bestArcs, const vector<v
       }
       else if (bestArc < 0) {
         int nextBestArc = allArcs[row][f];
-        float extraCost = nextBestArc >= 0 ? costMatrices[row].at<float>(f, nextBestArc) : 10000000;
+        float extraCost = nextBestArc >= 0 ? costMatrices[row].at(f, nextBestArc) : 10000000;
         edgeCost = extraCost;
       }
       else {
         edgeCost = 0;
       }
       edgeCosts.at<float>(row, f) = edgeCost;
-      
-      g -> add_edge(row * numFrames + 2*f + 1, row * numFrames + 2*f + 2,  INFINITE_D, 0);
     }
   }
-  
-  // Add infinite edges between nodes in adjacent viewing directions.
+  return edgeCosts;
+}
+
+// Infinite edges from each frame to the next frame of the neighbouring views (see ViewNeighbours). The first node of each neighbouring
+// row is computed once per view rather than per edge.
+template <typename G> void AddNeighbourEdges(G* g, ViewGrid grid, int radius, int numRawFrames) {
+  int numFrames = numRawFrames + numRawFrames - 1;
+  int numViewingDirection = grid.numYaw * grid.numPitch;
+  vector<int> offsets;
+  vector<int> neighbourStart = ViewNeighbours(grid, radius, &offsets);
+  for (int& n : neighbourStart) {
+    n *= numFrames;
+  }
   for (int f = 0; f < numRawFrames - 1; f++) {
     for (int row = 0; row < numViewingDirection; row++) {
-      int bottomRow = (row+1) < numViewingDirection ? (row+1) : (row+1-numViewingDirection);
       int nodeCurrent = row * numFrames + 2 * f + 1;
-      int nodeBottom = bottomRow * numFrames + 2 * f + 2;
-      g -> add_edge( nodeCurrent, nodeBottom, INFINITE_D, 0);
-      
-      int topRow = (row-1) >= 0 ? (row-1) : (row-1+numViewingDirection);
-      int nodeTop = topRow * numFrames + 2 * f + 2;
-      nodeCurrent = row * numFrames + 2 * f + 1;
-      g -> add_edge( nodeCurrent, nodeTop, INFINITE_D, 0);
-      
-      int bottomBottomRow = (row+2) < numViewingDirection ? (row+2) : (row+2-numViewingDirection);
-      int nodeBottomBottom = bottomBottomRow * numFrames + 2 * f + 2;
-      nodeCurrent = row * numFrames + 2 * f + 1;
-      g -> add_edge( nodeCurrent, nodeBottomBottom, INFINITE_D, 0);
-      
-      int topTopRow = (row-2) >= 0 ? (row-2) : (row-2+numViewingDirection);
-      int nodeTopTop = topTopRow * numFrames + 2 * f + 2;
-      nodeCurrent = row * numFrames + 2 * f + 1;
-      g -> add_edge( nodeCurrent, nodeTopTop, INFINITE_D, 0);
+      for (int n = offsets[row]; n < offsets[row + 1]; n++) {
+        g -> add_edge(nodeCurrent, neighbourStart[n] + 2 * f + 2, INFINITE_D, 0);
+      }
+    }
+  }
+}
+
+template <typename G> Mat SetupGraph(G* g, const vector<vector<int>>& bestArcs, const vector<vector<int>>& allArcs, const vector<CostMatrix>& costMatrices, int gateFrame, variables_map vm)
+{
+  assert(bestArcs.size() == costMatrices.size()); // Number of viewing directions.
+  assert(bestArcs[0].size() == costMatrices[0].Rows()); // Number of (total) frames in each viewing direction.
+  int numRawFrames = gateFrame + 2; // Only creating nodes for frames up to gate frame + 1 (so cutting on gate frame is also possible).
+
+  int numFrames = numRawFrames + numRawFrames - 1;  // Number of nodes per viewing direction, including buffer nodes.
+  int numViewingDirection = bestArcs.size();
+  int numNodes = numFrames * bestArcs.size();  // Total number of nodes in the graph
+
+  g -> add_node(numNodes);
+  
+  Mat edgeCosts = ComputeBufferEdgeCosts(bestArcs, allArcs, costMatrices, gateFrame, vm);
+  
+  // First add all the infinite weights from s and to t.
+  int count = 0;
+  for (int s = 0; s < numNodes; s += numFrames) {
+    count ++;
+    g -> add_tweights( s,   /* capacities */  INFINITE_D, 0 );
+  }
+  assert(count == numViewingDirection);
+  
+  count = 0;
+  for (int t = numFrames - 1; t < numNodes; t += numFrames) {
+    count++;
+    g -> add_tweights( t,   /* capacities */  0, INFINITE_D);
+  }
+  
+  assert(count == numViewingDirection);
+  
+  // Add edges between adjacent frames.
+  for (int row = 0; row < numViewingDirection; row++) {
+    for (int f = 0; f < numRawFrames - 1; f++) {
+      g -> add_edge(row * numFrames + 2*f + 1, row * numFrames + 2*f + 2,  INFINITE_D, 0);
     }
   }
+  
+  // Add infinite edges between nodes in adjacent viewing directions.
+  AddNeighbourEdges(g, GetViewGrid(numViewingDirection, vm), vm["neighbourRadius"].as<int>(), numRawFrames);
   return edgeCosts;
 }
 
-void AssignEdgeCosts(GraphType* g, const vector<vector<int>>& bestArcs, int gateFrame, const Mat& edgeCosts) {
+template <typename G> void AssignEdgeCosts(G* g, const vector<vector<int>>& bestArcs, int gateFrame, const Mat& edgeCosts) {
   int numRawFrames = gateFrame + 2; // Only creating nodes for frames up to gate frame + 1 (so cutting on gate frame is also possible).
   int numFrames = numRawFrames + numRawFrames - 1;  // Number of nodes per viewing direction, including buffer nodes.
   int numViewingDirection = bestArcs.size();
@@ -171,156 +338,136 @@ bool containedBy(tuple<int, int> block1, tuple<int, int> block2) {  // Is block1
   return get<0>(block2) <= get<0>(block1) && get<1>(block1) <= get<1>(block2);
 }
 
-void UpdateEdgeCosts(Mat* edgeCosts, variables_map vm) {
-  int numViewingDirection = edgeCosts->rows;
-  assert(numViewingDirection == 40);
-  int x1 = vm["ROIstart"].as<int>();
-  int x2 = vm["ROIend"].as<int>();
-  if (vm["offscreen"].as<bool>()) {
-    InvertTarget(&x1, &x2, numViewingDirection);
-  }
-  
-  int x3 = 10000000;
-  int x4 = x3;
-  if (x1 > x2) {
-    x3 = 0;
-    x4 = x2;
-    x2 = numViewingDirection - 1;
-  }
-  
-  int region = vm["loopDuration"].as<int>();
-  
-  vector<vector<tuple<int, int>>> AllBlocks;
-  
-  for (int i = 0; i < edgeCosts->rows; i++) {
-    
-    vector<tuple<int, int>> blocks;
-    
-    if ((i >= x1 && i <= x2) || (i >= x3 && i <= x4)) {
-      AllBlocks.push_back(blocks);
-      continue;
+// Counts, for each block, whether some block of others contains it. Blocks of a row are sorted and disjoint, so a block can only be
+// contained by the last block of others starting at or before it: one sweep over both lists.
+void CountContainingRows(const vector<tuple<int, int>>& blocks, const vector<tuple<int, int>>& others, vector<int>* numContaining) {
+  int o = 0;
+  for (int b = 0; b < blocks.size(); b++) {
+    while (o + 1 < others.size() && get<0>(others[o + 1]) <= get<0>(blocks[b])) {
+      o++;
     }
-    
-    int start = -1;
-    int end = -1;
-    bool insideBlock = false;
-    for (int f = 0; f < edgeCosts->cols; f++) {
-      if (edgeCosts->at<float>(i, f) == 0) {
-        if (!insideBlock) {
-          insideBlock = true;
-          start = f;
-        }
-      }
-      else {
-        if (insideBlock) {
-          insideBlock = false;
-          end = f - 1;
-          blocks.push_back(make_tuple(start, end));
-        }
+    if (o < others.size() && containedBy(blocks[b], others[o])) {
+      (*numContaining)[b]++;
+    }
+  }
+}
+
+// Runs of zero cost (arcs within the thresholds) in a row of buffer edge costs, as (first, last) frames.
+vector<tuple<int, int>> ZeroBlocks(const Mat& edgeCosts, int row) {
+  vector<tuple<int, int>> blocks;
+  int start = -1;
+  int end = -1;
+  bool insideBlock = false;
+  for (int f = 0; f < edgeCosts.cols; f++) {
+    if (edgeCosts.at<float>(row, f) == 0) {
+      if (!insideBlock) {
+        insideBlock = true;
+        start = f;
       }
-      if (f == edgeCosts->cols - 1 && insideBlock) {
+    }
+    else {
+      if (insideBlock) {
         insideBlock = false;
-        end = f;
+        end = f - 1;
         blocks.push_back(make_tuple(start, end));
       }
     }
-    AllBlocks.push_back(blocks);
+    if (f == edgeCosts.cols - 1 && insideBlock) {
+      insideBlock = false;
+      end = f;
+      blocks.push_back(make_tuple(start, end));
+    }
+  }
+  return blocks;
+}
+
+// Replaces the zero costs of the blocks of a row by ramps, so that cuts land away from the block ends.
+void RampBlocks(Mat* edgeCosts, int row, const vector<tuple<int, int>>& blocks, int region, int gateFrame) {
+  for (auto& block : blocks) {
+    int blockLength = get<1>(block) - get<0>(block) + 1;
+    int halfLength = blockLength / 2;
     
-    for (auto& block : blocks) {
-      int blockLength = get<1>(block) - get<0>(block) + 1;
-      int halfLength = blockLength / 2;
+    float slope = 1.0f / (float)(region);
+    for (int s = 0; s < blockLength; s++) {
+      float newCost;
       
-      float slope = 1.0f / (float)(region);
-      for (int s = 0; s < blockLength; s++) {
-        float newCost;
-        
-        if (get<1>(block) != vm["gateFrame"].as<int>() && blockLength < region*2) {
-          slope = 1.0f / (float)(halfLength+1);
-          if (s >= halfLength) {
-            newCost = 1 + slope * (s - halfLength);
-          }
-          else {
-            newCost = 1 + 1 - slope * s;
-          }
+      if (get<1>(block) != gateFrame && blockLength < region*2) {
+        slope = 1.0f / (float)(halfLength+1);
+        if (s >= halfLength) {
+          newCost = 1 + slope * (s - halfLength);
         }
-        else if (s >= blockLength - 1 - region) {
-          if (get<1>(block) == vm["gateFrame"].as<int>()) {
-            newCost = 0;
-          }
-          else {
-            newCost = slope * (s - (blockLength-1 - region));
-          }
+        else {
+          newCost = 1 + 1 - slope * s;
         }
-        else if (s < region) {
-          newCost = 1 - slope * s;
+      }
+      else if (s >= blockLength - 1 - region) {
+        if (get<1>(block) == gateFrame) {
+          newCost = 0;
         }
         else {
-          newCost = 0.f;
+          newCost = slope * (s - (blockLength-1 - region));
         }
-        edgeCosts->at<float>(i, get<0>(block) + s) = newCost;
       }
+      else if (s < region) {
+        newCost = 1 - slope * s;
+      }
+      else {
+        newCost = 0.f;
+      }
+      edgeCosts->at<float>(row, get<0>(block) + s) = newCost;
     }
-    
+  }
+}
+
+// Penalizes the blocks of row r not contained by a block of each adjacent view (see ViewNeighbours with radius 1).
+void PenalizeBlocks(Mat* edgeCosts, int r, const vector<vector<tuple<int, int>>>& AllBlocks, const vector<int>& adjacent, const vector<int>& offsets, vector<int>* numContaining) {
+  numContaining->assign(AllBlocks[r].size(), 0);
+  for (int n = offsets[r]; n < offsets[r + 1]; n++) {
+    CountContainingRows(AllBlocks[r], AllBlocks[adjacent[n]], numContaining);
   }
   
-  for (int r = 0; r < AllBlocks.size(); r++) {
-    int topRow = r - 1;
-    int bottomRow = r+1;
-    
-    
-    if (topRow < 0) {
-      topRow += numViewingDirection;
-    }
-    if (bottomRow >= numViewingDirection) {
-      bottomRow -= numViewingDirection;
+  for (int b = 0; b < AllBlocks[r].size(); b++) {
+    const tuple<int, int>& blockC = AllBlocks[r][b];
+    float verticalPenalty = 0.0f;
+    for (int n = (*numContaining)[b]; n < offsets[r + 1] - offsets[r]; n++) {
+      verticalPenalty += 0.1f;
     }
     
-    if ((r >= x1 && r <= x2) || (r >= x3 && r <= x4)) {
+    // Apply penalty to block.
+    if (verticalPenalty > 0.0f) {
+      for (int s = get<0>(blockC); s <= get<1>(blockC); s++) {
+        edgeCosts->at<float>(r, s) = edgeCosts->at<float>(r, s)  + verticalPenalty;
+      }
+    }
+  }
+}
+
+void UpdateEdgeCosts(Mat* edgeCosts, variables_map vm) {
+  int numViewingDirection = edgeCosts->rows;
+  ViewGrid grid = GetViewGrid(numViewingDirection, vm);
+  vector<bool> inGate = GateViews(grid, vm);
+  
+  int region = vm["loopDuration"].as<int>();
+  
+  vector<vector<tuple<int, int>>> AllBlocks;
+  
+  for (int i = 0; i < edgeCosts->rows; i++) {
+    if (inGate[i]) {
+      AllBlocks.push_back(vector<tuple<int, int>>());
       continue;
     }
-    
-    for (auto & blockC : AllBlocks[r]) {
-      bool overlapsTop = false;
-      bool overlapsBottom = false;
-      
-      if ((topRow >= x1 && topRow <= x2) || (topRow >= x3 && topRow <= x4)) {
-        overlapsTop = false;
-      }
-      else {
-        for (auto& blockT : AllBlocks[topRow]) {
-          if (containedBy(blockC, blockT)) {
-            overlapsTop = true;
-            break;
-          }
-        }
-      }
-      
-      if ((bottomRow >= x1 && bottomRow <= x2) || (bottomRow >= x3 && bottomRow <= x4)) {
-        overlapsBottom = false;
-      }
-      else {
-        for (auto& blockB : AllBlocks[bottomRow]) {
-          if (containedBy(blockC, blockB)) {
-            overlapsBottom = true;
-            break;
-          }
-        }
-      }
-      
-      float verticalPenalty = 0.0f;
-      if (!overlapsTop) {
-        verticalPenalty += 0.1f;
-      }
-      if (!overlapsBottom) {
-        verticalPenalty += 0.1f;
-      }
-      
-      // Apply penalty to block.
-      if (verticalPenalty > 0.0f) {
-        for (int s = get<0>(blockC); s <= get<1>(blockC); s++) {
-          edgeCosts->at<float>(r, s) = edgeCosts->at<float>(r, s)  + verticalPenalty;
-        }
-      }
+    AllBlocks.push_back(ZeroBlocks(*edgeCosts, i));
+    RampBlocks(edgeCosts, i, AllBlocks[i], region, vm["gateFrame"].as<int>());
+  }
+  
+  // Penalize blocks not contained by a block of each adjacent view (yaw -1 and +1, and pitch -1 and +1 where they exist). Views in the
+  // gate have no blocks.
+  vector<int> offsets;
+  vector<int> adjacent = ViewNeighbours(grid, 1, &offsets);
+  vector<int> numContaining;
+  for (int r = 0; r < AllBlocks.size(); r++) {
+    if (!inGate[r]) {
+      PenalizeBlocks(edgeCosts, r, AllBlocks, adjacent, offsets, &numContaining);
     }
   }
 }
@@ -350,7 +497,7 @@ Mat convertDataToMat(NpyArray arr, string saveToFile="") {
   memcpy(M.data, floatArray, height*width*sizeof(float));
   
   if (saveToFile != "") {
-    cout << "Writing cost matrices to " << saveToFile << endl;
+    LogLine() << "Writing cost matrices to " << saveToFile;
     FileStorage file(saveToFile, FileStorage::WRITE);
     file << "raw_costs" << M;
     file.release();
@@ -364,40 +511,280 @@ NpyArray ReadCostMatrix(string filename) {
   return arr;
 }
 
+// Read-only private mapping of a float32, C-order .npy cost matrix. mat wraps the first rows of the mapped data without copying;
+// pages are only read from disk when touched. The mapping (and mat's data) goes away with this object.
+struct MappedCostMatrix {
+  void* addr;
+  size_t length;
+  Mat mat;
+  
+  ~MappedCostMatrix() {
+    munmap(addr, length);
+  }
+};
+
+// Shape and data offset of a float32, C-order .npy file from its first length bytes. Header: magic string, version, header length
+// (2 bytes for version 1, 4 bytes after), then a python dict.
+size_t ParseNpyHeader(const char* bytes, size_t length, string filename, int* rows, int* cols) {
+  if (length < 12 || memcmp(bytes, "\x93NUMPY", 6) != 0) {
+    throw std::runtime_error("ParseNpyHeader: Not a .npy file " + filename);
+  }
+  size_t headerStart = bytes[6] == 1 ? 10 : 12;
+  size_t headerLength = bytes[6] == 1 ? *(const uint16_t*)(bytes + 8) : *(const uint32_t*)(bytes + 8);
+  if (headerStart + headerLength > length) {
+    throw std::runtime_error("ParseNpyHeader: Truncated header in " + filename);
+  }
+  string header(bytes + headerStart, headerLength);
+  if (header.find("'descr': '<f4'") == string::npos || header.find("'fortran_order': False") == string::npos) {
+    throw std::runtime_error("ParseNpyHeader: Expected a float32, C-order matrix in " + filename);
+  }
+  size_t shapeStart = header.find('(', header.find("'shape'")) + 1;
+  *rows = stoi(header.substr(shapeStart));
+  *cols = stoi(header.substr(header.find(',', shapeStart) + 1));
+  return headerStart + headerLength;
+}
+
+// Shape of a .npy or .vdcm cost matrix, from its header only.
+void CostMatrixShape(string filename, int* rows, int* cols) {
+  if (path(filename).extension() == ".vdcm") {
+    costmatrix::CostMatrixFile file(filename);
+    *rows = file.Size();
+    *cols = file.Size();
+    return;
+  }
+  std::ifstream in(filename, std::ios::binary);
+  vector<char> bytes(4096);
+  in.read(bytes.data(), bytes.size());
+  ParseNpyHeader(bytes.data(), in.gcount(), filename, rows, cols);
+}
+
+// The first maxRows rows of a float32, C-order .npy cost matrix, read from the file without loading the rest.
+Mat ReadCostMatrixRows(string filename, int maxRows) {
+  std::ifstream in(filename, std::ios::binary);
+  if (!in) {
+    throw std::runtime_error("ReadCostMatrixRows: Unable to open file " + filename);
+  }
+  vector<char> bytes(4096);
+  in.read(bytes.data(), bytes.size());
+  int rows, cols;
+  size_t dataStart = ParseNpyHeader(bytes.data(), in.gcount(), filename, &rows, &cols);
+  Mat M(min(rows, maxRows), cols, CV_32FC1);
+  in.clear();
+  in.seekg(dataStart);
+  in.read((char*)M.data, (size_t)M.rows * cols * sizeof(float));
+  if (!in || (size_t)in.gcount() != (size_t)M.rows * cols * sizeof(float)) {
+    throw std::runtime_error("ReadCostMatrixRows: Truncated data in " + filename);
+  }
+  return M;
+}
+
+shared_ptr<MappedCostMatrix> MapCostMatrix(string filename, int maxRows) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("MapCostMatrix: Unable to open file " + filename);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw std::runtime_error("MapCostMatrix: Unable to stat file " + filename);
+  }
+  size_t length = st.st_size;
+  void* addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    throw std::runtime_error("MapCostMatrix: Unable to map file " + filename);
+  }
+  shared_ptr<MappedCostMatrix> mapped(new MappedCostMatrix());
+  mapped->addr = addr;
+  mapped->length = length;
+  
+  const char* bytes = (const char*)addr;
+  int rows, cols;
+  size_t dataStart = ParseNpyHeader(bytes, length, filename, &rows, &cols);
+  if (dataStart + (size_t)rows * cols * sizeof(float) > length) {
+    throw std::runtime_error("MapCostMatrix: Truncated data in " + filename);
+  }
+  
+  int bandRows = min(rows, maxRows);
+  mapped->mat = Mat(bandRows, cols, CV_32FC1, (void*)(bytes + dataStart));
+  // The band is read whole, but diagonalBoxFilter walks it from the bottom up, so only ask for readahead of the band.
+  madvise(addr, min(length, dataStart + (size_t)bandRows * cols * sizeof(float)), MADV_WILLNEED);
+  return mapped;
+}
+
+// Compares m(r, c) with m(c, r) tile by tile, without materializing the transpose. Stops at the first mismatch.
+// A band of the first rows (rows < cols) is checked against its leading square block.
+bool isSymmetric(const Mat& m) {
+  if (m.rows > m.cols) {
+    return false;
+  }
+  const int tile = 64;
+  for (int r0 = 0; r0 < m.rows; r0 += tile) {
+    for (int c0 = 0; c0 <= r0; c0 += tile) {
+      for (int r = r0; r < min(r0 + tile, m.rows); r++) {
+        const float* row = m.ptr<float>(r);
+        for (int c = c0; c < min(c0 + tile, r); c++) {
+          if (row[c] != m.at<float>(c, r)) {
+            return false;
+          }
+        }
+      }
+    }
+  }
+  return true;
+}
+
 void checkForSymmetry(const Mat& m) {
-  Mat t;
-  transpose(m, t);
-  Mat diff = m != t;
-  assert(countNonZero(diff) == 0);
+  assert(isSymmetric(m));
+}
+
+// Same result as filter2D with a (2L-1)x(2L-1) kernel that is 1 on the lower half of its main diagonal (zero border):
+// out(r, c) = sum of m(r+d, c+d) for d = 0..L-1. Computed as running sums along the diagonals, one row at a time from the
+// bottom up, so the cost is O(rows * cols) regardless of L and the inner loops are contiguous (vectorized by the compiler).
+// Sums are kept in double so long diagonals don't drift. clampInput treats negative inputs as 0 without writing to m.
+// For a band of the first rows, the last length-1 rows of the output are incomplete.
+void diagonalBoxFilter(const Mat& m, Mat* out, int length, bool clampInput=false) {
+  int rows = m.rows;
+  int cols = m.cols;
+  Mat result(rows, cols, CV_32FC1);
+  vector<double> below(cols + 1, 0.0);  // Window sums of row r+1, padded so below[cols] is 0.
+  vector<double> current(cols + 1, 0.0);
+  
+  for (int r = rows - 1; r >= 0; r--) {
+    const float* src = m.ptr<float>(r);
+    double* cur = current.data();
+    const double* prev = below.data();
+    for (int c = 0; c < cols; c++) {
+      cur[c] = (clampInput && src[c] < 0 ? 0 : src[c]) + prev[c + 1];
+    }
+    if (r + length < rows) {  // Element leaving the window.
+      const float* leaving = m.ptr<float>(r + length) + length;
+      for (int c = 0; c < cols - length; c++) {
+        cur[c] -= (clampInput && leaving[c] < 0 ? 0 : leaving[c]);
+      }
+    }
+    float* dst = result.ptr<float>(r);
+    for (int c = 0; c < cols; c++) {
+      dst[c] = (float)cur[c];
+    }
+    swap(current, below);
+  }
+  *out = result;
+}
+
+void convolveGaussianKernel(Mat* m, int loopDuration, bool checkSymmetry=true, bool clampInput=false) {  // cross fade time in number of frames.
+  if (checkSymmetry) {
+    checkForSymmetry(*m);
+  }
+  diagonalBoxFilter(*m, m, loopDuration, clampInput);
 }
 
-void convolveGaussianKernel(Mat* m, int loopDuration) {  // cross fade time in number of frames.
-  checkForSymmetry(*m);
-  Mat kernel = Mat::zeros( Size(loopDuration*2-1, loopDuration*2-1), CV_32F );
-  for(int i = loopDuration - 1; i < loopDuration*2-1; i ++) {
-    kernel.at<float>(i, i) = 1;
+// Prefix-minimum records of each row of a filtered cost matrix, restricted to backward arcs (c <= r). A record is a column c with
+// m(r, c) <= min(m(r, 0..c-1)), so the cheapest arc within columns 0..k is the last record at or before k. Built once per view in
+// O(n^2); afterwards any (perceptual threshold, minLength) query takes O(log n) per row instead of rescanning the row.
+// Random rows have ~ln(n) records, but a decreasing or constant row (e.g. a static shot, all zeros after filtering) has one per column.
+// A row with more than a third of its length in records keeps its costs instead (4 instead of 12 bytes a column) and is scanned, so
+// the index never exceeds the float32 backward triangle of the matrix, and queries on such rows take O(n).
+struct ArcIndex {
+  vector<int> rowStart;  // Records of row r are at [rowStart[r], rowStart[r+1]).
+  vector<int> columns;
+  vector<float> costs;
+  vector<int> firstOfCost;  // Column of the first record with the same cost (ties: m(r, c) == current min).
+  vector<size_t> denseStart;  // Costs of columns 0..r of row r at denseCosts[denseStart[r]], or NO_DENSE_ROW if the row has records.
+  vector<float> denseCosts;
+};
+
+const size_t NO_DENSE_ROW = numeric_limits<size_t>::max();
+
+// Cheapest backward arc of a row within columns 0..lastColumn: its cost, its last column and the first column of the same cost.
+struct PrefixMin {
+  float cost;
+  int column;
+  int firstColumn;
+};
+
+ArcIndex BuildArcIndex(const Mat& m) {
+  assert(m.rows <= m.cols);
+  ArcIndex index;
+  index.rowStart.push_back(0);
+  for (int r = 0; r < m.rows; r++) {
+    const float* row = m.ptr<float>(r);
+    size_t rowStart = index.columns.size();
+    float minCost = numeric_limits<float>::infinity();
+    int firstColumn = -1;
+    for (int c = 0; c <= r; c++) {
+      if (row[c] <= minCost) {
+        if (row[c] < minCost) {
+          firstColumn = c;
+        }
+        minCost = row[c];
+        index.columns.push_back(c);
+        index.costs.push_back(minCost);
+        index.firstOfCost.push_back(firstColumn);
+      }
+    }
+    if (3 * (index.columns.size() - rowStart) > (size_t)r + 1) {
+      index.columns.resize(rowStart);
+      index.costs.resize(rowStart);
+      index.firstOfCost.resize(rowStart);
+      index.denseStart.push_back(index.denseCosts.size());
+      index.denseCosts.insert(index.denseCosts.end(), row, row + r + 1);
+    }
+    else {
+      index.denseStart.push_back(NO_DENSE_ROW);
+    }
+    index.rowStart.push_back(index.columns.size());
+  }
+  return index;
+}
+
+// Cheapest arc of row at or before lastColumn. False if there is none (lastColumn < 0).
+bool FindPrefixMin(const ArcIndex& index, int row, int lastColumn, PrefixMin* result) {
+  if (lastColumn < 0) {
+    return false;
+  }
+  if (index.denseStart[row] != NO_DENSE_ROW) {
+    const float* costs = &index.denseCosts[index.denseStart[row]];
+    result->cost = numeric_limits<float>::infinity();
+    for (int c = 0; c <= min(lastColumn, row); c++) {
+      if (costs[c] <= result->cost) {
+        if (costs[c] < result->cost) {
+          result->firstColumn = c;
+        }
+        result->cost = costs[c];
+        result->column = c;
+      }
+    }
+    return true;
+  }
+  auto begin = index.columns.begin() + index.rowStart[row];
+  auto end = index.columns.begin() + index.rowStart[row + 1];
+  auto it = upper_bound(begin, end, lastColumn);
+  if (it == begin) {
+    return false;
   }
-  filter2D(*m, *m, -1 , kernel, Point(-1,-1), 0, BORDER_ISOLATED);
+  int record = (it - 1) - index.columns.begin();
+  result->cost = index.costs[record];
+  result->column = index.columns[record];
+  result->firstColumn = index.firstOfCost[record];
+  return true;
 }
 
 // For one viewing direction. allArcs: Arcs with minimum perceptual cost, given that min loop length is met. May be above perceptual threshold.
-vector<int> FindValidArcs(Mat* m, float perceptualThreshold, int minLength, vector<int>* allArcs) {
+vector<int> FindValidArcs(const ArcIndex& index, float perceptualThreshold, int minLength, vector<int>* allArcs) {
   vector<int> arcs;
-  assert(m->rows == m->cols);
+  int rows = index.rowStart.size() - 1;
   
-  for (int r = 0; r < m->rows; r++) {
+  for (int r = 0; r < rows; r++) {
     int arc = -1;
-    float minCost = INFINITE_D;
-    float minCostUnderThres = INFINITE_D;
     int minArcTo = -1;
-    for (int c = 0; c <= r - minLength; c++) {
-      if (m->at<float>(r, c) < minCost) {
-        minCost =m->at<float>(r, c);
-        minArcTo = c;  // Arc with minimum perceptual cost, given that min loop length is met.
+    PrefixMin min;
+    if (FindPrefixMin(index, r, r - minLength, &min)) {
+      if (min.cost < INFINITE_D) {
+        minArcTo = min.firstColumn;  // Arc with minimum perceptual cost, given that min loop length is met (first of ties).
       }
-      if (m->at<float>(r, c) <= perceptualThreshold && m->at<float>(r, c) <= minCostUnderThres) {
-        arc = c;  // Arc with minimum perceptual cost, given that min loop length AND perceptual threshold are met.
-        minCostUnderThres = m->at<float>(r, c);
+      if (min.cost <= perceptualThreshold) {
+        arc = min.column;  // Arc with minimum perceptual cost, given that min loop length AND perceptual threshold are met (last of ties).
       }
     }
 
@@ -410,60 +797,303 @@ vector<int> FindValidArcs(Mat* m, float perceptualThreshold, int minLength, vect
   return arcs;  // Arcs with minimum perceptual cost, given that min loop length AND perceptual threshold are met.
 }
 
-Mat ConstructGraph(GraphType* g, variables_map vm, vector<string> filePaths, vector<vector<int>>* bestArcs, vector<vector<int>>* allArcs, vector<Mat>* costMatrices, float perceptualThreshold, bool writeCosts) {
-  
-  for (int p = 0; p < filePaths.size(); p++) {
-    Mat mat = convertDataToMat(ReadCostMatrix(filePaths.at(p)), "");
-    mat.setTo(0, mat < 0);
-    
-    costMatrices->push_back(mat);
+// First maxRows rows of a packed .vdcm cost matrix (see costmatrix.h), unpacked for the filter. maxError is the largest error of the
+// file's encoding.
+Mat ReadPackedCostMatrix(string filename, int maxRows, float* maxError) {
+  costmatrix::CostMatrixFile file(filename);
+  Mat mat(min(maxRows, file.Size()), file.Size(), CV_32FC1);
+  file.ReadRows(mat.rows, mat.ptr<float>(0), mat.step);
+  *maxError = file.Header().maxError;
+  return mat;
+}
+
+struct ViewJob {
+  int index;
+  Mat mat;
+  shared_ptr<MappedCostMatrix> mapping;  // Set if mat wraps a mapped file.
+};
+
+// Filtered cost matrix of one viewing direction. Identical to what the serial path computes.
+// A read-only input (e.g. a mapped file) is never written; the result is a new matrix.
+void FilterCostMatrix(Mat* mat, int loopDuration, bool checkSymmetry, bool readOnly) {
+  if (loopDuration > 1) {
+    convolveGaussianKernel(mat, loopDuration, checkSymmetry, true);  // Equation (1) in Appendix. Clamps negative costs to 0 on the fly.
   }
-  
-  // Convolve gaussian kernel of size loopDuration.
+  else if (readOnly) {
+    *mat = mat->clone();
+  }
+  mat->setTo(0, *mat < 0);
+}
+
+// Per-view preprocessing as a pipeline: loader -> filter -> arc finder -> (optional) writer. Views are independent until SetupGraph, so
+// disk reads overlap with filtering, and the bounded queues cap the number of matrices in flight. Results are stored by view index.
+// The arc finder always builds the arc index of each view; if findArcs is false, bestArcs and allArcs are left untouched.
+void PreprocessViews(variables_map vm, vector<string> filePaths, bool writeCosts, bool findArcs, float perceptualThreshold, vector<CostMatrix>* costMatrices, vector<ArcIndex>* arcIndices, vector<vector<int>>* bestArcs, vector<vector<int>>* allArcs) {
+  int numViews = filePaths.size();
   int loopDuration = vm["loopDuration"].as<int>();
+  int minLength = vm["minLength"].as<int>();
+  bool checkSymmetry = vm["checkSymmetry"].as<bool>();
+  int numThreads = vm["preprocessThreads"].as<int>() > 0 ? vm["preprocessThreads"].as<int>() : max(1, (int)thread::hardware_concurrency());
+  int queueDepth = max(1, vm["queueDepth"].as<int>());
+  bool mmapCosts = vm["mmapCosts"].as<bool>();
+  costmatrix::Encoding encoding;
+  bool knownEncoding = costmatrix::ParseEncoding(vm["costEncoding"].as<string>(), &encoding);
+  assert(knownEncoding);
+  float inputError = 0;  // Largest error of the packed input files.
+  
+  // With gateRowsOnly, only the rows the graph and the cut post-processing use (frames up to the gate frame) are kept. The filter
+  // reads loopDuration-1 rows past them.
+  int outputRows = vm["gateRowsOnly"].as<bool>() ? vm["gateFrame"].as<int>() + 1 : INT_MAX;
+  int loadRows = outputRows == INT_MAX ? INT_MAX : outputRows + max(loopDuration, 1) - 1;
+  
   if (loopDuration > 1) {
     cout << "Loop duration is " << loopDuration << " frames." << endl;
-    for (int m = 0; m < costMatrices->size(); m++) {
-      convolveGaussianKernel(&(costMatrices->at(m)), loopDuration);  // Equation (1) in Appendix.
-      costMatrices->at(m).setTo(0, costMatrices->at(m) < 0);
+  }
+  
+  profiler::Scope scope("PreprocessViews");
+  scope.Arg("views", numViews);
+  costMatrices->assign(numViews, CostMatrix());
+  arcIndices->assign(numViews, ArcIndex());
+  if (findArcs) {
+    bestArcs->assign(numViews, vector<int>());
+    allArcs->assign(numViews, vector<int>());
+  }
+  
+  BoundedQueue<ViewJob> loaded(queueDepth);
+  BoundedQueue<ViewJob> filtered(queueDepth);
+  BoundedQueue<ViewJob> toWrite(queueDepth);
+  
+  // An exception escaping a thread would terminate the process. The first one (e.g. costs that do not fit float16) is kept, the
+  // remaining views are drained without work, and it is rethrown once every thread has joined.
+  exception_ptr error;
+  mutex errorMutex;
+  auto keepError = [&]() {
+    lock_guard<mutex> lock(errorMutex);
+    if (!error) {
+      error = current_exception();
     }
+  };
+  auto failed = [&]() {
+    lock_guard<mutex> lock(errorMutex);
+    return (bool)error;
+  };
+  
+  thread loader([&]() {
+    for (int p = 0; p < numViews && !failed(); p++) {
+      ViewJob job;
+      try {
+        profiler::Scope scope("loadCostMatrix", "io");  // Excludes waiting for the filters.
+        scope.Arg("view", p);
+        if (path(filePaths.at(p)).extension() == ".vdcm") {
+          float maxError;
+          job = ViewJob{p, ReadPackedCostMatrix(filePaths.at(p), loadRows, &maxError), NULL};
+          inputError = max(inputError, maxError);
+        }
+        else if (mmapCosts) {
+          shared_ptr<MappedCostMatrix> mapping = MapCostMatrix(filePaths.at(p), loadRows);
+          job = ViewJob{p, mapping->mat, mapping};
+        }
+        else if (loadRows < INT_MAX) {
+          job = ViewJob{p, ReadCostMatrixRows(filePaths.at(p), loadRows), NULL};
+        }
+        else {
+          job = ViewJob{p, convertDataToMat(ReadCostMatrix(filePaths.at(p)), ""), NULL};
+        }
+      }
+      catch (...) {
+        keepError();
+        break;
+      }
+      loaded.push(job);
+    }
+    loaded.close();
+  });
+  
+  vector<thread> filters;
+  for (int t = 0; t < numThreads; t++) {
+    filters.push_back(thread([&]() {
+      ViewJob job;
+      while (loaded.pop(&job)) {
+        if (failed()) {
+          continue;
+        }
+        try {
+          profiler::Scope scope("filterCostMatrix");
+          scope.Arg("view", job.index);
+          FilterCostMatrix(&job.mat, loopDuration, checkSymmetry, job.mapping != NULL);
+          job.mapping.reset();  // Unmap as soon as the filtered copy exists.
+        }
+        catch (...) {
+          keepError();
+          continue;
+        }
+        if (job.mat.rows > outputRows) {
+          job.mat = job.mat.rowRange(0, outputRows);
+        }
+        filtered.push(job);
+      }
+    }));
   }
   
-  if (writeCosts) {
-    for (int p = 0; p < costMatrices->size(); p++) {
+  vector<thread> arcFinders;
+  for (int t = 0; t < numThreads; t++) {
+    arcFinders.push_back(thread([&]() {
+      ViewJob job;
+      while (filtered.pop(&job)) {
+        if (failed()) {
+          continue;
+        }
+        try {
+          profiler::Scope scope("findArcs");
+          scope.Arg("view", job.index);
+          (*arcIndices)[job.index] = BuildArcIndex(job.mat);  // From the exact filtered costs.
+          if (findArcs) {
+            vector<int> allArcsInView;
+            (*bestArcs)[job.index] = FindValidArcs((*arcIndices)[job.index], perceptualThreshold, minLength, &allArcsInView);
+            (*allArcs)[job.index] = allArcsInView;
+          }
+          (*costMatrices)[job.index] = CostMatrix(job.mat.ptr<float>(0), job.mat.step, job.mat.rows, job.mat.cols, encoding);
+        }
+        catch (...) {
+          keepError();
+          continue;
+        }
+        if (writeCosts) {
+          toWrite.push(job);
+        }
+      }
+    }));
+  }
+  
+  thread writer([&]() {
+    ViewJob job;
+    while (toWrite.pop(&job)) {
+      if (failed()) {
+        continue;
+      }
+      profiler::Scope scope("writeCostMatrix", "io");
+      scope.Arg("view", job.index);
       path outputDir = path(vm["outputDir"].as<string>());
-      path fn = path( to_string(p) + "_cost_matrices.xml");
+      path fn = path( to_string(job.index) + "_cost_matrices.xml");
       string finalStr = (outputDir / fn).string();
-
-      cout << "Writing matrix to " << finalStr << endl;
+      
       FileStorage file(finalStr, FileStorage::WRITE);
-      file << "filtered_costs" << (*costMatrices)[p];
+      file << "filtered_costs" << job.mat;
       file.release();
     }
+  });
+  
+  loader.join();
+  for (auto& t : filters) {
+    t.join();
+  }
+  filtered.close();
+  for (auto& t : arcFinders) {
+    t.join();
+  }
+  toWrite.close();
+  writer.join();
+  if (error) {
+    rethrow_exception(error);
   }
   
-  // Find best arcs for each frame based on perceptual threshold, minLength
-  for (int m = 0; m < costMatrices->size(); m++) {
-    vector<int> allArcsInView;
-    vector<int> arcs = FindValidArcs(&(costMatrices->at(m)), perceptualThreshold, vm["minLength"].as<int>(), &allArcsInView);
-    assert(arcs.size() == costMatrices->at(m).rows);
-    assert(allArcsInView.size() == costMatrices->at(m).rows);
-    bestArcs->push_back(arcs);  // Best backward arc satisfying all user thresholds (perceptual threshold AND minlength). If none exists, then -1.
-    allArcs->push_back(allArcsInView);  // Backward arc with lowest perceptual cost that satisfies minLength. May not satisfy user-set perceptual threshold.
+  if (writeCosts) {
+    cout << "Wrote " << numViews << " filtered cost matrices to " << vm["outputDir"].as<string>() << endl;
+  }
+  
+  double packedBytes = 0;
+  double denseBytes = 0;
+  float storedError = 0;
+  for (const CostMatrix& m : *costMatrices) {
+    packedBytes += m.Bytes();
+    denseBytes += (double)m.Rows() * m.Cols() * sizeof(float);
+    storedError = max(storedError, m.MaxError());
+  }
+  cout << "Cost matrices take " << packedBytes / 1e6 << " MB (packed " << costmatrix::EncodingName(encoding) << ", " << denseBytes / 1e6 << " MB dense)." << endl;
+  if (inputError > 0) {
+    // The filter sums loopDuration input costs per entry.
+    float filteredError = inputError * max(loopDuration, 1);
+    cout << "Input costs are quantized to within " << inputError << ": arcs are selected from costs within " << filteredError << " of the exact ones, so a selected arc costs at most " << 2 * filteredError << " more than the cheapest." << endl;
+  }
+  if (storedError > 0) {
+    cout << "Stored costs are within " << storedError << " of the filtered costs. Arcs are selected before quantization; buffer edge and extra costs use the stored values." << endl;
+  }
+}
+
+// Read, clamp and filter the cost matrices. Independent of the perceptual threshold, so only needs to happen once per run.
+void LoadCostMatrices(variables_map vm, vector<string> filePaths, vector<CostMatrix>* costMatrices, vector<ArcIndex>* arcIndices, bool writeCosts) {
+  PreprocessViews(vm, filePaths, writeCosts, false, 0, costMatrices, arcIndices, NULL, NULL);
+}
+
+// Engines that need an upper bound on the min cut before the buffer edges are added (see QuantizedGraph) get the cost of cutting
+// every view at the same frame, the cheapest of which is always a valid cut.
+template <typename G> void SetCutBound(G* g, const Mat& edgeCosts) {
+}
+
+void SetCutBound(QuantizedGraph* g, const Mat& edgeCosts) {
+  double bound = DBL_MAX;
+  for (int f = 0; f < edgeCosts.cols; f++) {
+    double columnCost = 0;
+    for (int r = 0; r < edgeCosts.rows; r++) {
+      columnCost += edgeCosts.at<float>(r, f);
+    }
+    bound = min(bound, columnCost);
+  }
+  assert(bound < FLT_MAX);
+  g->set_cut_bound(bound);
+}
+
+// Engine options besides the graph size: the threads of the parallel push-relabel engine (--maxflowThreads, 0 for all cores).
+template <typename G> void ConfigureEngine(G* g, variables_map vm) {
+}
+
+void ConfigureEngine(ParallelPushRelabelGraph* g, variables_map vm) {
+  if (vm["maxflowThreads"].as<int>() > 0) {
+    g->set_num_threads(vm["maxflowThreads"].as<int>());
   }
+}
+
+// Graph for already computed arcs.
+template <typename G> Mat ConstructGraphFromArcs(G* g, variables_map vm, const vector<CostMatrix>& costMatrices, const vector<vector<int>>& bestArcs, const vector<vector<int>>& allArcs) {
   
   // Construct nodes up to gateFrame only.
   int gateFrame = vm["gateFrame"].as<int>();
-  cout << "Gate frame is " << gateFrame << endl;
+  LogLine() << "Gate frame is " << gateFrame;
   Mat edgeCosts;
  
-  edgeCosts = SetupGraph(g, *bestArcs, *allArcs, *costMatrices, gateFrame, vm);  // Buffer edge costs for entire graph.
+  auto start = chrono::steady_clock::now();
+  profiler::Scope scope("buildGraph");
+  edgeCosts = SetupGraph(g, bestArcs, allArcs, costMatrices, gateFrame, vm);  // Buffer edge costs for entire graph.
   UpdateEdgeCosts(&edgeCosts, vm);  // Update with heuristic weights.
-  AssignEdgeCosts(g, *bestArcs, gateFrame, edgeCosts);  // Apply new edge costs to graph.
+  SetCutBound(g, edgeCosts);
+  AssignEdgeCosts(g, bestArcs, gateFrame, edgeCosts);  // Apply new edge costs to graph.
+  double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+  LogLine() << "Built graph with " << g->get_node_num() << " nodes and " << g->get_arc_num() / 2 << " edges in " << ms << " ms. Peak RSS: " << PeakRssKB() << " KB.";
+  scope.Arg("nodes", g->get_node_num());
+  scope.Arg("edges", g->get_arc_num() / 2);
   
   return edgeCosts;
 }
 
+// Threshold-dependent part of graph construction. costMatrices must already be filtered (see LoadCostMatrices).
+// Find best arcs for each frame based on perceptual threshold, minLength.
+void FindArcs(variables_map vm, const vector<CostMatrix>& costMatrices, const vector<ArcIndex>& arcIndices, float perceptualThreshold, vector<vector<int>>* bestArcs, vector<vector<int>>* allArcs) {
+  profiler::Scope scope("FindArcs");
+  for (int m = 0; m < costMatrices.size(); m++) {
+    vector<int> allArcsInView;
+    vector<int> arcs = FindValidArcs(arcIndices.at(m), perceptualThreshold, vm["minLength"].as<int>(), &allArcsInView);
+    assert(arcs.size() == costMatrices.at(m).Rows());
+    assert(allArcsInView.size() == costMatrices.at(m).Rows());
+    bestArcs->push_back(arcs);  // Best backward arc satisfying all user thresholds (perceptual threshold AND minlength). If none exists, then -1.
+    allArcs->push_back(allArcsInView);  // Backward arc with lowest perceptual cost that satisfies minLength. May not satisfy user-set perceptual threshold.
+  }
+}
+
+template <typename G> Mat ConstructGraphFromCosts(G* g, variables_map vm, const vector<CostMatrix>& costMatrices, const vector<ArcIndex>& arcIndices, vector<vector<int>>* bestArcs, vector<vector<int>>* allArcs, float perceptualThreshold) {
+  FindArcs(vm, costMatrices, arcIndices, perceptualThreshold, bestArcs, allArcs);
+  return ConstructGraphFromArcs(g, vm, costMatrices, *bestArcs, *allArcs);
+}
+
 void writeJson(vector<vector<float>> arr, variables_map vm, string name) {
   string outputDir = vm["outputDir"].as<string>();
   path outputPath = outputDir / name;
@@ -509,19 +1139,71 @@ void writeEdgeCosts(const Mat& edgeCosts, string outputDir) {
   file.release();
 }
 
-int FindMinValidArc(const Mat& m, int row, int firstFrameCut) {
-  float minCost = INFINITE_D;
-  int minArcTo = -1;
-  for (int c = 0; c <= firstFrameCut; c++) {
-    if (m.at<float>(row, c) < minCost) {
-      minCost = m.at<float>(row, c);
-      minArcTo = c;
-    }
+bool WritesJson(variables_map vm) {
+  return vm["outputFormat"].as<string>() != "binary";
+}
+
+bool WritesBinary(variables_map vm) {
+  return vm["outputFormat"].as<string>() != "json";
+}
+
+void addFilteredCosts(resultbundle::BundleWriter* writer, const vector<CostMatrix>& costMatrices) {
+  for (int v = 0; v < costMatrices.size(); v++) {
+    writer->AddMatrix("filtered_" + to_string(v), costMatrices[v].Rows(), costMatrices[v].Cols(), [&costMatrices, v](int r, float* out) { costMatrices[v].Row(r, out); });
+  }
+}
+
+// Everything the JSON/XML export writes, in one results.vdtb file (see resultbundle.h). Filtered cost matrices are included with
+// --writeCosts.
+void writeResultBundle(const Mat& edgeCosts, const vector<vector<int>>& cut, const vector<vector<int>>& validArcs, const vector<vector<float>>& extraCosts, const vector<vector<int>>& allArcs, const vector<CostMatrix>& costMatrices, variables_map vm) {
+  resultbundle::BundleWriter writer;
+  writer.AddRagged("cut", cut);
+  writer.AddRagged("valid", validArcs);
+  writer.AddRagged("extraCosts", extraCosts);
+  writer.AddRagged("allArcs", allArcs);
+  assert(edgeCosts.type() == CV_32FC1);
+  writer.AddMatrix("edgeCosts", edgeCosts.ptr<float>(0), edgeCosts.rows, edgeCosts.cols, edgeCosts.step);
+  if (vm["writeCosts"].as<bool>()) {
+    addFilteredCosts(&writer, costMatrices);
+  }
+  path outputPath = path(vm["outputDir"].as<string>()) / "results.vdtb";
+  uint64_t bytes = writer.Write(outputPath.string());
+  LogLine() << "Wrote " << bytes << " bytes to " << outputPath.string();
+}
+
+// Bundle with only the filtered cost matrices, for batch runs where the per-gate bundles leave them out.
+void writeFilteredCostsBundle(const vector<CostMatrix>& costMatrices, variables_map vm) {
+  resultbundle::BundleWriter writer;
+  addFilteredCosts(&writer, costMatrices);
+  path outputPath = path(vm["outputDir"].as<string>()) / "results.vdtb";
+  uint64_t bytes = writer.Write(outputPath.string());
+  LogLine() << "Wrote " << bytes << " bytes to " << outputPath.string();
+}
+
+void writeResults(const Mat& edgeCosts, const vector<vector<int>>& cut, const vector<vector<int>>& validArcs, const vector<vector<float>>& extraCosts, const vector<vector<int>>& allArcs, const vector<CostMatrix>& costMatrices, variables_map vm) {
+  profiler::Scope scope("writeResults", "io");
+  if (WritesJson(vm)) {
+    writeEdgeCosts(edgeCosts, vm["outputDir"].as<string>());
+    writeJson(cut, vm, "cut.json");
+    writeJson(validArcs, vm, "valid.json");
+    writeJson(extraCosts, vm, "extraCosts.json");
+    writeAllArcsJson(allArcs, vm);
+  }
+  if (WritesBinary(vm)) {
+    writeResultBundle(edgeCosts, cut, validArcs, extraCosts, allArcs, costMatrices, vm);
   }
-  return minArcTo;
 }
 
-bool GetValidArcsFromCut(const vector<vector<int>>& cut, const vector<vector<int>>& allArcs, const vector<Mat>& costMatrices, vector<vector<int>>* validArcs, vector<vector<float>>* extraCosts, float threshold) {
+int FindMinValidArc(const ArcIndex& index, int row, int firstFrameCut) {
+  PrefixMin min;
+  if (!FindPrefixMin(index, row, firstFrameCut, &min) || min.cost >= INFINITE_D) {
+    return -1;
+  }
+  return min.firstColumn;
+}
+
+bool GetValidArcsFromCut(const vector<vector<int>>& cut, const vector<vector<int>>& allArcs, const vector<CostMatrix>& costMatrices, const vector<ArcIndex>& arcIndices, vector<vector<int>>* validArcs, vector<vector<float>>* extraCosts, float threshold) {
+  profiler::Scope scope("GetValidArcsFromCut");
   
   bool changed = false;
   float totalCost = 0;
@@ -546,8 +1228,8 @@ bool GetValidArcsFromCut(const vector<vector<int>>& cut, const vector<vector<int
       }
       else {
         changed=true;
-        int minArc = FindMinValidArc(costMatrices[i], cutFrame, firstFrameCut);
-        float newCost = (costMatrices[i].at<float>(cutFrame, minArc) <= threshold) ? 0 : costMatrices[i].at<float>(cutFrame, minArc);
+        int minArc = FindMinValidArc(arcIndices[i], cutFrame, firstFrameCut);
+        float newCost = (costMatrices[i].at(cutFrame, minArc) <= threshold) ? 0 : costMatrices[i].at(cutFrame, minArc);
         totalCost += newCost;
         extraCostsInView.push_back(newCost);
         validArcsInView.push_back(minArc);
@@ -556,14 +1238,14 @@ bool GetValidArcsFromCut(const vector<vector<int>>& cut, const vector<vector<int
     validArcs->push_back(validArcsInView);
     extraCosts->push_back(extraCostsInView);
   }
-  cout << "changed? " << changed << ". Total extra cost: " << totalCost << endl;
+  LogLine() << "changed? " << changed << ". Total extra cost: " << totalCost;
   return changed;
 }
 
-vector<vector<int>> findCut(GraphType* g, const Mat& edgeCosts, const vector<vector<int>>& bestArcs, const vector<vector<int>>& allArcs, const vector<Mat>& costMatrices, float* totalCost) {
+template <typename G> vector<vector<int>> findCut(G* g, const Mat& edgeCosts, const vector<vector<int>>& bestArcs, const vector<vector<int>>& allArcs, const vector<CostMatrix>& costMatrices, float* totalCost) {
   
   assert(bestArcs.size() == costMatrices.size()); // Number of viewing directions.
-  assert(bestArcs[0].size() == costMatrices[0].rows); // Number of (total) frames in each viewing direction.
+  assert(bestArcs[0].size() == costMatrices[0].Rows()); // Number of (total) frames in each viewing direction.
   
   int numRawFrames = edgeCosts.cols + 1;
   int numFrames = numRawFrames + numRawFrames - 1;  // Number of nodes per viewing direction, including buffer nodes.
@@ -585,11 +1267,197 @@ vector<vector<int>> findCut(GraphType* g, const Mat& edgeCosts, const vector<vec
     }
     cut.push_back(cutsInViewingDirection);
   }
-  cout << "Total cut cost: " << cutCost << endl;
+  LogLine() << "Total cut cost: " << cutCost;
   *totalCost = cutCost;
   return cut;
 }
 
+// Builds the graph for the given arcs on engine G, solves it and finds the cut. Returns the flow.
+template <typename G> float SolveCutWith(variables_map vm, const vector<CostMatrix>& costMatrices, const vector<vector<int>>& bestArcs, const vector<vector<int>>& allArcs, Mat* edgeCosts, vector<vector<int>>* cut, float* totalCost) {
+  G* g = NewGraph<G>(costMatrices.size(), vm);
+  ConfigureEngine(g, vm);
+  *edgeCosts = ConstructGraphFromArcs(g, vm, costMatrices, bestArcs, allArcs);
+  auto start = chrono::steady_clock::now();
+  float flow;
+  {
+    profiler::Scope scope("maxflow");
+    scope.Arg("nodes", g->get_node_num());
+    scope.Arg("edges", g->get_arc_num() / 2);
+    flow = g -> maxflow();
+  }
+  double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+  LogLine() << "Maxflow took " << ms << " ms.";
+  {
+    profiler::Scope scope("findCut");
+    *cut = findCut(g, *edgeCosts, bestArcs, allArcs, costMatrices, totalCost);
+  }
+  delete g;
+  return flow;
+}
+
+float SolveCutWithEngine(string engine, variables_map vm, const vector<CostMatrix>& costMatrices, const vector<vector<int>>& bestArcs, const vector<vector<int>>& allArcs, Mat* edgeCosts, vector<vector<int>>* cut, float* totalCost) {
+  if (engine == "bkint") {
+    return SolveCutWith<QuantizedGraph>(vm, costMatrices, bestArcs, allArcs, edgeCosts, cut, totalCost);
+  }
+  if (engine == "pushrelabel") {
+    return SolveCutWith<PushRelabelGraph>(vm, costMatrices, bestArcs, allArcs, edgeCosts, cut, totalCost);
+  }
+  if (engine == "parallelpushrelabel") {
+    return SolveCutWith<ParallelPushRelabelGraph>(vm, costMatrices, bestArcs, allArcs, edgeCosts, cut, totalCost);
+  }
+  assert(engine == "bk");
+  return SolveCutWith<GraphType>(vm, costMatrices, bestArcs, allArcs, edgeCosts, cut, totalCost);
+}
+
+// Solves with every engine and compares the cut costs with the one of the selected engine. Float engines have to agree up to
+// rounding; bkint up to its quantization bound (see QuantizedGraph).
+bool CrossCheckEngines(variables_map vm, const vector<CostMatrix>& costMatrices, const vector<vector<int>>& bestArcs, const vector<vector<int>>& allArcs, float totalCost) {
+  bool agree = true;
+  for (string engine : {"bk", "bkint", "pushrelabel", "parallelpushrelabel"}) {
+    Mat edgeCosts;
+    vector<vector<int>> cut;
+    float engineCost;
+    auto start = chrono::steady_clock::now();
+    float flow = SolveCutWithEngine(engine, vm, costMatrices, bestArcs, allArcs, &edgeCosts, &cut, &engineCost);
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    
+    int numCutEdges = 0;
+    for (auto& c : cut) {
+      numCutEdges += c.size();
+    }
+    float tolerance = 1e-4f * max(1.0f, fabs(totalCost));
+    if (engine == "bkint") {
+      QuantizedGraph bound(0, 0);
+      SetCutBound(&bound, edgeCosts);
+      tolerance += 2 * numCutEdges / bound.get_scale();
+    }
+    bool match = fabs(engineCost - totalCost) <= tolerance;
+    agree = agree && match;
+    LogLine() << "Engine " << engine << ": flow " << flow << ", cut cost " << engineCost << ", " << ms << " ms. " << (match ? "OK" : "MISMATCH");
+  }
+  return agree;
+}
+
+// Builds and solves the graph with the engine chosen by --maxflowEngine. Returns the flow.
+float SolveCut(variables_map vm, const vector<CostMatrix>& costMatrices, const vector<vector<int>>& bestArcs, const vector<vector<int>>& allArcs, Mat* edgeCosts, vector<vector<int>>* cut, float* totalCost) {
+  float flow = SolveCutWithEngine(vm["maxflowEngine"].as<string>(), vm, costMatrices, bestArcs, allArcs, edgeCosts, cut, totalCost);
+  if (vm["crossCheckEngines"].as<bool>()) {
+    bool agree = CrossCheckEngines(vm, costMatrices, bestArcs, allArcs, *totalCost);
+    LogLine() << (agree ? "All engines agree on the cut cost." : "Engines disagree on the cut cost!");
+  }
+  return flow;
+}
+
+// Keeps one graph alive across solves. Only the buffer edges (AssignEdgeCosts) depend on the perceptual threshold, minLength and the gate ROI,
+// so an update only touches the capacities that changed and maxflow reuses its search trees (Kohli & Torr, "Dynamic Graph Cuts").
+// Changing the gate frame changes the number of nodes and needs a new session.
+struct CutSession {
+  GraphType* g;
+  const vector<CostMatrix>* costMatrices;
+  const vector<ArcIndex>* arcIndices;
+  int gateFrame;
+  vector<vector<int>> bestArcs;
+  vector<vector<int>> allArcs;
+  Mat edgeCosts;  // Buffer edge capacities currently in the graph.
+  vector<GraphType::arc_id> bufferArcs;  // Forward arc of the buffer edge for (row, f), at row * edgeCosts.cols + f.
+  bool solved;
+};
+
+CutSession* CreateCutSession(const vector<CostMatrix>& costMatrices, const vector<ArcIndex>& arcIndices, variables_map vm, float perceptualThreshold) {
+  profiler::Scope scope("CreateCutSession");
+  CutSession* session = new CutSession();
+  session->g = NewGraph<GraphType>(costMatrices.size(), vm);
+  session->costMatrices = &costMatrices;
+  session->arcIndices = &arcIndices;
+  session->gateFrame = vm["gateFrame"].as<int>();
+  session->edgeCosts = ConstructGraphFromCosts(session->g, vm, costMatrices, arcIndices, &session->bestArcs, &session->allArcs, perceptualThreshold);
+  session->solved = false;
+  
+  // Arcs are only stable once the graph is built, so look the buffer edges up afterwards: they are the only edges from an even node to the next node in the same row.
+  int numFrames = 2 * session->edgeCosts.cols + 1;
+  session->bufferArcs.resize(session->edgeCosts.rows * session->edgeCosts.cols, NULL);
+  GraphType::arc_id a = session->g->get_first_arc();
+  for (int k = 0; k < session->g->get_arc_num(); k += 2) {
+    GraphType::node_id i, j;
+    session->g->get_arc_ends(a, i, j);
+    if (j == i + 1 && (i % numFrames) % 2 == 0) {
+      session->bufferArcs[(i / numFrames) * session->edgeCosts.cols + (i % numFrames) / 2] = a;
+    }
+    a = session->g->get_next_arc(session->g->get_next_arc(a));
+  }
+  return session;
+}
+
+// Set the capacity of buffer edge i -> i+1 to newCost, keeping the current flow valid.
+void SetBufferEdgeCost(GraphType* g, GraphType::arc_id a, GraphType::node_id i, float newCost) {
+  GraphType::arc_id sister = g->get_next_arc(a);  // Reverse arc (reverse capacity is 0, so its residual is the flow).
+  float flow = g->get_rcap(sister);
+  if (newCost >= flow) {
+    g->set_rcap(a, newCost - flow);
+  }
+  else {
+    // Flow exceeds the new capacity. Reduce it to newCost and reparameterize the terminal edges so that the min cut is unchanged.
+    float excess = flow - newCost;
+    g->set_rcap(a, 0);
+    g->set_rcap(sister, newCost);
+    g->add_tweights(i, excess, 0);
+    g->add_tweights(i + 1, 0, excess);
+  }
+  g->mark_node(i);
+  g->mark_node(i + 1);
+}
+
+// Recompute arcs and buffer edge costs for new parameters (perceptual threshold, minLength, ROI, offscreen) and update the changed edges only.
+int UpdateCutSession(CutSession* session, variables_map vm, float perceptualThreshold) {
+  profiler::Scope scope("UpdateCutSession");
+  assert(vm["gateFrame"].as<int>() == session->gateFrame);
+  const vector<CostMatrix>& costMatrices = *session->costMatrices;
+  
+  session->bestArcs.clear();
+  session->allArcs.clear();
+  for (int m = 0; m < costMatrices.size(); m++) {
+    vector<int> allArcsInView;
+    session->bestArcs.push_back(FindValidArcs(session->arcIndices->at(m), perceptualThreshold, vm["minLength"].as<int>(), &allArcsInView));
+    session->allArcs.push_back(allArcsInView);
+  }
+  
+  Mat edgeCosts = ComputeBufferEdgeCosts(session->bestArcs, session->allArcs, costMatrices, session->gateFrame, vm);
+  UpdateEdgeCosts(&edgeCosts, vm);
+  
+  int numFrames = 2 * edgeCosts.cols + 1;
+  int numChanged = 0;
+  for (int row = 0; row < edgeCosts.rows; row++) {
+    for (int f = 0; f < edgeCosts.cols; f++) {
+      if (edgeCosts.at<float>(row, f) != session->edgeCosts.at<float>(row, f)) {
+        SetBufferEdgeCost(session->g, session->bufferArcs[row * edgeCosts.cols + f], row * numFrames + 2*f, edgeCosts.at<float>(row, f));
+        numChanged++;
+      }
+    }
+  }
+  session->edgeCosts = edgeCosts;
+  LogLine() << "Updated " << numChanged << " buffer edges.";
+  return numChanged;
+}
+
+// Flow includes the constants added by reparameterization; use findCut for the cut cost.
+vector<vector<int>> SolveCutSession(CutSession* session, float* totalCost) {
+  {
+    profiler::Scope scope("maxflow");
+    scope.Arg("nodes", session->g->get_node_num());
+    scope.Arg("edges", session->g->get_arc_num() / 2);
+    scope.Arg("reuseTrees", session->solved);
+    session->g->maxflow(session->solved);  // Reuse search trees after the first solve.
+  }
+  session->solved = true;
+  profiler::Scope scope("findCut");
+  return findCut(session->g, session->edgeCosts, session->bestArcs, session->allArcs, *session->costMatrices, totalCost);
+}
+
+void DeleteCutSession(CutSession* session) {
+  delete session->g;
+  delete session;
+}
+
 float getXFromFileName(string s) {
   stringstream test(s);
   string segment;
@@ -603,61 +1471,777 @@ float getXFromFileName(string s) {
   return x;
 }
 
+// Vertical view center, the last number of the file name (..._center_{x}_{y}.npy).
+float getYFromFileName(string s) {
+  string stem = path(s).stem().string();
+  return stof(stem.substr(stem.rfind('_') + 1));
+}
+
+// Pitch, then yaw (see ViewGrid).
 bool comparingNumpyFiles(string a, string b) {
+  float y1 = getYFromFileName(a);
+  float y2 = getYFromFileName(b);
+  if (y1 != y2) {
+    return y1 < y2;
+  }
   float x1 = getXFromFileName(a);
   float x2 = getXFromFileName(b);
   return x1 < x2;
 }
 
+// .npy or packed .vdcm (see costmatrix.h).
+bool IsCostMatrixFile(const path& p) {
+  return p.extension() == ".npy" || p.extension() == ".vdcm";
+}
+
+// Cost matrices in directory and its immediate subdirectories, so that the directory of a whole view grid (one subdirectory per
+// vertical center, see getCostMatrixFileName in preprocess.py) can be given.
 vector<string> GetNumpyFiles(string directory) {
   vector<string> numpyFiles;
   for(auto& entry : boost::make_iterator_range(directory_iterator(directory), {})) {
-    if (entry.path().extension().string() == ".npy") {
+    if (IsCostMatrixFile(entry.path())) {
       numpyFiles.push_back(entry.path().string());
     }
+    else if (is_directory(entry.path())) {
+      for (auto& subEntry : boost::make_iterator_range(directory_iterator(entry.path()), {})) {
+        if (IsCostMatrixFile(subEntry.path())) {
+          numpyFiles.push_back(subEntry.path().string());
+        }
+      }
+    }
   }
   
   sort(numpyFiles.begin(), numpyFiles.end(), comparingNumpyFiles);
   return numpyFiles;
 }
 
-float findCutCost(vector<string> numpyFiles, variables_map vm, float perceptualThreshold) {
-  GraphType *g = new GraphType(numpyFiles.size() * 30 * 10, numpyFiles.size() * 30 * 10);
-  vector<vector<int>> bestArcs;
-  vector<vector<int>> allArcs;
-  vector<Mat> costMatrices;
-  Mat edgeCosts = ConstructGraph(g, vm, numpyFiles, &bestArcs, &allArcs, &costMatrices, perceptualThreshold, false);  // Updated buffer edge costs (after applying heuristics).
-  float flow = g -> maxflow();
-  
-  vector<vector<int>> cut;
+// Number of distinct vertical centers. Every one needs the same number of views.
+int CountPitchViews(const vector<string>& numpyFiles) {
+  map<float, int> viewsPerPitch;
+  for (const string& f : numpyFiles) {
+    viewsPerPitch[getYFromFileName(f)]++;
+  }
+  for (auto& p : viewsPerPitch) {
+    assert(p.second == viewsPerPitch.begin()->second);
+  }
+  return viewsPerPitch.size();
+}
+
+// One step of the threshold search.
+float findCutCost(CutSession* session, variables_map vm, float perceptualThreshold) {
+  profiler::Scope scope("thresholdIteration", "search");
+  int numChanged = UpdateCutSession(session, vm, perceptualThreshold);
   float totalCost;
-  cut = findCut(g, edgeCosts, bestArcs, allArcs, costMatrices, &totalCost);
-  delete g;
-  
+  SolveCutSession(session, &totalCost);
+  scope.Arg("threshold", perceptualThreshold);
+  scope.Arg("changedEdges", numChanged);
+  scope.Arg("totalCost", totalCost);
   return totalCost;
 }
 
 // Find lowest threshold that still gives us a cut whose total cost is under that threshold. Left means not good enough cut. Right is ok.
-float findThreshold(vector<string> numpyFiles, variables_map vm, int left=0, int right=15000) {
+float findThreshold(CutSession* session, variables_map vm, int left=0, int right=15000) {
   
-  cout << "Left is " << left << ". Right is " << right << endl;
+  LogLine() << "Left is " << left << ". Right is " << right;
   if (right - left <= 1) {
     return right;
   }
   int mid = (int)(left + right) / 2.0f;
-  float totalCost = findCutCost(numpyFiles, vm, mid);
-  cout << "mid is " << mid << ". Total cost is " << totalCost << endl;
+  float totalCost = findCutCost(session, vm, mid);
+  LogLine() << "mid is " << mid << ". Total cost is " << totalCost;
   if (totalCost < mid) {
     right = mid;
-    cout << "Assigning "<< right << " to right." << endl;
+    LogLine() << "Assigning "<< right << " to right.";
   }
   else {
     left = mid;
-    cout << "Assigning "<< left << " to left." << endl;
+    LogLine() << "Assigning "<< left << " to left.";
+  }
+  return findThreshold(session, vm, left, right);
+}
+
+// Same search as findThreshold, but evaluates numThreads thresholds per round concurrently, narrowing [left, right] by a factor of numThreads + 1.
+// Each thread keeps its own session (graph); costMatrices are shared read-only.
+float findThresholdParallel(const vector<CostMatrix>& costMatrices, const vector<ArcIndex>& arcIndices, variables_map vm, int numThreads, int left=0, int right=15000) {
+  vector<CutSession*> sessions(numThreads);
+  vector<thread> workers;
+  for (int t = 0; t < numThreads; t++) {
+    workers.push_back(thread([&, t]() { sessions[t] = CreateCutSession(costMatrices, arcIndices, vm, 0); }));
+  }
+  for (auto& w : workers) {
+    w.join();
+  }
+  
+  int round = 0;
+  while (right - left > 1) {
+    auto start = chrono::steady_clock::now();
+    profiler::Scope scope("searchRound", "search");
+    scope.Arg("round", round);
+    
+    // Evenly spaced candidates strictly inside (left, right). Fewer than numThreads once the interval gets small.
+    vector<int> mids;
+    for (int t = 1; t <= numThreads; t++) {
+      int mid = left + (int)((long long)(right - left) * t / (numThreads + 1));
+      if (mid > left && mid < right && (mids.empty() || mid > mids.back())) {
+        mids.push_back(mid);
+      }
+    }
+    
+    vector<float> totalCosts(mids.size());
+    workers.clear();
+    for (int t = 0; t < mids.size(); t++) {
+      workers.push_back(thread([&, t]() { totalCosts[t] = findCutCost(sessions[t], vm, mids[t]); }));
+    }
+    for (auto& w : workers) {
+      w.join();
+    }
+    
+    // Lowest candidate whose cut is under its threshold becomes the new right; the candidate before it the new left.
+    int newLeft = left;
+    int newRight = right;
+    for (int t = 0; t < mids.size(); t++) {
+      LogLine() << "mid is " << mids[t] << ". Total cost is " << totalCosts[t];
+      if (totalCosts[t] < mids[t]) {
+        newRight = mids[t];
+        break;
+      }
+      newLeft = mids[t];
+    }
+    
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    LogLine() << "Round " << round << ": " << mids.size() << " thresholds in " << ms << " ms. Left is " << newLeft << ". Right is " << newRight;
+    left = newLeft;
+    right = newRight;
+    round++;
+  }
+  
+  for (auto session : sessions) {
+    DeleteCutSession(session);
+  }
+  return right;
+}
+
+// Cut as a function of the perceptual threshold. Buffer edge costs only depend on which frames have their cheapest arc (given
+// minLength) within the threshold, so the cut only changes at arc costs. Breakpoint k covers thresholds [thresholds[k],
+// thresholds[k+1]); the last one extends to the end of the sweep. Arc costs where neither the cut nor its cost change are left out.
+struct ThresholdSweep {
+  vector<float> thresholds;
+  vector<float> totalCosts;
+  vector<int> cutSizes;
+  vector<vector<int>> toggled;  // Flattened (view, frame) pairs whose buffer edge enters or leaves the cut at breakpoint k; the whole cut for k = 0.
+};
+
+// Walks the arc costs in (0, maxThreshold] in increasing order on one session. Each step only recomputes the rows whose arcs came
+// within the threshold and the block penalties of their adjacent rows, and only checks the edges of the nodes that maxflow reports
+// as possibly changed. The edge costs do not move monotonically with the threshold (the ramps of UpdateEdgeCosts), so this visits
+// every arc cost rather than relying on nested cuts. With step > 0, arc costs are rounded up to multiples of step: fewer steps, and
+// the cut is exact at those thresholds only.
+ThresholdSweep SweepThresholds(const vector<CostMatrix>& costMatrices, const vector<ArcIndex>& arcIndices, variables_map vm, float maxThreshold, float step) {
+  profiler::Scope scope("sweepThresholds", "search");
+  auto start = chrono::steady_clock::now();
+  CutSession* session = CreateCutSession(costMatrices, arcIndices, vm, 0);
+  GraphType* g = session->g;
+  Mat& edgeCosts = session->edgeCosts;
+  int numRows = edgeCosts.rows;
+  int numCols = edgeCosts.cols;
+  int numFrames = 2 * numCols + 1;
+  int minLength = vm["minLength"].as<int>();
+  int region = vm["loopDuration"].as<int>();
+  ViewGrid grid = GetViewGrid(numRows, vm);
+  vector<bool> inGate = GateViews(grid, vm);
+  vector<int> offsets;
+  vector<int> adjacent = ViewNeighbours(grid, 1, &offsets);
+  
+  vector<tuple<float, int, int, int>> events;  // (cost, row, frame, column) of each cheapest arc above 0, by cost.
+  for (int row = 0; row < numRows; row++) {
+    if (inGate[row]) {
+      continue;
+    }
+    for (int f = 0; f < numCols; f++) {
+      PrefixMin min;
+      if (!FindPrefixMin(arcIndices[row], f, f - minLength, &min)) {
+        continue;
+      }
+      float cost = min.cost;
+      if (step > 0) {
+        cost = ceil((double)cost / step) * step;
+      }
+      if (cost > 0 && cost <= maxThreshold) {
+        events.push_back(make_tuple(cost, row, f, min.column));
+      }
+    }
+  }
+  sort(events.begin(), events.end());
+  
+  // Buffer edge costs before the ramps and penalties of UpdateEdgeCosts, and their blocks.
+  Mat rawCosts = ComputeBufferEdgeCosts(session->bestArcs, session->allArcs, costMatrices, session->gateFrame, vm);
+  vector<vector<tuple<int, int>>> AllBlocks(numRows);
+  for (int row = 0; row < numRows; row++) {
+    if (!inGate[row]) {
+      AllBlocks[row] = ZeroBlocks(rawCosts, row);
+    }
+  }
+  
+  ThresholdSweep sweep;
+  float totalCost;
+  vector<vector<int>> cut = SolveCutSession(session, &totalCost);
+  vector<char> isCut(numRows * numCols, 0);
+  vector<int> toggled;
+  for (int row = 0; row < numRows; row++) {
+    for (int f : cut[row]) {
+      isCut[row * numCols + f] = 1;
+      toggled.push_back(row);
+      toggled.push_back(f);
+    }
+  }
+  int cutSize = toggled.size() / 2;
+  sweep.thresholds.push_back(0);
+  sweep.totalCosts.push_back(totalCost);
+  sweep.cutSizes.push_back(cutSize);
+  sweep.toggled.push_back(toggled);
+  
+  Block<GraphType::node_id> changedList(1024);
+  Mat costs = edgeCosts.clone();  // Scratch for the rows being recomputed.
+  vector<int> rowStep(numRows, -1);
+  vector<int> rows;
+  vector<int> numContaining;
+  int numSteps = 0;
+  for (size_t e = 0; e < events.size(); numSteps++) {
+    float threshold = get<0>(events[e]);
+    bool costChanged = false;
+    
+    // Arcs of this cost are now within the threshold, as in FindValidArcs and ComputeBufferEdgeCosts.
+    rows.clear();
+    for (; e < events.size() && get<0>(events[e]) == threshold; e++) {
+      int row = get<1>(events[e]);
+      int f = get<2>(events[e]);
+      session->bestArcs[row][f] = get<3>(events[e]);
+      rawCosts.at<float>(row, f) = 0;
+      if (rowStep[row] != numSteps) {
+        rowStep[row] = numSteps;
+        rows.push_back(row);
+      }
+    }
+    for (int row : rows) {
+      AllBlocks[row] = ZeroBlocks(rawCosts, row);
+    }
+    size_t numRowsWithArcs = rows.size();
+    for (size_t k = 0; k < numRowsWithArcs; k++) {
+      for (int n = offsets[rows[k]]; n < offsets[rows[k] + 1]; n++) {
+        int row = adjacent[n];
+        if (rowStep[row] != numSteps && !inGate[row]) {
+          rowStep[row] = numSteps;
+          rows.push_back(row);
+        }
+      }
+    }
+    
+    for (int row : rows) {
+      for (int f = 0; f < numCols; f++) {
+        costs.at<float>(row, f) = rawCosts.at<float>(row, f);
+      }
+      RampBlocks(&costs, row, AllBlocks[row], region, session->gateFrame);
+      PenalizeBlocks(&costs, row, AllBlocks, adjacent, offsets, &numContaining);
+      for (int f = 0; f < numCols; f++) {
+        float newCost = costs.at<float>(row, f);
+        if (newCost != edgeCosts.at<float>(row, f)) {
+          costChanged = costChanged || isCut[row * numCols + f];
+          SetBufferEdgeCost(g, session->bufferArcs[row * numCols + f], row * numFrames + 2*f, newCost);
+          edgeCosts.at<float>(row, f) = newCost;
+        }
+      }
+    }
+    
+    g->maxflow(true, &changedList);
+    toggled.clear();
+    for (GraphType::node_id* i = changedList.ScanFirst(); i; i = changedList.ScanNext()) {
+      g->remove_from_changed_list(*i);
+      int row = *i / numFrames;
+      int f = (*i % numFrames) / 2;
+      if (f >= numCols) {
+        continue;
+      }
+      bool nowCut = g->what_segment(row * numFrames + 2*f) != g->what_segment(row * numFrames + 2*f + 1);
+      if (nowCut != (bool)isCut[row * numCols + f]) {
+        isCut[row * numCols + f] = nowCut;
+        cutSize += nowCut ? 1 : -1;
+        toggled.push_back(row);
+        toggled.push_back(f);
+      }
+    }
+    changedList.Reset();
+    
+    if (!toggled.empty() || costChanged) {
+      totalCost = 0;  // Summed in the same order as findCut.
+      for (int k = 0; k < isCut.size(); k++) {
+        if (isCut[k]) {
+          totalCost += edgeCosts.at<float>(k / numCols, k % numCols);
+        }
+      }
+      if (!toggled.empty() || totalCost != sweep.totalCosts.back()) {
+        sweep.thresholds.push_back(threshold);
+        sweep.totalCosts.push_back(totalCost);
+        sweep.cutSizes.push_back(cutSize);
+        sweep.toggled.push_back(toggled);
+      }
+    }
+  }
+  DeleteCutSession(session);
+  
+  double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+  LogLine() << "Swept " << numSteps << " thresholds up to " << maxThreshold << " in " << ms << " ms: " << sweep.thresholds.size() << " breakpoints.";
+  scope.Arg("steps", numSteps);
+  scope.Arg("breakpoints", (int)sweep.thresholds.size());
+  return sweep;
+}
+
+// Lowest integer threshold whose cut costs less than the threshold, as findThreshold searches for, read off the sweep. Exact even
+// where the cost curve is not monotonic. maxThreshold if there is none.
+float ThresholdFromSweep(const ThresholdSweep& sweep, float maxThreshold) {
+  for (int k = 0; k < sweep.thresholds.size(); k++) {
+    float end = k + 1 < sweep.thresholds.size() ? sweep.thresholds[k + 1] : floor(maxThreshold) + 1;
+    float threshold = max(max(1.0f, ceil(sweep.thresholds[k])), floor(sweep.totalCosts[k]) + 1);
+    if (threshold < end) {
+      return threshold;
+    }
+  }
+  return maxThreshold;
+}
+
+// Breakpoint table of a threshold sweep: thresholds, totalCosts and cutSizes per breakpoint, and toggled, the flattened (view, frame)
+// cut edges that flip at each breakpoint. The cut at a threshold is the XOR of the toggled lists up to its breakpoint. threshold is
+// the lowest threshold whose cut costs less than it (see ThresholdFromSweep).
+json ThresholdSweepToJson(const ThresholdSweep& sweep, variables_map vm) {
+  json j;
+  j["gateFrame"] = vm["gateFrame"].as<int>();
+  j["minLength"] = vm["minLength"].as<int>();
+  j["sweepMax"] = vm["sweepMax"].as<float>();
+  j["threshold"] = ThresholdFromSweep(sweep, vm["sweepMax"].as<float>());
+  j["thresholds"] = sweep.thresholds;
+  j["totalCosts"] = sweep.totalCosts;
+  j["cutSizes"] = sweep.cutSizes;
+  j["toggled"] = sweep.toggled;
+  return j;
+}
+
+// Writes ThresholdSweepToJson to thresholds.json in vm's output directory, compact (no indentation).
+void writeThresholdSweep(const ThresholdSweep& sweep, variables_map vm) {
+  path outputPath = path(vm["outputDir"].as<string>()) / "thresholds.json";
+  std::ofstream o(outputPath.string());
+  o << ThresholdSweepToJson(sweep, vm) << endl;
+  LogLine() << "Wrote " << sweep.thresholds.size() << " threshold breakpoints to " << outputPath.string();
+}
+
+struct GateResult {
+  float threshold;
+  float flow;
+  float totalCost;
+  Mat edgeCosts;
+  vector<vector<int>> cut;
+  vector<vector<int>> validArcs;
+  vector<vector<float>> extraCosts;
+  vector<vector<int>> allArcs;
+  ThresholdSweep sweep;  // With sweepThresholds.
+};
+
+// Threshold search (if findThreshold) and cut for the gate described by vm, from already loaded cost matrices. With a session (of the same
+// gate frame, bk engine only), the search and the cut update and solve its graph instead of building new ones.
+GateResult SolveGate(variables_map vm, const vector<CostMatrix>& costMatrices, const vector<ArcIndex>& arcIndices, CutSession* session = NULL) {
+  profiler::Scope scope("SolveGate");
+  scope.Arg("gateFrame", vm["gateFrame"].as<int>());
+  GateResult result;
+  result.threshold = vm["perceptualThreshold"].as<float>();
+  if (vm["sweepThresholds"].as<bool>()) {
+    result.sweep = SweepThresholds(costMatrices, arcIndices, vm, vm["sweepMax"].as<float>(), vm["sweepStep"].as<float>());
+  }
+  if (vm["findThreshold"].as<bool>() && vm["sweepThresholds"].as<bool>()) {
+    result.threshold = ThresholdFromSweep(result.sweep, vm["sweepMax"].as<float>());
+  }
+  else if (vm["findThreshold"].as<bool>()) {
+    profiler::Scope searchScope("findThreshold", "search");
+    if (vm["searchThreads"].as<int>() > 1) {
+      result.threshold = findThresholdParallel(costMatrices, arcIndices, vm, vm["searchThreads"].as<int>(), 0, 100000);
+    }
+    else if (session != NULL) {
+      result.threshold = findThreshold(session, vm, 0, 100000);
+    }
+    else {
+      CutSession* searchSession = CreateCutSession(costMatrices, arcIndices, vm, 0);  // Kept alive across the search; each step only updates the changed edges.
+      result.threshold = findThreshold(searchSession, vm, 0, 100000);
+      DeleteCutSession(searchSession);
+    }
+    searchScope.Arg("threshold", result.threshold);
+  }
+  
+  if (session != NULL) {
+    UpdateCutSession(session, vm, result.threshold);
+    result.cut = SolveCutSession(session, &result.totalCost);
+    result.flow = result.totalCost;  // The session's flow includes reparameterization constants.
+    result.edgeCosts = session->edgeCosts.clone();
+    result.allArcs = session->allArcs;
+  }
+  else {
+    vector<vector<int>> bestArcs;  // "Best" backward arc from each frame, i.e. satisfies BOTH perceptual and min loop length thresholds.
+    FindArcs(vm, costMatrices, arcIndices, result.threshold, &bestArcs, &result.allArcs);
+    result.flow = SolveCut(vm, costMatrices, bestArcs, result.allArcs, &result.edgeCosts, &result.cut, &result.totalCost);
+  }
+  
+  bool changed = GetValidArcsFromCut(result.cut, result.allArcs, costMatrices, arcIndices, &result.validArcs, &result.extraCosts, result.threshold);
+  return result;
+}
+
+// SolveGate, then write the outputs to vm's output directory.
+GateResult RunGate(variables_map vm, const vector<CostMatrix>& costMatrices, const vector<ArcIndex>& arcIndices) {
+  GateResult result = SolveGate(vm, costMatrices, arcIndices);
+  writeResults(result.edgeCosts, result.cut, result.validArcs, result.extraCosts, result.allArcs, costMatrices, vm);
+  if (vm["sweepThresholds"].as<bool>()) {
+    writeThresholdSweep(result.sweep, vm);
+  }
+  return result;
+}
+
+// Replaces (or adds) an option of a variables_map.
+void SetOption(variables_map* vm, string key, boost::any value) {
+  vm->erase(key);
+  vm->insert(make_pair(key, variable_value(value, false)));
+}
+
+// Copy of vm with the options of a gate spec (JSON object) applied: gateFrame (required) and optionally ROIstart, ROIend, offscreen,
+// minLength, perceptualThreshold, findThreshold and sweepThresholds. name (default gate_{gateFrame}) goes to the pointer. Throws on unknown keys or
+// wrong types, as specs come from manifests and socket requests.
+variables_map ApplyGateSpec(const json& spec, variables_map vm, string* name) {
+  if (!spec.is_object() || spec.count("gateFrame") == 0) {
+    throw std::runtime_error("Gate spec needs a gateFrame.");
+  }
+  *name = "gate_" + to_string(spec["gateFrame"].get<int>());
+  for (auto& item : spec.items()) {
+    string key = item.key();
+    if (key == "name") {
+      *name = item.value().get<string>();
+    }
+    else if (key == "gateFrame" || key == "ROIstart" || key == "ROIend" || key == "minLength") {
+      SetOption(&vm, key, item.value().get<int>());
+    }
+    else if (key == "offscreen" || key == "findThreshold" || key == "sweepThresholds") {
+      SetOption(&vm, key, item.value().get<bool>());
+    }
+    else if (key == "perceptualThreshold") {
+      SetOption(&vm, key, item.value().get<float>());
+    }
+    else if (key != "op" && key != "outputDir") {  // Used by the server.
+      throw std::runtime_error("Unknown key " + key + " in gate spec.");
+    }
+  }
+  return vm;
+}
+
+// Per-gate options of a batch manifest: a JSON array of objects with gateFrame (required) and optionally name, ROIstart, ROIend,
+// offscreen, minLength, perceptualThreshold and findThreshold. Anything left out falls back to the command line. Each gate writes to
+// outputDir/{name}, where name defaults to gate_{gateFrame}.
+vector<variables_map> ReadBatchManifest(string filename, variables_map vm, vector<string>* names) {
+  std::ifstream i(filename);
+  if (!i.good()) {
+    throw std::runtime_error("Unable to open batch manifest " + filename + ".");
+  }
+  json manifest;
+  i >> manifest;
+  if (!manifest.is_array()) {
+    throw std::runtime_error("Batch manifest " + filename + " is not a JSON array of gate specs.");
+  }
+  
+  vector<variables_map> gates;
+  for (const json& spec : manifest) {
+    string name;
+    variables_map gateVm = ApplyGateSpec(spec, vm, &name);
+    path outputDir = path(vm["outputDir"].as<string>()) / name;
+    create_directories(outputDir);
+    SetOption(&gateVm, "outputDir", outputDir.string());
+    SetOption(&gateVm, "writeCosts", false);  // Written once for the whole batch.
+    gates.push_back(gateVm);
+    names->push_back(name);
+  }
+  return gates;
+}
+
+// Loads and filters the cost matrices once, then solves the gates of the manifest on batchThreads threads. Writes a batch.json summary
+// with the threshold, cost and solve time of each gate. Peak RSS is for the whole process (so far), as gates share the matrices.
+void RunBatch(variables_map vm, vector<string> filePaths) {
+  vector<string> names;
+  vector<variables_map> gates = ReadBatchManifest(vm["batch"].as<string>(), vm, &names);
+  
+  int maxGateFrame = 0;
+  for (variables_map& gateVm : gates) {
+    maxGateFrame = max(maxGateFrame, gateVm["gateFrame"].as<int>());
+  }
+  SetOption(&vm, "gateFrame", maxGateFrame);  // With gateRowsOnly, keep the rows every gate needs.
+  
+  auto loadStart = chrono::steady_clock::now();
+  vector<CostMatrix> costMatrices;
+  vector<ArcIndex> arcIndices;
+  LoadCostMatrices(vm, filePaths, &costMatrices, &arcIndices, vm["writeCosts"].as<bool>() && WritesJson(vm));
+  if (vm["writeCosts"].as<bool>() && WritesBinary(vm)) {
+    writeFilteredCostsBundle(costMatrices, vm);
+  }
+  double loadSeconds = chrono::duration<double>(chrono::steady_clock::now() - loadStart).count();
+  cout << "Loaded " << costMatrices.size() << " cost matrices in " << loadSeconds << " s. Peak RSS: " << PeakRssKB() << " KB." << endl;
+  
+  int numThreads = vm["batchThreads"].as<int>() > 0 ? vm["batchThreads"].as<int>() : max(1, (int)thread::hardware_concurrency());
+  numThreads = min(numThreads, (int)gates.size());
+  vector<json> reports(gates.size());
+  atomic<int> next(0);
+  vector<thread> workers;
+  for (int t = 0; t < numThreads; t++) {
+    workers.push_back(thread([&]() {
+      for (int i = next++; i < gates.size(); i = next++) {
+        auto start = chrono::steady_clock::now();
+        GateResult result = RunGate(gates[i], costMatrices, arcIndices);
+        float threshold = result.threshold;
+        float flow = result.flow;
+        float totalCost = result.totalCost;
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        long peakRss = PeakRssKB();
+        
+        reports[i] = {{"name", names[i]}, {"gateFrame", gates[i]["gateFrame"].as<int>()}, {"threshold", threshold}, {"flow", flow},
+                      {"totalCost", totalCost}, {"seconds", seconds}, {"peakRssKB", peakRss}};
+        LogLine() << "Gate " << names[i] << ": threshold " << threshold << ", total cost " << totalCost << ", " << seconds << " s. Peak RSS: " << peakRss << " KB.";
+      }
+    }));
+  }
+  for (auto& w : workers) {
+    w.join();
+  }
+  
+  json summary = {{"loadSeconds", loadSeconds}, {"peakRssKB", PeakRssKB()}, {"gates", reports}};
+  std::ofstream o((path(vm["outputDir"].as<string>()) / "batch.json").string());
+  o << std::setw(4) << summary << endl;
+}
+
+// Latencies of the cut requests answered by the server, and the connected clients (so a shutdown can wait for them).
+struct ServerStats {
+  mutex m;
+  vector<double> ms;
+  double loadSeconds;
+  set<int> clients;
+  condition_variable noClients;
+};
+
+// Graphs the server keeps between requests, one per gate frame, so that repeated requests for a gate (e.g. the editor's "Apply Gate" loop
+// with a new threshold or ROI) only update the buffer edges that changed. Requests for the same gate frame take turns on its session; the
+// least recently used session is dropped beyond maxSessions (and freed once its last request is done).
+struct SessionCache {
+  struct Entry {
+    mutex m;
+    CutSession* session = NULL;
+    long long lastUse = 0;
+    ~Entry() {
+      if (session != NULL) {
+        DeleteCutSession(session);
+      }
+    }
+  };
+  mutex m;
+  map<int, shared_ptr<Entry>> entries;
+  long long uses = 0;
+  int maxSessions;
+};
+
+shared_ptr<SessionCache::Entry> AcquireSession(SessionCache* cache, int gateFrame) {
+  lock_guard<mutex> lock(cache->m);
+  shared_ptr<SessionCache::Entry>& entry = cache->entries[gateFrame];
+  if (!entry) {
+    entry = make_shared<SessionCache::Entry>();
+  }
+  entry->lastUse = ++cache->uses;
+  shared_ptr<SessionCache::Entry> result = entry;
+  while (cache->entries.size() > max(cache->maxSessions, 1)) {
+    auto oldest = cache->entries.end();
+    for (auto it = cache->entries.begin(); it != cache->entries.end(); it++) {
+      if (it->first != gateFrame && (oldest == cache->entries.end() || it->second->lastUse < oldest->second->lastUse)) {
+        oldest = it;
+      }
+    }
+    cache->entries.erase(oldest);
+  }
+  return result;
+}
+
+json StatsToJson(ServerStats* stats) {
+  lock_guard<mutex> lock(stats->m);
+  vector<double> ms = stats->ms;
+  sort(ms.begin(), ms.end());
+  double total = 0;
+  for (double x : ms) {
+    total += x;
+  }
+  json result = {{"requests", ms.size()}, {"loadSeconds", stats->loadSeconds}, {"peakRssKB", PeakRssKB()}};
+  if (!ms.empty()) {
+    result["meanMs"] = total / ms.size();
+    result["p50Ms"] = ms[ms.size() / 2];
+    result["p95Ms"] = ms[min(ms.size() - 1, ms.size() * 95 / 100)];
+    result["maxMs"] = ms.back();
   }
-  return findThreshold(numpyFiles, vm, left, right);
+  return result;
 }
 
+// One request line -> one response. {"op": "stats"} returns latency metrics, {"op": "shutdown"} stops the server; anything else is a
+// gate spec (see ApplyGateSpec). Cut responses hold what cut.json, valid.json, extraCosts.json and allArcs.json would, and with
+// sweepThresholds what thresholds.json would under "sweep"; with "outputDir", the usual output files are written there as well.
+json HandleRequest(const string& line, variables_map vm, const vector<CostMatrix>& costMatrices, const vector<ArcIndex>& arcIndices, ServerStats* stats, SessionCache* sessions, bool* shutdown) {
+  auto start = chrono::steady_clock::now();
+  double startUs = profiler::Profiler::Get().NowUs();
+  try {
+    json request = json::parse(line);
+    string op = request.is_object() && request.count("op") ? request["op"].get<string>() : "cut";
+    if (op == "stats") {
+      return StatsToJson(stats);
+    }
+    if (op == "shutdown") {
+      *shutdown = true;
+      return {{"ok", true}};
+    }
+    if (op != "cut") {
+      throw std::runtime_error("Unknown op " + op);
+    }
+    
+    string name;
+    variables_map gateVm = ApplyGateSpec(request, vm, &name);
+    int gateFrame = gateVm["gateFrame"].as<int>();
+    if (gateFrame < 0 || gateFrame + 1 >= costMatrices[0].Rows()) {
+      throw std::runtime_error("Gate frame " + to_string(gateFrame) + " out of range.");
+    }
+    GateResult result;
+    bool warmStart = false;
+    if (sessions->maxSessions > 0 && gateVm["maxflowEngine"].as<string>() == "bk" && !gateVm["crossCheckEngines"].as<bool>()) {
+      shared_ptr<SessionCache::Entry> entry = AcquireSession(sessions, gateFrame);
+      lock_guard<mutex> lock(entry->m);
+      warmStart = entry->session != NULL;
+      if (!warmStart) {
+        entry->session = CreateCutSession(costMatrices, arcIndices, gateVm, gateVm["perceptualThreshold"].as<float>());
+      }
+      result = SolveGate(gateVm, costMatrices, arcIndices, entry->session);
+    }
+    else {
+      result = SolveGate(gateVm, costMatrices, arcIndices);
+    }
+    double solveMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    if (request.count("outputDir")) {
+      SetOption(&gateVm, "outputDir", request["outputDir"].get<string>());
+      SetOption(&gateVm, "writeCosts", false);
+      create_directories(path(request["outputDir"].get<string>()));
+      writeResults(result.edgeCosts, result.cut, result.validArcs, result.extraCosts, result.allArcs, costMatrices, gateVm);
+      if (gateVm["sweepThresholds"].as<bool>()) {
+        writeThresholdSweep(result.sweep, gateVm);
+      }
+      if (gateVm["profile"].as<bool>()) {
+        profiler::Profiler::Get().WriteTrace((path(request["outputDir"].get<string>()) / "profile.json").string(), startUs);
+      }
+    }
+    double totalMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    {
+      lock_guard<mutex> lock(stats->m);
+      stats->ms.push_back(totalMs);
+    }
+    json response = {{"cut", result.cut}, {"valid", result.validArcs}, {"extraCosts", result.extraCosts}, {"allArcs", result.allArcs},
+                     {"threshold", result.threshold}, {"flow", result.flow}, {"totalCost", result.totalCost}, {"solveMs", solveMs}, {"totalMs", totalMs}, {"warmStart", warmStart}};
+    if (gateVm["sweepThresholds"].as<bool>()) {
+      response["sweep"] = ThresholdSweepToJson(result.sweep, gateVm);
+    }
+    return response;
+  }
+  catch (const std::exception& e) {
+    return {{"error", e.what()}};
+  }
+}
+
+// Reads newline-separated requests from a client until it disconnects and answers each on its own line.
+void ServeConnection(int fd, int listenFd, variables_map vm, const vector<CostMatrix>& costMatrices, const vector<ArcIndex>& arcIndices, ServerStats* stats, SessionCache* sessions) {
+  string buffer;
+  char chunk[65536];
+  ssize_t n;
+  while ((n = read(fd, chunk, sizeof(chunk))) > 0) {
+    buffer.append(chunk, n);
+    size_t newline;
+    while ((newline = buffer.find('\n')) != string::npos) {
+      string line = buffer.substr(0, newline);
+      buffer.erase(0, newline + 1);
+      if (line.empty()) {
+        continue;
+      }
+      bool shutdown = false;
+      string response = HandleRequest(line, vm, costMatrices, arcIndices, stats, sessions, &shutdown).dump() + "\n";
+      for (size_t sent = 0; sent < response.size(); ) {
+        ssize_t m = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (m <= 0) {
+          break;
+        }
+        sent += m;
+      }
+      if (shutdown) {
+        ::shutdown(listenFd, SHUT_RDWR);  // Wakes up the accept loop.
+      }
+    }
+  }
+  lock_guard<mutex> lock(stats->m);
+  stats->clients.erase(fd);
+  close(fd);
+  stats->noClients.notify_all();
+}
+
+const size_t SERVER_PROFILE_EVENTS = 1 << 16;
+
+// Loads and filters the cost matrices once, then answers cut requests on a Unix domain socket. Each client gets its own thread, so
+// requests from different clients are solved concurrently against the shared matrices.
+void RunServer(variables_map vm, vector<string> filePaths) {
+  SetOption(&vm, "gateRowsOnly", false);  // Requests may use any gate frame.
+  ServerStats stats;
+  SessionCache sessions;
+  sessions.maxSessions = vm["serveSessions"].as<int>();
+  profiler::Profiler::Get().SetMaxEvents(SERVER_PROFILE_EVENTS);  // The server runs until shutdown; profile.json keeps the latest events.
+  auto loadStart = chrono::steady_clock::now();
+  vector<CostMatrix> costMatrices;
+  vector<ArcIndex> arcIndices;
+  LoadCostMatrices(vm, filePaths, &costMatrices, &arcIndices, vm["writeCosts"].as<bool>() && WritesJson(vm));
+  if (vm["writeCosts"].as<bool>() && WritesBinary(vm)) {
+    writeFilteredCostsBundle(costMatrices, vm);
+  }
+  assert(!costMatrices.empty());
+  stats.loadSeconds = chrono::duration<double>(chrono::steady_clock::now() - loadStart).count();
+  
+  string socketPath = vm["serve"].as<string>();
+  int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  assert(socketPath.size() < sizeof(addr.sun_path));
+  strcpy(addr.sun_path, socketPath.c_str());
+  unlink(socketPath.c_str());
+  if (listenFd < 0 || ::bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenFd, 16) != 0) {
+    cout << "Unable to listen on " << socketPath << endl;
+    return;
+  }
+  cout << "Loaded " << costMatrices.size() << " cost matrices in " << stats.loadSeconds << " s. Listening on " << socketPath << endl;
+  
+  int fd;
+  while ((fd = accept(listenFd, NULL, NULL)) >= 0) {
+    lock_guard<mutex> lock(stats.m);
+    stats.clients.insert(fd);
+    thread(ServeConnection, fd, listenFd, vm, cref(costMatrices), cref(arcIndices), &stats, &sessions).detach();
+  }
+  close(listenFd);
+  
+  // Disconnect the remaining clients and wait for their threads, which use the matrices.
+  unique_lock<mutex> lock(stats.m);
+  for (int client : stats.clients) {
+    ::shutdown(client, SHUT_RDWR);
+  }
+  stats.noClients.wait(lock, [&]() { return stats.clients.empty(); });
+  lock.unlock();
+  unlink(socketPath.c_str());
+  cout << "Server stopped. " << StatsToJson(&stats).dump() << endl;
+}
+
+// benchmark.cpp includes this file with VIEWDEP_NO_MAIN defined to time the stages on synthetic inputs.
+#ifndef VIEWDEP_NO_MAIN
 int main(int argc, char **argv)
 {
   
@@ -669,13 +2253,34 @@ int main(int argc, char **argv)
   ("minLength", value<int>()->default_value(30), "Minimum length of loop in number of frames.")
   ("perceptualThreshold", value<float>()->default_value(2000), "User-set perceptual threshold. Could also automatically find the lowest threshold such that the total cut cost is under that threshold; see findThreshold parameter.")
   ("gateFrame,G", value<int>(), "Gate frame number.")
-  ("inputDir,I", value<string>(), "Input directory of .npy files of cost matrices.")
+  ("batch", value<string>(), "JSON manifest of gates to solve from one load of the cost matrices, instead of -G. See ReadBatchManifest for the format. Results go to one subdirectory of the output directory per gate.")
+  ("batchThreads", value<int>()->default_value(0), "Number of gates solved concurrently in batch mode. 0 uses all cores.")
+  ("serve", value<string>(), "Unix domain socket path. Instead of -G, keep the cost matrices loaded and answer cut requests (one JSON gate spec per line, see HandleRequest) until a shutdown request.")
+  ("serveSessions", value<int>()->default_value(4), "With --serve, the number of gate frames whose graphs are kept between requests, so that a repeated request for a gate only updates the edges that changed (bk engine). 0 builds a new graph for every request.")
+  ("inputDir,I", value<string>(), "Input directory of cost matrices (.npy, or packed .vdcm files, see costmatrix.h).")
   ("ROIstart", value<int>()->default_value(4), "View in which ROI starts (inclusive).")
   ("ROIend", value<int>()->default_value(13), "View in which ROI ends (inclusive).")
+  ("neighbourRadius", value<int>()->default_value(2), "Number of adjacent views on each side, along yaw and along pitch, that a view is tied to in the graph (1 to 4).")
+  ("pitchViews", value<int>()->default_value(0), "Number of pitch rows of the view grid (see ViewGrid). 0 counts the distinct vertical view centers in the cost matrix file names. ROIstart and ROIend are yaw indices and apply to every pitch row.")
+  ("maxflowEngine", value<string>()->default_value("bk"), "Maxflow solver for the final cut: bk (Boykov-Kolmogorov, float capacities), bkint (Boykov-Kolmogorov on quantized integer capacities), pushrelabel (sequential push-relabel) or parallelpushrelabel (push-relabel discharging all active nodes of a round in parallel, see --maxflowThreads). The threshold search always uses bk.")
+  ("maxflowThreads", value<int>()->default_value(0), "Threads of the parallelpushrelabel engine. 0 uses all cores.")
+  ("crossCheckEngines", value<bool>()->default_value(false), "Whether or not to also solve the final cut with every engine, and compare their cut costs and times.")
   ("outputDir,O", value<string>(), "Output directory for cut results, cost matrices, etc.")
-  ("writeCosts", value<bool>()->default_value(true), "Whether or not to write costs to xml files.")
+  ("writeCosts", value<bool>()->default_value(true), "Whether or not to write the filtered cost matrices (xml files, or sections of the binary bundle).")
+  ("outputFormat", value<string>()->default_value("json"), "Format of the results: json (JSON and OpenCV XML files), binary (a single results.vdtb bundle, see resultbundle.h) or both.")
   ("findThreshold", value<bool>()->default_value(false), "Whether or not to automatically find minimum perceptual threshold such that the total cut cost is under that threshold. Uses binary search to find minimum threshold.")
+  ("sweepThresholds", value<bool>()->default_value(false), "Whether or not to also compute the cut at every perceptual threshold up to sweepMax, and write the breakpoints where it changes with the cut cost curve to thresholds.json (see writeThresholdSweep). With findThreshold, the threshold is read off the curve instead of searched for.")
+  ("sweepMax", value<float>()->default_value(100000), "Highest perceptual threshold of the sweep.")
+  ("sweepStep", value<float>()->default_value(0), "Spacing of the swept thresholds. 0 visits every arc cost, so the curve is exact everywhere; larger values take fewer steps and are exact at multiples of sweepStep.")
   ("offscreen", value<bool>()->default_value(false), "Whether or not to use offscreen gate (i.e., NOT look at ROI to proceed).")
+  ("checkSymmetry", value<bool>()->default_value(true), "Whether or not to check that each cost matrix is symmetric before filtering.")
+  ("mmapCosts", value<bool>()->default_value(false), "Whether or not to memory-map the .npy cost matrices instead of reading them into memory.")
+  ("costEncoding", value<string>()->default_value("float32"), "How the filtered cost matrices are kept in memory: packed triangular float32 (exact), float16 or uint16 (scaled per matrix). The 16-bit encodings halve the memory again and report their largest error.")
+  ("gateRowsOnly", value<bool>()->default_value(false), "Whether or not to only load and keep cost matrix rows up to the gate frame. Written cost matrices and allArcs.json then only cover those frames.")
+  ("preprocessThreads", value<int>()->default_value(0), "Number of threads per stage of the per-view preprocessing pipeline (filter, arc finder). 0 uses all cores.")
+  ("queueDepth", value<int>()->default_value(4), "Maximum number of views waiting between two preprocessing stages. Caps the number of matrices in flight.")
+  ("searchThreads", value<int>()->default_value(1), "Number of thresholds to evaluate concurrently per round when finding the threshold. 1 uses the serial binary search.")
+  ("profile", value<bool>()->default_value(false), "Whether or not to record wall and CPU time, bytes read and written, peak RSS and graph size per stage and per threshold search step. Writes profile.json (Chrome trace events, see profiler.h) to the output directory and prints a summary table.")
   ;
   
   variables_map vm;
@@ -687,7 +2292,7 @@ int main(int argc, char **argv)
     return 1;
   }
   
-  if (vm.count("gateFrame") == 0) {
+  if (vm.count("gateFrame") == 0 && vm.count("batch") == 0 && vm.count("serve") == 0) {
     cout << "Need to specify gate frame. Exiting." << "\n";
     return 1;
   }
@@ -702,6 +2307,33 @@ int main(int argc, char **argv)
     return 1;
   }
   
+  if (vm["neighbourRadius"].as<int>() < 1 || vm["neighbourRadius"].as<int>() > 4) {
+    cout << "Neighbour radius must be between 1 and 4. Exiting." << "\n";
+    return 1;
+  }
+  
+  string engine = vm["maxflowEngine"].as<string>();
+  if (engine != "bk" && engine != "bkint" && engine != "pushrelabel" && engine != "parallelpushrelabel") {
+    cout << "Unknown maxflow engine " << engine << ". Use bk, bkint, pushrelabel or parallelpushrelabel. Exiting." << "\n";
+    return 1;
+  }
+  
+  costmatrix::Encoding encoding;
+  if (!costmatrix::ParseEncoding(vm["costEncoding"].as<string>(), &encoding)) {
+    cout << "Unknown cost encoding " << vm["costEncoding"].as<string>() << ". Use float32, float16 or uint16. Exiting." << "\n";
+    return 1;
+  }
+  
+  string outputFormat = vm["outputFormat"].as<string>();
+  if (outputFormat != "json" && outputFormat != "binary" && outputFormat != "both") {
+    cout << "Unknown output format " << outputFormat << ". Use json, binary or both. Exiting." << "\n";
+    return 1;
+  }
+  
+  if (vm["profile"].as<bool>()) {
+    profiler::Profiler::Get().Enable();
+  }
+  
   for (const auto& it : vm) {
     std::cout << it.first.c_str() << " = ";
     auto& value = it.second.value();
@@ -722,55 +2354,64 @@ int main(int argc, char **argv)
     numpyFiles = GetNumpyFiles(vm["inputDir"].as<string>());
   }
   
-  if (!vm["findThreshold"].as<bool>()) {  // Don't automatically find best threshold.
-    GraphType *g = new GraphType(numpyFiles.size() * 30 * 10, numpyFiles.size() * 30 * 10);
-    vector<vector<int>> bestArcs;  // "Best" backward arc from each frame, i.e. satisfies BOTH perceptual and min loop length thresholds.
-    vector<vector<int>> allArcs;  // Lowest perceptual cost arc from each frame that satisfies min loop length threshold. Note that cost may not satisfy user-set perceptual threshold.
-    vector<Mat> costMatrices;
-    Mat edgeCosts = ConstructGraph(g, vm, numpyFiles, &bestArcs, &allArcs, &costMatrices, vm["perceptualThreshold"].as<float>(), vm["writeCosts"].as<bool>());
-    float flow = g -> maxflow();
-    
-    vector<vector<int>> cut;
-    float totalCost;
-    cut = findCut(g, edgeCosts, bestArcs, allArcs, costMatrices, &totalCost);
+  if (vm["pitchViews"].as<int>() == 0) {
+    SetOption(&vm, "pitchViews", CountPitchViews(numpyFiles));
+  }
+  if (numpyFiles.size() % max(1, vm["pitchViews"].as<int>()) != 0) {
+    cout << numpyFiles.size() << " cost matrices do not form a grid of " << vm["pitchViews"].as<int>() << " pitch rows. Exiting." << "\n";
+    return 1;
+  }
+  cout << "View grid: " << numpyFiles.size() / max(1, vm["pitchViews"].as<int>()) << " yaw x " << vm["pitchViews"].as<int>() << " pitch." << endl;
+  
+  try {
+    if (vm.count("batch")) {
+      RunBatch(vm, numpyFiles);
+    }
+    else if (vm.count("serve")) {
+      RunServer(vm, numpyFiles);
+    }
+    else if (!vm["findThreshold"].as<bool>() && !vm["sweepThresholds"].as<bool>()) {  // Don't automatically find best threshold.
+      vector<vector<int>> bestArcs;  // "Best" backward arc from each frame, i.e. satisfies BOTH perceptual and min loop length thresholds.
+      vector<vector<int>> allArcs;  // Lowest perceptual cost arc from each frame that satisfies min loop length threshold. Note that cost may not satisfy user-set perceptual threshold.
+      vector<CostMatrix> costMatrices;
+      vector<ArcIndex> arcIndices;
+      PreprocessViews(vm, numpyFiles, vm["writeCosts"].as<bool>() && WritesJson(vm), true, vm["perceptualThreshold"].as<float>(), &costMatrices, &arcIndices, &bestArcs, &allArcs);  // The binary bundle gets the matrices at the end.
       
-    vector<vector<int>> validArcs;
-    vector<vector<float>> extraCosts;
-    bool changed = GetValidArcsFromCut(cut, allArcs, costMatrices, &validArcs, &extraCosts, vm["perceptualThreshold"].as<float>());
-    
-    writeEdgeCosts(edgeCosts, vm["outputDir"].as<string>());
-    writeJson(cut, vm, "cut.json");
-    writeJson(validArcs, vm, "valid.json");
-    writeJson(extraCosts, vm, "extraCosts.json");
-    writeAllArcsJson(allArcs, vm);
+      Mat edgeCosts;
+      vector<vector<int>> cut;
+      float totalCost;
+      float flow = SolveCut(vm, costMatrices, bestArcs, allArcs, &edgeCosts, &cut, &totalCost);
+        
+      vector<vector<int>> validArcs;
+      vector<vector<float>> extraCosts;
+      bool changed = GetValidArcsFromCut(cut, allArcs, costMatrices, arcIndices, &validArcs, &extraCosts, vm["perceptualThreshold"].as<float>());
+      
+      writeResults(edgeCosts, cut, validArcs, extraCosts, allArcs, costMatrices, vm);
+    }
+    else {
+      if (vm["findThreshold"].as<bool>()) {
+        cout << "Finding best threshold!" << endl;
+      }
+      vector<CostMatrix> costMatrices;  // Loaded and filtered once; every step of the search only rebuilds the threshold-dependent parts.
+      vector<ArcIndex> arcIndices;
+      LoadCostMatrices(vm, numpyFiles, &costMatrices, &arcIndices, vm["writeCosts"].as<bool>() && WritesJson(vm));
+      GateResult result = RunGate(vm, costMatrices, arcIndices);
+      cout <<"Threshold is " << result.threshold << endl;
+      cout << "Flow: " << result.flow << ". Total cost: " << result.totalCost << endl;
+    }
   }
-  else {
-    cout << "Finding best threshold!" << endl;
-    float threshold = findThreshold(numpyFiles, vm, 0, 100000);
-    
-    GraphType *g = new GraphType(numpyFiles.size() * 30 * 10, numpyFiles.size() * 30 * 10);
-    vector<vector<int>> bestArcs;  // "Best" backward arc from each frame, i.e. satisfies BOTH perceptual and min loop length thresholds.
-    vector<vector<int>> allArcs;  // Lowest perceptual cost arc from each frame that satisfies min loop length threshold. Note that cost may not satisfy user-set perceptual threshold.
-    vector<Mat> costMatrices;
-    Mat edgeCosts = ConstructGraph(g, vm, numpyFiles, &bestArcs, &allArcs, &costMatrices, threshold,  vm["writeCosts"].as<bool>());
-    float flow = g -> maxflow();
-    
-    vector<vector<int>> cut;
-    float totalCost;
-    cut = findCut(g, edgeCosts, bestArcs, allArcs, costMatrices, &totalCost);
-    cout <<"Threshold is " << threshold << endl;
-    cout << "Flow: " << flow << ". Total cost: " << totalCost << endl;
-    
-    vector<vector<int>> validArcs;
-    vector<vector<float>> extraCosts;
-    bool changed = GetValidArcsFromCut(cut, allArcs, costMatrices, &validArcs, &extraCosts, threshold);
-    
-    writeEdgeCosts(edgeCosts, vm["outputDir"].as<string>());
-    writeJson(cut, vm, "cut.json");
-    writeJson(validArcs, vm, "valid.json");
-    writeJson(extraCosts, vm, "extraCosts.json");
-    writeAllArcsJson(allArcs, vm);
+  catch (const std::exception& e) {  // Bad inputs, e.g. a batch manifest or costs that do not fit the encoding.
+    cout << e.what() << " Exiting." << endl;
+    return 1;
+  }
+  
+  if (vm["profile"].as<bool>()) {
+    path tracePath = path(vm["outputDir"].as<string>()) / "profile.json";
+    profiler::Profiler::Get().WriteTrace(tracePath.string());
+    cout << "Wrote profile to " << tracePath.string() << endl;
+    profiler::Profiler::Get().PrintSummary(cout);
   }
 
 	return 0;
 }
+#endif
@@ -0,0 +1,212 @@
+// Decoded frame store written by ingest (see ingest.cpp) and read by satengine and preprocess.py. Holds every frame of a clip,
+// resized and converted to RGB, plus its Canny edge mask packed to one bit per pixel. Little-endian; both arrays start on a 64-byte
+// boundary so readers can mmap the file and use them in place.
+//
+// Layout: FrameStoreHeader, then
+//   frames: numFrames * height * width * 3 uint8 (RGB, row-major) at framesOffset.
+//   edges: numFrames * edgeStride bytes at edgesOffset. Pixel p of a mask is bit (7 - p % 8) of byte p / 8, as np.packbits does.
+#ifndef FRAMESTORE_H
+#define FRAMESTORE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace framestore {
+
+const char MAGIC[4] = {'V', 'D', 'F', 'S'};
+const uint32_t VERSION = 1;
+const uint64_t ALIGNMENT = 64;
+
+struct FrameStoreHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t numFrames;
+  uint32_t width;
+  uint32_t height;
+  uint32_t lowThreshold;  // Canny thresholds the edges were computed with.
+  uint32_t highThreshold;
+  uint32_t edgeStride;  // Bytes per packed edge mask.
+  double fps;
+  uint64_t framesOffset;
+  uint64_t edgesOffset;
+  uint8_t reserved[8];
+};
+
+static_assert(sizeof(FrameStoreHeader) == 64, "FrameStoreHeader must match the file layout.");
+
+inline uint64_t Align(uint64_t x) {
+  return (x + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+inline uint32_t EdgeStride(uint32_t width, uint32_t height) {
+  return ((uint64_t)width * height + 7) / 8;
+}
+
+inline bool EdgeBit(const uint8_t* bits, size_t p) {
+  return (bits[p >> 3] >> (7 - (p & 7))) & 1;
+}
+
+// Packs a mask (any nonzero byte is an edge) to stride bytes.
+inline void PackEdges(const uint8_t* mask, size_t numPixels, uint8_t* bits) {
+  memset(bits, 0, (numPixels + 7) / 8);
+  for (size_t p = 0; p < numPixels; p++) {
+    if (mask[p] != 0) {
+      bits[p >> 3] |= 0x80 >> (p & 7);
+    }
+  }
+}
+
+// Streams frames into the store. The frames go straight to disk; the packed edges are kept in memory (width * height / 8 bytes per
+// frame) and appended by Close, which also fills in the header. The store is written under a temporary name and renamed by Close.
+class FrameStoreWriter {
+public:
+  FrameStoreWriter(const std::string& filename, uint32_t width, uint32_t height, uint32_t lowThreshold, uint32_t highThreshold, double fps)
+    : filename(filename), tmpFilename(filename + ".tmp"), o(tmpFilename, std::ios::binary) {
+    if (!o) {
+      throw std::runtime_error("FrameStoreWriter: Unable to open " + tmpFilename);
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAGIC, 4);
+    header.version = VERSION;
+    header.width = width;
+    header.height = height;
+    header.lowThreshold = lowThreshold;
+    header.highThreshold = highThreshold;
+    header.edgeStride = EdgeStride(width, height);
+    header.fps = fps;
+    header.framesOffset = Align(sizeof(FrameStoreHeader));
+    o.write((const char*)&header, sizeof(header));
+    Pad(header.framesOffset);
+  }
+
+  // rgb is height * width * 3 bytes, mask height * width bytes, both contiguous.
+  void AddFrame(const uint8_t* rgb, const uint8_t* mask) {
+    o.write((const char*)rgb, (size_t)header.width * header.height * 3);
+    edges.resize(edges.size() + header.edgeStride);
+    PackEdges(mask, (size_t)header.width * header.height, edges.data() + edges.size() - header.edgeStride);
+    header.numFrames++;
+  }
+
+  uint32_t NumFrames() const {
+    return header.numFrames;
+  }
+
+  void Close() {
+    header.edgesOffset = Align(header.framesOffset + (uint64_t)header.numFrames * header.width * header.height * 3);
+    Pad(header.edgesOffset);
+    o.write((const char*)edges.data(), edges.size());
+    o.seekp(0);
+    o.write((const char*)&header, sizeof(header));
+    o.close();
+    if (!o) {
+      throw std::runtime_error("FrameStoreWriter: Failed writing " + tmpFilename);
+    }
+    rename(tmpFilename.c_str(), filename.c_str());
+  }
+
+private:
+  std::string filename;
+  std::string tmpFilename;
+  std::ofstream o;
+  FrameStoreHeader header;
+  std::vector<uint8_t> edges;
+
+  void Pad(uint64_t position) {
+    static const char zeros[ALIGNMENT] = {0};
+    uint64_t current = o.tellp();
+    o.write(zeros, position - current);
+  }
+};
+
+// Maps a store read-only. Pointers returned by Frame and Edges point into the mapping and are valid for the reader's lifetime.
+class FrameStore {
+public:
+  explicit FrameStore(const std::string& filename) : addr(NULL), length(0) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("FrameStore: Unable to open " + filename);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      throw std::runtime_error("FrameStore: Unable to stat " + filename);
+    }
+    if ((size_t)st.st_size < sizeof(FrameStoreHeader)) {
+      close(fd);
+      throw std::runtime_error("FrameStore: Not a version " + std::to_string(VERSION) + " frame store: " + filename);
+    }
+    length = st.st_size;
+    addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+      addr = NULL;
+      throw std::runtime_error("FrameStore: Unable to map " + filename);
+    }
+
+    header = *(const FrameStoreHeader*)addr;
+    if (memcmp(header.magic, MAGIC, 4) != 0 || header.version != VERSION) {
+      Unmap();
+      throw std::runtime_error("FrameStore: Not a version " + std::to_string(VERSION) + " frame store: " + filename);
+    }
+    if (header.edgesOffset + (uint64_t)header.numFrames * header.edgeStride > length) {
+      Unmap();
+      throw std::runtime_error("FrameStore: Truncated frame store: " + filename);
+    }
+  }
+
+  ~FrameStore() {
+    Unmap();
+  }
+
+  FrameStore(const FrameStore&) = delete;
+  FrameStore& operator=(const FrameStore&) = delete;
+
+  const FrameStoreHeader& Header() const {
+    return header;
+  }
+
+  int NumFrames() const {
+    return header.numFrames;
+  }
+
+  int Width() const {
+    return header.width;
+  }
+
+  int Height() const {
+    return header.height;
+  }
+
+  const uint8_t* Frame(int i) const {
+    return (const uint8_t*)addr + header.framesOffset + (uint64_t)i * header.width * header.height * 3;
+  }
+
+  const uint8_t* Edges(int i) const {
+    return (const uint8_t*)addr + header.edgesOffset + (uint64_t)i * header.edgeStride;
+  }
+
+private:
+  void* addr;
+  size_t length;
+  FrameStoreHeader header;
+
+  void Unmap() {
+    if (addr != NULL) {
+      munmap(addr, length);
+      addr = NULL;
+    }
+  }
+};
+
+}  // namespace framestore
+
+#endif
@@ -0,0 +1,71 @@
+// Decodes a clip once into a frame store (see framestore.h): every frame resized to the SAT resolution (nearest neighbour), converted
+// to RGB, and its Canny edge mask (from the resized gray frame), exactly as compute_edge_masks and getFrames in preprocess.py.
+#include "framestore.h"
+#include <opencv2/opencv.hpp>
+#include <boost/program_options.hpp>
+#include <iostream>
+#include <chrono>
+#include <assert.h>
+#include <sys/resource.h>
+
+using namespace std;
+using namespace cv;
+using namespace boost::program_options;
+
+int main(int argc, char **argv)
+{
+  options_description desc("Allowed options");
+  desc.add_options()
+  ("help", "Print help message.")
+  ("input,i", value<string>(), "Input equirect 360 video.")
+  ("output,o", value<string>(), "Frame store to write.")
+  ("width", value<int>()->default_value(640), "Horizontal resolution of the stored frames.")
+  ("height", value<int>()->default_value(320), "Vertical resolution of the stored frames.")
+  ("lowThreshold", value<int>()->default_value(80), "Low threshold of the Canny edge detector.")
+  ("highThreshold", value<int>()->default_value(100), "High threshold of the Canny edge detector.")
+  ;
+
+  variables_map vm;
+  store(parse_command_line(argc, argv, desc), vm);
+  notify(vm);
+
+  if (vm.count("help")) {
+    cout << desc << "\n";
+    return 1;
+  }
+
+  if (vm.count("input") == 0 || vm.count("output") == 0) {
+    cout << "Need to specify input video and output frame store. Exiting." << "\n";
+    return 1;
+  }
+
+  VideoCapture capture(vm["input"].as<string>());
+  if (!capture.isOpened()) {
+    cout << "Unable to open " << vm["input"].as<string>() << ". Exiting." << "\n";
+    return 1;
+  }
+
+  int width = vm["width"].as<int>();
+  int height = vm["height"].as<int>();
+  int lowThreshold = vm["lowThreshold"].as<int>();
+  int highThreshold = vm["highThreshold"].as<int>();
+  framestore::FrameStoreWriter writer(vm["output"].as<string>(), width, height, lowThreshold, highThreshold, capture.get(CAP_PROP_FPS));
+
+  auto start = chrono::steady_clock::now();
+  Mat image, resized, gray, rgb, edges;
+  while (capture.read(image)) {
+    resize(image, resized, Size(width, height), 0, 0, INTER_NEAREST);
+    cvtColor(resized, gray, COLOR_BGR2GRAY);
+    Canny(gray, edges, lowThreshold, highThreshold, 3, true);
+    cvtColor(resized, rgb, COLOR_BGR2RGB);
+    assert(rgb.isContinuous() && edges.isContinuous());
+    writer.AddFrame(rgb.data, edges.data);
+  }
+  writer.Close();
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  cout << "Wrote " << writer.NumFrames() << " frames of " << width << "x" << height << " to " << vm["output"].as<string>() << " in " << seconds << " s. Peak RSS: " << usage.ru_maxrss << " KB" << endl;
+  return 0;
+}
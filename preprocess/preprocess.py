@@ -9,6 +9,10 @@ import subprocess
 import os
 import sys
 import argparse
+import struct
+import json
+import hashlib
+import time
 import cv2
 from moviepy.editor import *
 import scipy.misc
@@ -57,6 +61,103 @@ def getPreprocessDir(vid):
         os.makedirs(preprocess_dir)
     return preprocess_dir
     
+def getProvenanceFileName(vid):
+    return os.path.join(getPreprocessDir(vid), "provenance.json")
+
+def loadProvenance(vid):
+    # Fingerprints of the frames the outputs were computed from, and the number of frames each output (SAT rows, cost matrix) covers.
+    fn = getProvenanceFileName(vid)
+    if not os.path.isfile(fn):
+        return {"frames": [], "outputs": {}}
+    with open(fn) as f:
+        return json.load(f)
+
+def saveProvenance(vid, provenance):
+    fn = getProvenanceFileName(vid)
+    with open(fn + ".tmp", "w") as f:
+        json.dump(provenance, f, indent=1)
+    os.replace(fn + ".tmp", fn)
+
+def getFrameFingerprints(vidFrames, edgeFrames):
+    return [hashlib.sha1(np.ascontiguousarray(vidFrames[i]).tobytes() + np.ascontiguousarray(edgeFrames[i]).tobytes()).hexdigest() for i in range(len(vidFrames))]
+
+def getStoreFingerprints(store):
+    # Fingerprints of the frames in a frame store, from the packed edge masks, so they can be computed without unpacking them.
+    return [hashlib.sha1(store["frames"][i].tobytes() + store["edgeBits"][i].tobytes()).hexdigest() for i in range(store["numFrames"])]
+
+def recordOutput(vid, key, numFrames, fingerprints=None):
+    provenance = loadProvenance(vid)
+    if fingerprints is not None:
+        n = min(len(provenance["frames"]), len(fingerprints))
+        if provenance["frames"][:n] != fingerprints[:n]:
+            # A different clip: none of the outputs recorded so far can be extended.
+            provenance["outputs"] = {}
+            provenance["frames"] = fingerprints
+        elif len(fingerprints) > len(provenance["frames"]):
+            provenance["frames"] = fingerprints
+    provenance["outputs"][key] = numFrames
+    saveProvenance(vid, provenance)
+
+def getExtendFrom(vid, key, fingerprints):
+    # Number of frames the output was computed for. Rejects the extension if any of those frames changed since.
+    provenance = loadProvenance(vid)
+    assert key in provenance["outputs"], "No provenance for {}. It has to be recomputed without --extend.".format(key)
+    previous = provenance["outputs"][key]
+    assert previous <= len(fingerprints), "{} covers {} frames but the clip only has {}.".format(key, previous, len(fingerprints))
+    changed = [k for k in range(previous) if provenance["frames"][k] != fingerprints[k]]
+    assert len(changed) == 0, "Cannot extend {}: frame {} changed since it was computed.".format(key, changed[0] if changed else None)
+    return previous
+
+def extendNpyRows(fn, previousRows, newRows):
+    # Appends newRows to the first previousRows entries of fn and rewrites the header in place (numpy leaves room in the header for the
+    # first dimension to grow). The header is written last, so an interrupted extension is simply redone.
+    with open(fn, "r+b") as f:
+        np.lib.format.read_magic(f)
+        shape, fortran_order, dtype = np.lib.format.read_array_header_1_0(f)
+        assert shape[0] == previousRows and shape[1:] == newRows.shape[1:] and dtype == newRows.dtype and not fortran_order
+        dataStart = f.tell()
+        f.seek(dataStart + previousRows * newRows[0].nbytes)
+        f.truncate()
+        f.write(np.ascontiguousarray(newRows).tobytes())
+        f.seek(0)
+        np.lib.format.write_array_header_1_0(f, {"descr": np.lib.format.dtype_to_descr(dtype), "fortran_order": False, "shape": (previousRows + len(newRows),) + shape[1:]})
+        assert f.tell() == dataStart
+
+def getFrameStoreFileName(vid):
+    return os.path.join(getPreprocessDir(vid), "frames.vdfs")
+
+def ingestFrameStore(vid, size, binary, lowThreshold, highThreshold):
+    # Decodes the video once into frames.vdfs with the ingest binary (see ingest.cpp).
+    subprocess.check_call([binary, "-i", vid, "-o", getFrameStoreFileName(vid), "--width", str(size[0]), "--height", str(size[1]),
+                           "--lowThreshold", str(lowThreshold), "--highThreshold", str(highThreshold)])
+
+def openFrameStore(vid):
+    # Memory-maps the frame store written by ingest, if there is one. See framestore.h for the layout.
+    fn = getFrameStoreFileName(vid)
+    if not os.path.isfile(fn):
+        return None
+    with open(fn, "rb") as f:
+        magic, version, numFrames, width, height, low, high, edgeStride, fps, framesOffset, edgesOffset = struct.unpack("<4s7Id2Q8x", f.read(64))
+    assert magic == b"VDFS" and version == 1, "Not a version 1 frame store: {}".format(fn)
+    store = {"numFrames": numFrames, "width": width, "height": height, "fps": fps, "path": fn}
+    if numFrames > 0:
+        store["frames"] = np.memmap(fn, dtype=np.uint8, mode="r", offset=framesOffset, shape=(numFrames, height, width, 3))
+        store["edgeBits"] = np.memmap(fn, dtype=np.uint8, mode="r", offset=edgesOffset, shape=(numFrames, edgeStride))
+    return store
+
+def loadFrames(vid, size, native):
+    # Frames, edge masks and fingerprints for the SAT stages. With a frame store of this size, the fingerprints come from the store;
+    # with --native too, satengine reads the store itself, so the masks are not unpacked (edgeFrames is None).
+    store = openFrameStore(vid)
+    if store is not None and [store["width"], store["height"]] == list(size):
+        fingerprints = getStoreFingerprints(store)
+        edgeFrames = None if native is not None else getEdges(vid, size)
+        return store["frames"], edgeFrames, fingerprints
+    edgeFrames = getEdges(vid, size)
+    vidFrames = getFrames(vid, resized=size)
+    assert edgeFrames.shape == vidFrames.shape[:3], "Edge masks of shape {} do not match frames of shape {}; compute the edge masks at this size.".format(edgeFrames.shape, vidFrames.shape)
+    return vidFrames, edgeFrames, getFrameFingerprints(vidFrames, edgeFrames)
+
 def compute_edge_masks(equirect_video_path, size, fps, lowThreshold, highThreshold):
     frames = getFrames(equirect_video_path, resized=size, gray=True)
     framesColor = getFrames(equirect_video_path, resized=size, gray=False)
@@ -82,13 +183,21 @@ def compute_edge_masks(equirect_video_path, size, fps, lowThreshold, highThresho
     new_clip = ImageSequenceClip(edges_clr, fps=29.97, with_mask=False)
     new_clip.write_videofile(edge_fn) 
     
-    original = getEdges(equirect_video_path)
+    original = getEdgesFromPngs(equirect_video_path)
     assert len(edges_gray) == len(original), "Edges vid has length: {}. original has length: {}".format(len(edges_gray), len(original))
     for i in range(len(original)):
         assert np.all(edges_gray[i] == original[i]) and edges_gray[i].dtype == original[i].dtype
 
     
-def getEdges(equirect_video_path):
+def getEdges(equirect_video_path, size=None):
+    # From the frame store if it has this size (any size if None), otherwise from the edge mask directory.
+    store = openFrameStore(equirect_video_path)
+    if store is not None and (size is None or [store["width"], store["height"]] == list(size)):
+        bits = np.unpackbits(store["edgeBits"], axis=1, count=store["height"] * store["width"])
+        return bits.reshape(store["numFrames"], store["height"], store["width"]) * np.uint8(255)
+    return getEdgesFromPngs(equirect_video_path)
+
+def getEdgesFromPngs(equirect_video_path):
     edge_dir = getEdgeDir(equirect_video_path)
     raw_fn = os.listdir(edge_dir)
     filtered_fn = list(filter(lambda x: not x.startswith("."), raw_fn))
@@ -103,40 +212,71 @@ def getEdges(equirect_video_path):
 
 # Vertical fov: 96.01604 degrees (Oculus Rift headset vertical FOV)
 # Horizontal fov: 180 degrees
-def generateCostMatrices(vid, y_value, size, hfov=80.65347, vfov=180):  # fovs are in degrees. Oculus headset FOVs.
-    center_y = y_value
-    x_step = int(size[0] / 40)
-    center_xs = np.arange(0, size[0], x_step)
+# Views form a grid of yawViews x len(y_values) centers; each vertical center gets its own cost matrix directory (see getCostMatrixFileName),
+# and the graph cut reads the grid from their parent directory.
+def getViewGeometry(size, yawViews, hfov, vfov):
+    center_xs = np.arange(yawViews) * size[0] // yawViews
     width_half = math.ceil(hfov / 2 / 360 * size[0])
     height_half = math.ceil(vfov / 2 / 180 * size[1])
-    print("Center xs: {}".format(center_xs))
+    return center_xs, width_half, height_half
+
+def getCenterYs(size, pitchViews):
+    return [(2 * k + 1) * size[1] // (2 * pitchViews) for k in range(pitchViews)]
+
+def generateCostMatrices(vid, y_values, size, yawViews=40, hfov=80.65347, vfov=180, columnProfile=False, extend=False, encoding="npy"):  # fovs are in degrees. Oculus headset FOVs.
+    # Extending re-encodes the earlier, already quantized entries: a rescaled uint16 matrix would compound their error, and the header
+    # of either 16-bit encoding would no longer record it.
+    assert not (extend and encoding in ["float16", "uint16"]), "Cannot extend {} cost matrices; regenerate them.".format(encoding)
+    center_xs, width_half, height_half = getViewGeometry(size, yawViews, hfov, vfov)
+    print("Center xs: {}. Center ys: {}".format(center_xs, y_values))
     print("FOV of {}, {} with size {}, {} resolution: width half: {}. Height half: {}".format(
         hfov, vfov, size[0], size[1], width_half, height_half))
-    numFrames = getNumFrames(vid)
+    numFrames = getNumFrames(vid, size)
     
-    for x in center_xs:
+    centers = [(x, center_y) for center_y in y_values for x in center_xs]
+    for x, center_y in centers:
         topLeft, botRight = getSATBounds(x, center_y, width_half, height_half, size[0], size[1])
+        if columnProfile:
+            # Column profiles only hold the bottom SAT row, which is only enough for views spanning the full height.
+            assert topLeft[1] == 0 and botRight[1] == size[1] - 1, "Column profiles need views spanning the full height (vfov=180)."
         print("Width/Height of {}, {} with center {}, {} has SAT bounds: {}, {}".format(width_half, height_half, x, center_y, topLeft, botRight))
-        cost_filename = getCostMatrixFileName(vid, size, [x, center_y], [2*width_half, 2*height_half])
+        cost_filename = getCostMatrixFileName(vid, size, [x, center_y], [2*width_half, 2*height_half], encoding)
         
+        cost_key = os.path.relpath(cost_filename, getPreprocessDir(vid))
+        previousFrames = 0
         if os.path.isfile(cost_filename):
-            print("Cost matrix for center {}, {} already exists at: {}".format(x, center_y, cost_filename))
-            continue
-        
-        print("Cost matrix does not exist yet. Building...")
+            previousFrames = getCostMatrixSize(cost_filename)
+            if previousFrames == numFrames:
+                print("Cost matrix for center {}, {} already exists at: {}".format(x, center_y, cost_filename))
+                continue
+            assert extend and previousFrames < numFrames, "Cost matrix {} covers {} frames but the clip has {}. Use --extend if the clip was lengthened, or delete it to rebuild.".format(cost_filename, previousFrames, numFrames)
+            provenance = loadProvenance(vid)
+            assert provenance["outputs"].get(cost_key) == previousFrames, "Cannot extend {}: no matching provenance.".format(cost_filename)
+            sat_key = getSATOutputKey(vid, size, args.t, columnProfile)
+            assert provenance["outputs"].get(sat_key, 0) >= numFrames, "Extend the SATs (-a --extend) before the cost matrices."
+            print("Extending cost matrix from {} to {} frames...".format(previousFrames, numFrames))
+        else:
+            print("Cost matrix does not exist yet. Building...")
         
         # Build cost matrix for this viewing direction. Go row by row for the cost matrix.
         costMatrix = np.zeros((numFrames, numFrames), dtype=np.float32)
+        if previousFrames > 0:
+            costMatrix[:previousFrames, :previousFrames] = loadCostMatrix(cost_filename)
         for i in range(costMatrix.shape[0]):
-            outfile = getSATFileName(vid, size, i, args.t)
+            outfile = getColumnProfileFileName(vid, size, i, args.t) if columnProfile else getSATFileName(vid, size, i, args.t)
             print("Getting sat file: {}".format(outfile))
             assert os.path.isfile(outfile)
             row_of_SATs = np.load(outfile, mmap_mode='r')
             print("Loaded row {} of SATs (shape: {})".format(i, row_of_SATs.shape))
             for j in range(numFrames):
+                if i < previousFrames and j < previousFrames:
+                    continue  # Kept from the cost matrix of the shorter clip.
                 if (i <= j):
                     SAT = np.array(row_of_SATs[j-i])
-                    sqdiff = findFOVFromSAT(SAT, topLeft, botRight, size[0], size[1])
+                    if columnProfile:
+                        sqdiff = findFOVFromColumnProfile(SAT, topLeft, botRight, size[0])
+                    else:
+                        sqdiff = findFOVFromSAT(SAT, topLeft, botRight, size[0], size[1])
                     if sqdiff < 0:
                         print("FLOATING POINT ERROR! Square diff is: {}. Clipping to 0.".format(sqdiff))
                         sqdiff = 0
@@ -146,7 +286,8 @@ def generateCostMatrices(vid, y_value, size, hfov=80.65347, vfov=180):  # fovs a
                 print("Processed i, j = {}, {}".format(i, j))
             del row_of_SATs
         print("Final cost matrix for Width/Height {}, {} centered at {}, {} is {}".format(2*width_half, 2*height_half, x, center_y, costMatrix))
-        np.save(cost_filename, costMatrix)
+        saveCostMatrix(cost_filename, costMatrix, encoding)
+        recordOutput(vid, cost_key, numFrames)
         print("Saved cost matrix to: {}".format(cost_filename))
 
 def getSumOfIntensities(SAT, topLeft, botRight):
@@ -178,17 +319,332 @@ def findFOVFromSAT(SAT, topLeft, botRight, w, h):
         result = getSumOfIntensities(SAT, topLeft, box1_br) + getSumOfIntensities(SAT, box2_tl, botRight)
         return result
     
+# A column profile is the bottom row of a SAT: profile[x] is the sum over all rows and columns 0..x. For full-height views it gives
+# the same values as findFOVFromSAT.
+def getSumOfColumns(profile, topLeft, botRight):
+    left = int(topLeft[0]) - 1
+    right = int(np.ceil(botRight[0]))
+    return profile[right] - (profile[left] if left >= 0 else 0)
+
+def findFOVFromColumnProfile(profile, topLeft, botRight, w):
+    if botRight[0] >= topLeft[0]:
+        return getSumOfColumns(profile, topLeft, botRight)
+    else:
+        # Wraps around horizontally: split into [left, w - 1] and [0, right].
+        return getSumOfColumns(profile, topLeft, [w - 1]) + getSumOfColumns(profile, [0], botRight)
+
+def getViewBoxes(topLeft, botRight, w, h):
+    # Inclusive pixel boxes [x0, y0, x1, y1] that findFOVFromSAT sums for a view.
+    if botRight[0] >= topLeft[0] and botRight[1] >= topLeft[1]:
+        return [[int(topLeft[0]), int(topLeft[1]), int(botRight[0]), int(botRight[1])]]
+    box1_br = np.array(botRight)
+    box2_tl = np.array(topLeft)
+    if botRight[0] < topLeft[0]:
+        box1_br[0] = w - 1
+        box2_tl[0] = 0
+    if botRight[1] < topLeft[1]:
+        box1_br[1] = h - 1
+        box2_tl[1] = 0
+    return [[int(topLeft[0]), int(topLeft[1]), int(box1_br[0]), int(box1_br[1])], [int(box2_tl[0]), int(box2_tl[1]), int(botRight[0]), int(botRight[1])]]
+
+# Tau-independent alternative to the SATs: for each frame pair and view, hist[k] is the sum over the view of the sphere-weighted squared
+# differences that are at least tauEdges[k] (the masked differences before tau, binned by value). The cost for tau = tauEdges[k] is
+# sqrt(hist[k]), so cost matrices for another tau only need a pass over the histograms. Differences are at most 3, so 3 is always an edge.
+DEFAULT_TAU_EDGES = [0, 0.001, 0.002, 0.005, 0.01, 0.015, 0.02, 0.03, 0.05, 0.075, 0.1, 0.15, 0.2, 0.3, 0.5, 0.75, 1, 1.5, 2, 3]
+
+def getHistogramLayout(size, y_values, yawViews, hfov, vfov, tauEdges):
+    center_xs, width_half, height_half = getViewGeometry(size, yawViews, hfov, vfov)
+    views = []
+    for center_y in y_values:
+        for x in center_xs:
+            topLeft, botRight = getSATBounds(x, center_y, width_half, height_half, size[0], size[1])
+            views.append({"center": [int(x), int(center_y)], "boxes": getViewBoxes(topLeft, botRight, size[0], size[1])})
+    tauEdges = sorted(set([0.0, 3.0] + [float(t) for t in tauEdges]))
+    return {"width": size[0], "height": size[1], "fovs": [2 * width_half, 2 * height_half], "tauEdges": tauEdges, "views": views}
+
+def getHistogramLayoutFileName(vid, size):
+    directory = getPreprocessDir(vid)
+    basename = os.path.splitext(os.path.basename(vid))[0]
+    return os.path.join(directory, "{}_{}_{}_hist_layout.json".format(basename, size[0], size[1]))
+
+def getHistogramFileName(vid, size, rowNum):
+    directory = getPreprocessDir(vid)
+    basename = os.path.splitext(os.path.basename(vid))[0]
+    return os.path.join(directory, "{}_{}_{}_hist_row_{}.npy".format(basename, size[0], size[1], rowNum))
+
+def getHistogramOutputKey(vid, size):
+    return os.path.basename(getHistogramFileName(vid, size, ""))[:-len(".npy")]
+
+def writeHistogramLayout(vid, size, layout):
+    # Histogram rows are only valid for the layout they were computed with.
+    fn = getHistogramLayoutFileName(vid, size)
+    if os.path.isfile(fn):
+        with open(fn) as f:
+            assert json.load(f) == layout, "Histograms in {} were computed for other views or tau edges; delete them to recompute.".format(getPreprocessDir(vid))
+        return fn
+    with open(fn + ".tmp", "w") as f:
+        json.dump(layout, f)
+    os.replace(fn + ".tmp", fn)
+    return fn
+
+def computeHistogram(frame1, mask1, frame2, mask2, layout):
+    frameDiff = computeFrameDiff(frame1, mask1, frame2, mask2, None)  # float64, before tau
+    weighted = scaleBySphericalProjection(frameDiff)  # float64
+    tauEdges = np.array(layout["tauEdges"])
+    bins = np.searchsorted(tauEdges, frameDiff, side="right") - 1
+    hist = np.zeros((len(layout["views"]), len(tauEdges)))
+    for v, view in enumerate(layout["views"]):
+        for x0, y0, x1, y1 in view["boxes"]:
+            hist[v] += np.bincount(bins[y0:y1+1, x0:x1+1].ravel(), weights=weighted[y0:y1+1, x0:x1+1].ravel(), minlength=len(tauEdges))
+    return np.cumsum(hist[:, ::-1], axis=1)[:, ::-1].astype(np.float32)
+
+def computeHistograms(vid, vidFrames, edgeFrames, size, layout, extendFrom=0):
+    # Same rows as computeSATs, with the histograms of each frame pair instead of its SAT: shape (numFrames - i, numViews, numEdges).
+    assert vidFrames.shape[0] == edgeFrames.shape[0]
+    for i in range(vidFrames.shape[0]):
+        outfile = getHistogramFileName(vid, size, i)
+        if i < extendFrom:
+            if np.load(outfile, mmap_mode='r').shape[0] == vidFrames.shape[0] - i:
+                print("Row {} is already extended: {}".format(i, outfile))
+                continue
+            newHists = [computeHistogram(vidFrames[i], edgeFrames[i], vidFrames[j], edgeFrames[j], layout) for j in range(extendFrom, vidFrames.shape[0])]
+            extendNpyRows(outfile, extendFrom - i, np.stack(newHists, axis=0))
+            print("Extended row {} by {} histograms: {}".format(i, len(newHists), outfile))
+            continue
+        if os.path.isfile(outfile):
+            print("Row {} is already computed: {}".format(i, outfile))
+            continue
+        hists = np.stack([computeHistogram(vidFrames[i], edgeFrames[i], vidFrames[j], edgeFrames[j], layout) for j in range(i, vidFrames.shape[0])], axis=0)
+        np.save(outfile, hists)
+        print("Wrote histograms of shape {} to file: {}".format(hists.shape, outfile))
+
+def getSumAboveTau(hists, tauEdges, tau):
+    # Sum of the differences of at least tau, from histograms (last axis over tauEdges). Exact at the edges; linear in between.
+    k = np.searchsorted(tauEdges, tau, side="right") - 1
+    if tau > tauEdges[-1]:
+        return np.zeros(hists.shape[:-1], dtype=np.float32)
+    if tauEdges[k] == tau:
+        return hists[..., k]
+    t = (tau - tauEdges[k]) / (tauEdges[k + 1] - tauEdges[k])
+    return (1 - t) * hists[..., k] + t * hists[..., k + 1]
+
+# Cost matrices derived from histograms are built a group of views at a time, so a pass holds at most this many bytes of them.
+COST_MATRIX_MERGE_BUDGET = 1024 * 1024 * 1024
+
+def getViewGroups(views, numFrames):
+    # Splits views into groups whose float32 cost matrices fit in COST_MATRIX_MERGE_BUDGET (at least one view per group).
+    perGroup = max(1, COST_MATRIX_MERGE_BUDGET // (4 * numFrames * numFrames))
+    return [views[k:k + perGroup] for k in range(0, len(views), perGroup)]
+
+def generateCostMatricesFromHistograms(vid, size, tau, encoding="npy"):
+    # Cost matrices for tau from the histogram rows (computeHistograms), for a group of views per pass over the rows (see getViewGroups).
+    with open(getHistogramLayoutFileName(vid, size)) as f:
+        layout = json.load(f)
+    tauEdges = layout["tauEdges"]
+    if tau not in tauEdges and tau <= tauEdges[-1]:
+        print("Tau {} is not one of the histogram edges {}: interpolating between the nearest two, so the costs are approximate.".format(tau, tauEdges))
+    numFrames = getNumFrames(vid, size)
+    assert loadProvenance(vid)["outputs"].get(getHistogramOutputKey(vid, size), 0) >= numFrames, "Compute the histograms (-a --histograms) first."
+    
+    views = []
+    for v, view in enumerate(layout["views"]):
+        cost_filename = getCostMatrixFileName(vid, size, view["center"], layout["fovs"], encoding)
+        if os.path.isfile(cost_filename) and getCostMatrixSize(cost_filename) == numFrames:
+            print("Cost matrix for center {}, {} already exists at: {}".format(view["center"][0], view["center"][1], cost_filename))
+            continue
+        views.append((v, cost_filename))
+    if len(views) == 0:
+        return
+    
+    for group in getViewGroups(views, numFrames):
+        costMatrices = np.zeros((len(group), numFrames, numFrames), dtype=np.float32)
+        indices = [v for v, _ in group]
+        for i in range(numFrames):
+            hists = np.load(getHistogramFileName(vid, size, i), mmap_mode='r')
+            sums = getSumAboveTau(np.array(hists[:numFrames - i, indices]), tauEdges, tau)  # (numFrames - i, len(group))
+            costMatrices[:, i, i:] = np.sqrt(np.maximum(sums, 0)).T
+            costMatrices[:, i:, i] = costMatrices[:, i, i:]
+        for k, (v, cost_filename) in enumerate(group):
+            saveCostMatrix(cost_filename, costMatrices[k], encoding)
+            recordOutput(vid, os.path.relpath(cost_filename, getPreprocessDir(vid)), numFrames)
+            print("Saved cost matrix to: {}".format(cost_filename))
+        del costMatrices
+
+# Sharded histograms (see RunShardWorker in satengine.cpp): the frame pair triangle is split into tiles that satengine workers claim
+# through files in the shard directory, so any number of processes here or on machines sharing the directory can work on one clip.
+# Finished tiles are the checkpoint; a worker that dies loses only the tile it held. mergeShards builds the cost matrices from the tiles.
+SHARD_CACHE_BUDGET = 32 * 1024 * 1024
+SHARD_MAX_ATTEMPTS = 3
+
+def getShardDir(vid, size):
+    return os.path.join(getPreprocessDir(vid), "shards_{}_{}".format(size[0], size[1]))
+
+def getShardTileSize(size):
+    # The frames and edge masks of a tile's two blocks of frames fit in the cache budget.
+    frameBytes = size[0] * size[1] * 4
+    return max(1, SHARD_CACHE_BUDGET // (2 * frameBytes))
+
+def getShardTiles(manifest):
+    numBlocks = (manifest["numFrames"] + manifest["tileSize"] - 1) // manifest["tileSize"]
+    return [(bi, bj) for bi in range(numBlocks) for bj in range(bi, numBlocks)]
+
+def getShardTileFileName(shardDir, tile):
+    return os.path.join(shardDir, "tile_{}_{}".format(tile[0], tile[1]))
+
+def writeShardManifest(vid, size, layout, vidFrames, edgeFrames, fingerprints, tileSize, lease):
+    # Tiles are only valid for the frames, views and tile size they were computed with.
+    shardDir = getShardDir(vid, size)
+    if not os.path.isdir(shardDir):
+        os.makedirs(shardDir)
+    manifest = {"numFrames": len(vidFrames), "tileSize": tileSize, "maxAttempts": SHARD_MAX_ATTEMPTS, "lease": lease, "layout": "layout.json",
+                "layoutSha1": hashlib.sha1(json.dumps(layout, sort_keys=True).encode()).hexdigest(),
+                "fingerprint": hashlib.sha1("".join(fingerprints).encode()).hexdigest()}
+    store = openFrameStore(vid)
+    if store is not None and [store["width"], store["height"]] == list(size):
+        manifest["frameStore"] = os.path.abspath(store["path"])
+    else:
+        manifest["frames"] = "frames.npy"
+        manifest["edges"] = "edges.npy"
+    fn = os.path.join(shardDir, "manifest.json")
+    if os.path.isfile(fn):
+        with open(fn) as f:
+            assert json.load(f) == manifest, "Shards in {} were computed for other frames, views or tiles; delete them to recompute.".format(shardDir)
+        return shardDir
+    with open(os.path.join(shardDir, "layout.json"), "w") as f:
+        json.dump(layout, f)
+    if "frames" in manifest:
+        np.save(os.path.join(shardDir, "frames.npy"), np.ascontiguousarray(vidFrames, dtype=np.uint8))
+        np.save(os.path.join(shardDir, "edges.npy"), np.ascontiguousarray(edgeFrames, dtype=np.uint8))
+    # Written last: workers only start on a complete shard directory.
+    with open(fn + ".tmp", "w") as f:
+        json.dump(manifest, f, indent=1)
+    os.replace(fn + ".tmp", fn)
+    return shardDir
+
+def getShardClaimCount(base):
+    # Claims logged to a tile's .attempts file (see CountClaims in satengine.cpp); its failures are logged there too, but do not count.
+    if not os.path.isfile(base + ".attempts"):
+        return 0
+    with open(base + ".attempts") as f:
+        return sum(1 for line in f if line.startswith("claimed "))
+
+def getShardStatus(shardDir, manifest):
+    status = {"done": [], "claimed": [], "failed": [], "pending": []}
+    for tile in getShardTiles(manifest):
+        base = getShardTileFileName(shardDir, tile)
+        if os.path.isfile(base + ".npy"):
+            status["done"].append(tile)
+        elif getShardClaimCount(base) >= manifest["maxAttempts"]:
+            status["failed"].append(tile)
+        elif os.path.isfile(base + ".claim"):
+            status["claimed"].append(tile)
+        else:
+            status["pending"].append(tile)
+    return status
+
+def runShards(shardDir, binary, workers, threads):
+    # Runs workers local satengine workers until every tile is done, restarting workers that die. With 0 workers, only waits for the
+    # workers started elsewhere (see README).
+    with open(os.path.join(shardDir, "manifest.json")) as f:
+        manifest = json.load(f)
+    # Each run gets maxAttempts claims per tile: the logs of the last run are kept as .attempts.prev.
+    for tile in getShardTiles(manifest):
+        base = getShardTileFileName(shardDir, tile)
+        if os.path.isfile(base + ".attempts") and not os.path.isfile(base + ".npy"):
+            os.replace(base + ".attempts", base + ".attempts.prev")
+    command = [binary, "--shardDir", shardDir, "--threads", str(threads)]
+    processes = [subprocess.Popen(command) for _ in range(workers)]
+    restarts = 0
+    last = None
+    while True:
+        status = getShardStatus(shardDir, manifest)
+        counts = tuple(len(status[k]) for k in ["done", "claimed", "failed", "pending"])
+        if counts != last:
+            print("Shards: {} done, {} claimed, {} failed, {} pending".format(*counts))
+            last = counts
+        if len(status["claimed"]) + len(status["pending"]) == 0:
+            break
+        for k, p in enumerate(processes):
+            if p.poll() is not None and restarts < workers * manifest["maxAttempts"]:
+                print("Worker {} exited with {}; restarting it.".format(p.pid, p.returncode))
+                processes[k] = subprocess.Popen(command)
+                restarts += 1
+        if workers > 0 and all(p.poll() is not None for p in processes):
+            break
+        time.sleep(1)
+    for p in processes:
+        p.wait()
+    for tile in status["failed"]:
+        with open(getShardTileFileName(shardDir, tile) + ".attempts") as f:
+            print("Tile {}, {} failed:\n{}".format(tile[0], tile[1], f.read()))
+    assert len(status["done"]) == len(getShardTiles(manifest)), "{} of {} tiles are not done; rerun to retry them.".format(len(getShardTiles(manifest)) - len(status["done"]), len(getShardTiles(manifest)))
+
+def getShardOutputKey(vid, size):
+    return os.path.basename(getShardDir(vid, size))
+
+def mergeShards(vid, size, tau, encoding="npy"):
+    # Cost matrices for tau from the tiles (runShards), for a group of views per pass over the tiles (see getViewGroups).
+    shardDir = getShardDir(vid, size)
+    with open(os.path.join(shardDir, "manifest.json")) as f:
+        manifest = json.load(f)
+    with open(os.path.join(shardDir, "layout.json")) as f:
+        layout = json.load(f)
+    tauEdges = layout["tauEdges"]
+    if tau not in tauEdges and tau <= tauEdges[-1]:
+        print("Tau {} is not one of the histogram edges {}: interpolating between the nearest two, so the costs are approximate.".format(tau, tauEdges))
+    numFrames = getNumFrames(vid, size)
+    assert loadProvenance(vid)["outputs"].get(getShardOutputKey(vid, size), 0) >= numFrames and manifest["numFrames"] == numFrames, "Compute the shards (-a --shards) first."
+
+    views = []
+    for v, view in enumerate(layout["views"]):
+        cost_filename = getCostMatrixFileName(vid, size, view["center"], layout["fovs"], encoding)
+        if os.path.isfile(cost_filename) and getCostMatrixSize(cost_filename) == numFrames:
+            print("Cost matrix for center {}, {} already exists at: {}".format(view["center"][0], view["center"][1], cost_filename))
+            continue
+        views.append((v, cost_filename))
+    if len(views) == 0:
+        return
+
+    tileSize = manifest["tileSize"]
+    for group in getViewGroups(views, numFrames):
+        costMatrices = np.zeros((len(group), numFrames, numFrames), dtype=np.float32)
+        indices = [v for v, _ in group]
+        for bi, bj in getShardTiles(manifest):
+            tile = np.load(getShardTileFileName(shardDir, (bi, bj)) + ".npy", mmap_mode='r')
+            rows = min(tileSize, numFrames - bi * tileSize)
+            cols = min(tileSize, numFrames - bj * tileSize)
+            sums = getSumAboveTau(np.array(tile[:rows, :cols, indices]), tauEdges, tau)  # (rows, cols, len(group)), zero below the diagonal
+            block = np.sqrt(np.maximum(sums, 0)).transpose(2, 0, 1)
+            if bi == bj:
+                block = block + np.triu(block, 1).transpose(0, 2, 1)
+            costMatrices[:, bi * tileSize:bi * tileSize + rows, bj * tileSize:bj * tileSize + cols] = block
+            costMatrices[:, bj * tileSize:bj * tileSize + cols, bi * tileSize:bi * tileSize + rows] = block.transpose(0, 2, 1)
+        for k, (v, cost_filename) in enumerate(group):
+            saveCostMatrix(cost_filename, costMatrices[k], encoding)
+            recordOutput(vid, os.path.relpath(cost_filename, getPreprocessDir(vid)), numFrames)
+            print("Saved cost matrix to: {}".format(cost_filename))
+        del costMatrices
+
 def getSATBounds(center_x, center_y, width_half, height_half, res_x, res_y):
     # return top left, bottom right window of SAT to extract.
     topLeft = np.array([center_x - width_half, center_y - height_half])
     topLeft = np.mod(topLeft, np.array([res_x, res_y]))
+    partialHeight = 2 * height_half < res_y
     if height_half == res_y / 2:
         height_half = height_half - 1
     botRight = np.array([center_x + width_half, center_y + height_half])
     botRight = np.mod(botRight, np.array([res_x, res_y]))
+    if partialHeight:
+        # Views with a partial vfov do not wrap vertically (past a pole is the opposite yaw): clamp them to the frame.
+        topLeft[1] = max(0, center_y - height_half)
+        botRight[1] = min(res_y - 1, center_y + height_half)
+        assert topLeft[1] <= center_y <= botRight[1], "View centered at row {} is outside the {} rows of the frame.".format(center_y, res_y)
     return topLeft, botRight
     
 def getFrames(vid, resized=None, gray=False, frameNum=None):    
+    store = openFrameStore(vid)
+    if store is not None and not gray and resized is not None and list(resized) == [store["width"], store["height"]]:
+        return store["frames"] if frameNum is None else np.array(store["frames"][frameNum])
     frames = []
     vidcap = cv2.VideoCapture(vid)
     success, image = vidcap.read()
@@ -267,42 +723,154 @@ def computeSummedAreaTable(frame1, mask1, frame2, mask2, threshold):
     assert summedArea.dtype == np.float64
     return summedArea.astype(np.float32)  # float32 to save space
 
-def computeSATs(vid, vidFrames, edgeFrames, size, threshold):
+def computeSATs(vid, vidFrames, edgeFrames, size, threshold, columnProfile=False, extendFrom=0):
     assert vidFrames.shape[0] == edgeFrames.shape[0]
         
     for i in range(vidFrames.shape[0]):
-        outfile = getSATFileName(vid, size, i, threshold)
+        outfile = getColumnProfileFileName(vid, size, i, threshold) if columnProfile else getSATFileName(vid, size, i, threshold)
+        if i < extendFrom:
+            # Row computed for the shorter clip: only the SATs against the appended frames are new.
+            if np.load(outfile, mmap_mode='r').shape[0] == vidFrames.shape[0] - i:
+                print("Row {} is already extended: {}".format(i, outfile))
+                continue
+            newSATs = []
+            for j in range(extendFrom, vidFrames.shape[0]):
+                SAT = computeSummedAreaTable(vidFrames[i], edgeFrames[i], vidFrames[j], edgeFrames[j], threshold)  # float32
+                newSATs.append(SAT[-1] if columnProfile else SAT)
+                print("Processed i, j = {}, {}".format(i, j))
+            extendNpyRows(outfile, extendFrom - i, np.stack(newSATs, axis=0))
+            print("Extended row {} by {} SATs: {}".format(i, len(newSATs), outfile))
+            continue
         if os.path.isfile(outfile):
             print("Row {} is already computed: {}".format(i, outfile))
             continue
-        SATs = np.zeros((vidFrames.shape[0] - i, vidFrames.shape[1], vidFrames.shape[2]), dtype=np.float32)
+        if columnProfile:
+            SATs = np.zeros((vidFrames.shape[0] - i, vidFrames.shape[2]), dtype=np.float32)
+        else:
+            SATs = np.zeros((vidFrames.shape[0] - i, vidFrames.shape[1], vidFrames.shape[2]), dtype=np.float32)
         print("Computing row {}. SATs shape: {}. dtype: {}".format(i, SATs.shape, SATs.dtype))
         
         count = 0
         for j in range(vidFrames.shape[0]):
             if (i <= j):
-                SATs[count, :, :] = computeSummedAreaTable(vidFrames[i], edgeFrames[i], vidFrames[j], edgeFrames[j], threshold)  # float32
+                SAT = computeSummedAreaTable(vidFrames[i], edgeFrames[i], vidFrames[j], edgeFrames[j], threshold)  # float32
+                SATs[count] = SAT[-1] if columnProfile else SAT
                 print("Processed i, j = {}, {}. Entered as entry {} out of {}".format(i, j, count, SATs.shape[0] - 1))
                 count = count + 1
         np.save(outfile, SATs)
         print("Wrote SATs of shape {} and dtype {} to file: {}".format(SATs.shape, SATs.dtype, outfile))
 
+def computeSATsNative(vid, vidFrames, edgeFrames, size, threshold, binary, threads, columnProfile=False, extendFrom=0, histogramLayoutFile=None):
+    # Same output as computeSATs (or computeHistograms, with histogramLayoutFile), computed by the satengine binary (see satengine.cpp).
+    # With a frame store of this size, satengine reads it directly and the frames and edges are not used.
+    store = openFrameStore(vid)
+    if store is not None and [store["width"], store["height"]] == list(size):
+        sources = ["--frameStore", store["path"]]
+    else:
+        assert vidFrames.shape[0] == edgeFrames.shape[0]
+        directory = getPreprocessDir(vid)
+        framesFile = os.path.join(directory, "frames_@{}.npy".format(size[0]))
+        edgesFile = os.path.join(directory, "edges_@{}.npy".format(size[0]))
+        np.save(framesFile, np.ascontiguousarray(vidFrames, dtype=np.uint8))
+        np.save(edgesFile, np.ascontiguousarray(edgeFrames, dtype=np.uint8))
+        sources = ["--frames", framesFile, "--edges", edgesFile]
+
+    if histogramLayoutFile is not None:
+        prefix = os.path.join(getPreprocessDir(vid), getHistogramOutputKey(vid, size))
+        command = [binary] + sources + ["--histogramLayout", histogramLayoutFile, "--outputPrefix", prefix, "--threads", str(threads), "--extendFrom", str(extendFrom)]
+    else:
+        prefix = os.path.join(getPreprocessDir(vid), getSATOutputKey(vid, size, threshold, columnProfile))
+        command = [binary] + sources + ["--tau", repr(threshold), "--outputPrefix", prefix, "--threads", str(threads), "--extendFrom", str(extendFrom)]
+    if columnProfile:
+        command.append("--columnProfile")
+    subprocess.check_call(command)
+    if "--frames" in sources:
+        os.remove(sources[1])
+        os.remove(sources[3])
+
+def getSATOutputKey(vid, size, thres, columnProfile):
+    # Provenance key of a set of SAT rows: their file name without the row number.
+    fn = getColumnProfileFileName(vid, size, "", thres) if columnProfile else getSATFileName(vid, size, "", thres)
+    return os.path.basename(fn)[:-len(".npy")]
+
 def getSATFileName(vid, size, rowNum, thres):
     directory = getPreprocessDir(vid)
     basename = os.path.splitext(os.path.basename(vid))[0]
     return os.path.join(directory, "{}_{}_{}_thres_{}_row_{}.npy".format(basename, size[0], size[1], thres, rowNum))
 
-def getCostMatrixFileName(vid, size, center, fovs):
+def getColumnProfileFileName(vid, size, rowNum, thres):
+    directory = getPreprocessDir(vid)
+    basename = os.path.splitext(os.path.basename(vid))[0]
+    return os.path.join(directory, "{}_{}_{}_thres_{}_colprofile_row_{}.npy".format(basename, size[0], size[1], thres, rowNum))
+
+COST_ENCODINGS = {"float32": 0, "float16": 1, "uint16": 2}
+
+# Packed cost matrix (see graphcut/costmatrix.h): 64-byte header, then the upper triangle row by row as float32, float16 or uint16
+# codes (value = code * scale). The header records the largest error of the encoding.
+def saveCostMatrix(filename, costMatrix, encoding):
+    if encoding == "npy":
+        np.save(filename, costMatrix)
+        return
+    n = costMatrix.shape[0]
+    upper = costMatrix[np.triu_indices(n)].astype(np.float32)
+    maxValue = float(upper.max()) if n > 0 else 0.0
+    scale = np.float32(1)
+    if encoding == "float16":
+        assert maxValue <= 65504, "Costs up to {} do not fit in float16; use uint16.".format(maxValue)
+        data = upper.astype(np.float16)
+        decoded = data.astype(np.float32)
+    elif encoding == "uint16":
+        scale = np.float32(maxValue / 65535) if maxValue > 0 else np.float32(1)
+        data = np.minimum(65535, np.round(upper / scale)).astype(np.uint16)
+        decoded = data.astype(np.float32) * scale
+    else:
+        data = upper
+        decoded = upper
+    maxError = float(np.abs(decoded - upper).max()) if n > 0 else 0.0
+    header = struct.pack("<4s3I2fQ32x", b"VDCM", 1, COST_ENCODINGS[encoding], n, scale, maxError, 64)
+    with open(filename + ".tmp", "wb") as f:
+        f.write(header)
+        f.write(data.tobytes())
+    os.replace(filename + ".tmp", filename)
+
+def loadCostMatrix(filename):
+    if filename.endswith(".npy"):
+        return np.load(filename)
+    with open(filename, "rb") as f:
+        magic, version, encoding, n, scale, maxError, dataOffset = struct.unpack("<4s3I2fQ32x", f.read(64))
+        assert magic == b"VDCM" and version == 1, "Not a packed cost matrix: {}".format(filename)
+        f.seek(dataOffset)
+        dtype = [np.float32, np.float16, np.uint16][encoding]
+        upper = np.fromfile(f, dtype=dtype, count=n * (n + 1) // 2).astype(np.float32)
+    if encoding == COST_ENCODINGS["uint16"]:
+        upper = upper * np.float32(scale)
+    costMatrix = np.zeros((n, n), dtype=np.float32)
+    rows, cols = np.triu_indices(n)
+    costMatrix[rows, cols] = upper
+    costMatrix[cols, rows] = upper
+    return costMatrix
+
+def getCostMatrixSize(filename):
+    if filename.endswith(".npy"):
+        return np.load(filename, mmap_mode='r').shape[0]
+    with open(filename, "rb") as f:
+        return struct.unpack("<4s3I", f.read(16))[3]
+
+def getCostMatrixFileName(vid, size, center, fovs, encoding="npy"):
     directory = getPreprocessDir(vid)
     cost_directory = os.path.join(directory, "costs", "size_{}_{}_fov_{}_{}".format(size[0], size[1], fovs[0], fovs[1]), "{:.3f}".format(center[1]))
     if not os.path.exists(cost_directory):
         os.makedirs(cost_directory)
     
     basename = os.path.splitext(os.path.basename(vid))[0]
-    return os.path.join(cost_directory, "{}_thres_{}_center_{:.3f}_{:.3f}.npy".format(basename, args.t, center[0], center[1]))
+    extension = "npy" if encoding == "npy" else "vdcm"
+    return os.path.join(cost_directory, "{}_thres_{}_center_{:.3f}_{:.3f}.{}".format(basename, args.t, center[0], center[1], extension))
 
-def getNumFrames(vid):
-    edges = getEdges(vid)
+def getNumFrames(vid, size=None):
+    store = openFrameStore(vid)
+    if store is not None and (size is None or [store["width"], store["height"]] == list(size)):
+        return store["numFrames"]
+    edges = getEdges(vid, size)
     return edges.shape[0]
 
 if __name__ == "__main__":
@@ -315,7 +883,22 @@ if __name__ == "__main__":
     parser.add_argument("-s", help="Horizontal and vertical resolution for SAT", type=int, nargs="+", default=[640, 320])
     parser.add_argument("-m", dest="matrices", action='store_true', help="Whether or not to compute cost matrices")
     parser.add_argument("-t", help="Threshold tau (see appendix of paper). Ignores pixel differences below this threshold to avoid over-penalizing arcs with stochastic motion (e.g., moving trees). Empirically, we found that a clip with no trees in the foreground works well with tau = 0.015, whereas a clip with large foreground trees moving in the wind requires a larger tau = 0.2", type=float, required=True)
-    parser.set_defaults(clean=False, matrices=False, sat=False, vertical=False)
+    parser.add_argument("--columnProfile", dest="columnProfile", action='store_true', help="Store only the bottom row of each SAT (a per-column prefix sum). Uses H times less disk, but only supports views spanning the full height.")
+    parser.add_argument("--ingest", help="Path to the ingest binary. Decodes the video once into a frame store (frames.vdfs) that replaces the edge PNGs and later decodes.", type=str, required=False)
+    parser.add_argument("--extend", dest="extend", action='store_true', help="The clip was lengthened: only compute the SATs and cost matrix entries involving the appended frames. Rejected if the earlier frames changed.")
+    parser.add_argument("--native", help="Path to the satengine binary. Computes the SATs with it instead of in Python.", type=str, required=False)
+    parser.add_argument("--threads", help="Number of threads for --native. 0 uses all cores.", type=int, default=0)
+    parser.add_argument("--costEncoding", help="Format of the cost matrices: npy, or packed .vdcm files holding one triangle as float32 (lossless), float16 or uint16 (see graphcut/costmatrix.h).", choices=["npy", "float32", "float16", "uint16"], default="npy")
+    parser.add_argument("--yawViews", help="Number of horizontal view centers (views around the horizon).", type=int, default=40)
+    parser.add_argument("--pitchViews", help="Number of vertical view centers. More than 1 needs a vertical FOV under 180 degrees (--vfov).", type=int, default=1)
+    parser.add_argument("--vfov", help="Vertical FOV of a view in degrees.", type=float, default=180)
+    parser.add_argument("--histograms", dest="histograms", action='store_true', help="With -a, compute tau-independent histograms per view instead of SATs (tau is not used). With -m, derive the cost matrices for -t from them, which takes one pass over the histograms instead of recomputing the SATs.")
+    parser.add_argument("--tauEdges", help="Taus at which the histograms are exact (--histograms). Others are interpolated between the nearest two.", type=float, nargs="+", default=DEFAULT_TAU_EDGES)
+    parser.add_argument("--shards", dest="shards", action='store_true', help="With -a and --native, compute the histograms as tiles of frame pairs that any number of satengine workers claim from a shared directory (see README). With -m, derive the cost matrices for -t from the tiles.")
+    parser.add_argument("--workers", help="Number of local satengine worker processes for --shards. 0 only waits for workers started on other machines.", type=int, default=1)
+    parser.add_argument("--tileSize", help="Frames per side of a --shards tile. 0 picks the largest whose frames fit in 32 MB.", type=int, default=0)
+    parser.add_argument("--lease", help="Seconds after which the tile of a --shards worker that stopped responding is given to another.", type=float, default=60)
+    parser.set_defaults(clean=False, matrices=False, sat=False, vertical=False, columnProfile=False, extend=False, histograms=False, shards=False)
     args = parser.parse_args()
 
     assert args.i or args.d, "Need to enter either -i or -d."
@@ -342,30 +925,101 @@ if __name__ == "__main__":
     for vid in lst_of_vids:
         preprocess_dir = getPreprocessDir(vid)
 
+        if args.ingest is not None:
+            store_file = getFrameStoreFileName(vid)
+            if not args.clean and not args.extend and os.path.isfile(store_file):
+                print("Frame store already exists for {}".format(vid))
+            else:
+                ingestFrameStore(vid, args.s, args.ingest, lowThreshold=80, highThreshold=100)
+            continue
+
         edges_video = os.path.join(preprocess_dir, "edges_@{}.mp4".format(args.s[0]))
-        if not args.clean and os.path.isfile(edges_video):
+        if not args.clean and not args.extend and os.path.isfile(edges_video):
             print("Edge mask video already exists for {}".format(vid))
         else:
             if os.path.isfile(edges_video):
                 os.remove(edges_video)
             compute_edge_masks(vid, args.s, 29.97, lowThreshold=80, highThreshold=100)
 
-    if args.sat:
+    if args.sat and args.shards:
+        assert args.native is not None, "--shards needs the satengine binary (--native)."
+        assert not args.columnProfile and not args.extend, "--shards computes histograms of the whole clip; --columnProfile and --extend do not apply."
+        for vid in lst_of_vids:
+            layout = getHistogramLayout(args.s, getCenterYs(args.s, args.pitchViews), args.yawViews, 80.65347, args.vfov, args.tauEdges)
+            shard_key = getShardOutputKey(vid, args.s)
+            vidFrames, edgeFrames, fingerprints = loadFrames(vid, args.s, args.native)
+            tileSize = args.tileSize if args.tileSize > 0 else getShardTileSize(args.s)
+            shardDir = writeShardManifest(vid, args.s, layout, vidFrames, edgeFrames, fingerprints, tileSize, args.lease)
+            if loadProvenance(vid)["outputs"].get(shard_key) == len(vidFrames):
+                print("Shards for {} are computed already.".format(vid))
+                continue
+            runShards(shardDir, args.native, args.workers, args.threads)
+            recordOutput(vid, shard_key, len(vidFrames), fingerprints)
+
+    elif args.sat and args.histograms:
+        assert not args.columnProfile, "Histograms replace the SATs; --columnProfile does not apply."
+        for vid in lst_of_vids:
+            layout = getHistogramLayout(args.s, getCenterYs(args.s, args.pitchViews), args.yawViews, 80.65347, args.vfov, args.tauEdges)
+            hist_key = getHistogramOutputKey(vid, args.s)
+            numFrames = getNumFrames(vid, args.s)
+            if loadProvenance(vid)["outputs"].get(hist_key) == numFrames and os.path.isfile(getHistogramFileName(vid, args.s, numFrames - 1)):
+                writeHistogramLayout(vid, args.s, layout)
+                print("Histograms for {} are computed already.".format(vid))
+                continue
+            layoutFile = writeHistogramLayout(vid, args.s, layout)
+            vidFrames, edgeFrames, fingerprints = loadFrames(vid, args.s, args.native)
+            extendFrom = 0
+            if args.extend:
+                extendFrom = getExtendFrom(vid, hist_key, fingerprints)
+                print("Extending histograms from {} to {} frames".format(extendFrom, len(vidFrames)))
+            else:
+                previous = loadProvenance(vid)["outputs"].get(hist_key)
+                assert previous is None or previous == len(vidFrames), "Histograms were computed for {} frames; the clip has {}. Use --extend.".format(previous, len(vidFrames))
+            if args.native is not None:
+                computeSATsNative(vid, vidFrames, edgeFrames, args.s, args.t, args.native, args.threads, extendFrom=extendFrom, histogramLayoutFile=layoutFile)
+            else:
+                computeHistograms(vid, vidFrames, edgeFrames, args.s, layout, extendFrom)
+            recordOutput(vid, hist_key, len(vidFrames), fingerprints)
+
+    elif args.sat:
         for i in range(len(lst_of_vids)):
             vid = lst_of_vids[i]
-            SAT_file = getSATFileName(vid, args.s, getNumFrames(vid) - 1, args.t)
+            numFrames = getNumFrames(vid, args.s)
+            if args.columnProfile:
+                SAT_file = getColumnProfileFileName(vid, args.s, numFrames - 1, args.t)
+            else:
+                SAT_file = getSATFileName(vid, args.s, numFrames - 1, args.t)
+            sat_key = getSATOutputKey(vid, args.s, args.t, args.columnProfile)
 
-            if os.path.isfile(SAT_file):
+            # The last row can be written before earlier rows are (extended), so only the provenance says the SATs are complete.
+            if loadProvenance(vid)["outputs"].get(sat_key) == numFrames and os.path.isfile(SAT_file):
                 print("SATs for {} is computed already at: {}".format(vid, SAT_file))
             else:
-                print("Insufficient SATs (no {}) computed for video: {}.".format(SAT_file, vid))
-                edgeFrames = getEdges(vid)
-                vidFrames = getFrames(vid, resized=args.s)
-                assert len(edgeFrames) == len(vidFrames)
+                print("Insufficient SATs (no {} for {} frames) computed for video: {}.".format(sat_key, numFrames, vid))
+                vidFrames, edgeFrames, fingerprints = loadFrames(vid, args.s, args.native)
                 print("Using tau threshold {}".format(args.t))
-                SATs = computeSATs(vid, vidFrames, edgeFrames, args.s, args.t)
+                extendFrom = 0
+                if args.extend:
+                    extendFrom = getExtendFrom(vid, sat_key, fingerprints)
+                    print("Extending SATs from {} to {} frames".format(extendFrom, len(vidFrames)))
+                else:
+                    previous = loadProvenance(vid)["outputs"].get(sat_key)
+                    assert previous is None or previous == len(vidFrames), "SATs were computed for {} frames; the clip has {}. Use --extend.".format(previous, len(vidFrames))
+                if args.native is not None:
+                    computeSATsNative(vid, vidFrames, edgeFrames, args.s, args.t, args.native, args.threads, args.columnProfile, extendFrom)
+                else:
+                    SATs = computeSATs(vid, vidFrames, edgeFrames, args.s, args.t, args.columnProfile, extendFrom)
+                recordOutput(vid, sat_key, len(vidFrames), fingerprints)
             
     if args.matrices:
         for i in range(len(lst_of_vids)):
             vid = lst_of_vids[i]
-            generateCostMatrices(vid, (int)(args.s[1] / 2), args.s)
+            assert args.pitchViews == 1 or args.vfov < 180, "Views spanning the full height are the same at every pitch; lower --vfov."
+            if args.shards:
+                mergeShards(vid, args.s, args.t, encoding=args.costEncoding)
+                continue
+            if args.histograms:
+                generateCostMatricesFromHistograms(vid, args.s, args.t, encoding=args.costEncoding)
+                continue
+            center_ys = getCenterYs(args.s, args.pitchViews)
+            generateCostMatrices(vid, center_ys, args.s, yawViews=args.yawViews, vfov=args.vfov, columnProfile=args.columnProfile, extend=args.extend, encoding=args.costEncoding)
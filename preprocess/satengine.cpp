@@ -0,0 +1,789 @@
+// Native version of the SAT stage of preprocess.py (computeSATs). Reads the decoded frames and edge masks from a frame store (see
+// framestore.h) or from the .npy files that preprocess.py --native saves without one, and writes the same {prefix}{i}.npy row files: for each frame i, the summed area tables of the masked, tau-thresholded,
+// sphere-weighted squared differences between frame i and frames j >= i, as float32 of shape (numFrames - i, height, width).
+//
+// Every step is done in double in the same order as computeSummedAreaTable, so the float32 output matches the Python version. Rows are
+// spread over a thread pool; rows whose file already exists are skipped, so an interrupted run can be resumed.
+//
+// With --histogramLayout, writes tau-independent histograms instead of SATs (see computeHistograms in preprocess.py): row i has shape
+// (numFrames - i, numViews, numEdges), where entry k is the sum over the view of the sphere-weighted squared differences of at least
+// tauEdges[k]. The cost for tau = tauEdges[k] is its square root, so cost matrices for any of the edges need no new pass.
+#include "cnpy.h"
+#include "framestore.h"
+#include <nlohmann/json.hpp>
+#include <boost/program_options.hpp>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <math.h>
+#include <assert.h>
+#include <stdio.h>
+#include <memory>
+#include <algorithm>
+#include <set>
+#include <iterator>
+#include <string.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <utime.h>
+
+using namespace std;
+using namespace cnpy;
+using namespace boost::program_options;
+
+// Frames (numFrames x height x width x 3) and packed edge masks, from a frame store or .npy files.
+struct FrameSource {
+  int numFrames;
+  int width;
+  int height;
+  const uint8_t* frames;
+  const uint8_t* edges;
+  size_t edgeStride;
+  shared_ptr<framestore::FrameStore> store;
+  NpyArray framesArray;
+  vector<uint8_t> packedEdges;
+
+  const uint8_t* Frame(int i) const {
+    return frames + (size_t)i * width * height * 3;
+  }
+
+  const uint8_t* Edges(int i) const {
+    return edges + i * edgeStride;
+  }
+};
+
+// The store is used in place; .npy masks are packed once so both go through the same code.
+void OpenFrameStore(string filename, FrameSource* source) {
+  source->store = make_shared<framestore::FrameStore>(filename);
+  source->numFrames = source->store->NumFrames();
+  source->width = source->store->Width();
+  source->height = source->store->Height();
+  source->frames = source->store->Frame(0);
+  source->edges = source->store->Edges(0);
+  source->edgeStride = source->store->Header().edgeStride;
+}
+
+void LoadNpyFrames(string framesFilename, string edgesFilename, FrameSource* source) {
+  source->framesArray = npy_load(framesFilename);
+  NpyArray edges = npy_load(edgesFilename);
+  const NpyArray& frames = source->framesArray;
+  assert(frames.word_size == 1 && frames.shape.size() == 4 && frames.shape[3] == 3);
+  assert(edges.word_size == 1 && edges.shape.size() == 3);
+  assert(frames.shape[0] == edges.shape[0] && frames.shape[1] == edges.shape[1] && frames.shape[2] == edges.shape[2]);
+  source->numFrames = frames.shape[0];
+  source->height = frames.shape[1];
+  source->width = frames.shape[2];
+  source->frames = frames.data<uint8_t>();
+
+  size_t numPixels = (size_t)source->width * source->height;
+  source->edgeStride = framestore::EdgeStride(source->width, source->height);
+  source->packedEdges.resize(source->numFrames * source->edgeStride);
+  for (int i = 0; i < source->numFrames; i++) {
+    framestore::PackEdges(edges.data<uint8_t>() + i * numPixels, numPixels, source->packedEdges.data() + i * source->edgeStride);
+  }
+  source->edges = source->packedEdges.data();
+}
+
+// computeScalingMapOnEquirect: area of each pixel on the unit sphere, normalized by the smallest one. Returned squared, as used by
+// scaleBySphericalProjection.
+vector<double> ComputeSquaredScalingMap(int width, int height) {
+  vector<double> scale(width * height);
+  double minScale = INFINITY;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      double xx = x - width / 2.0;
+      double yy = height / 2.0 - y;
+      double lonPerPixel = 360. / width;
+      double latPerPixel = 180. / height;
+      double lon1 = lonPerPixel * xx;
+      double lon2 = lonPerPixel * (xx + 1);
+      double lat1 = latPerPixel * (yy - 1);
+      double lat2 = latPerPixel * yy;
+      double area = (M_PI / 180.) * fabs(sin(lat1 * (M_PI / 180.)) - sin(lat2 * (M_PI / 180.))) * fabs(lon1 - lon2);
+      scale[y * width + x] = area;
+      minScale = min(minScale, area);
+    }
+  }
+  for (double& s : scale) {
+    s = s / minScale;
+    s = s * s;
+  }
+  return scale;
+}
+
+// Views and tau bins of the histograms, from the layout file written by preprocess.py (writeHistogramLayout). Boxes are inclusive
+// pixel ranges; a view wrapping around the edges has two, as in findFOVFromSAT. Boxes with the same rows share a band, whose
+// per-column sums are computed once per frame pair.
+struct HistogramLayout {
+  vector<double> tauEdges;  // Increasing, from 0.
+  struct Box {
+    int x0, x1;
+    int band;
+  };
+  vector<vector<Box>> views;
+  vector<pair<int, int>> bands;  // (y0, y1)
+  vector<vector<int>> bandsOfRow;  // Bands containing each pixel row.
+};
+
+HistogramLayout ReadHistogramLayout(string filename, int width, int height) {
+  ifstream i(filename);
+  if (!i) {
+    throw runtime_error("Unable to open " + filename);
+  }
+  nlohmann::json j;
+  i >> j;
+  if (j["width"].get<int>() != width || j["height"].get<int>() != height) {
+    throw runtime_error(filename + " is for " + to_string(j["width"].get<int>()) + "x" + to_string(j["height"].get<int>()) + " frames.");
+  }
+  HistogramLayout layout;
+  layout.tauEdges = j["tauEdges"].get<vector<double>>();
+  if (layout.tauEdges.empty() || layout.tauEdges[0] != 0 || !is_sorted(layout.tauEdges.begin(), layout.tauEdges.end())) {
+    throw runtime_error("tauEdges in " + filename + " must increase from 0.");
+  }
+  for (auto& view : j["views"]) {
+    vector<HistogramLayout::Box> boxes;
+    for (auto& b : view["boxes"]) {
+      vector<int> box = b.get<vector<int>>();  // x0, y0, x1, y1
+      pair<int, int> rows(box[1], box[3]);
+      int band = find(layout.bands.begin(), layout.bands.end(), rows) - layout.bands.begin();
+      if (band == layout.bands.size()) {
+        layout.bands.push_back(rows);
+      }
+      boxes.push_back(HistogramLayout::Box{box[0], box[2], band});
+    }
+    layout.views.push_back(boxes);
+  }
+  layout.bandsOfRow.resize(height);
+  for (int band = 0; band < layout.bands.size(); band++) {
+    for (int y = layout.bands[band].first; y <= layout.bands[band].second; y++) {
+      layout.bandsOfRow[y].push_back(band);
+    }
+  }
+  return layout;
+}
+
+// computeFrameDiff followed by scaleBySphericalProjection. frame1/frame2 are height x width x 3 uint8, masks packed bits.
+void ComputeFrameDiff(const uint8_t* frame1, const uint8_t* mask1, const uint8_t* frame2, const uint8_t* mask2, double tau, const vector<double>& squaredScale, double* diff) {
+  int numPixels = squaredScale.size();
+  for (int p = 0; p < numPixels; p++) {
+    double sum = 0;
+    for (int c = 0; c < 3; c++) {
+      double d = fabs(frame1[3 * p + c] / 255. - frame2[3 * p + c] / 255.);
+      sum = c == 0 ? d * d : sum + d * d;
+    }
+    if (!(framestore::EdgeBit(mask1, p) || framestore::EdgeBit(mask2, p)) || sum < tau) {
+      sum = 0.;
+    }
+    diff[p] = squaredScale[p] * sum;
+  }
+}
+
+// Histograms of one frame pair (numViews x numEdges, see HistogramLayout): the masked squared differences of computeFrameDiff, before
+// tau, binned by value and weighted as in scaleBySphericalProjection, summed per view and accumulated from the top bin down.
+// columnSums is scratch of numBands * numEdges * (width + 1).
+void ComputeHistograms(const uint8_t* frame1, const uint8_t* mask1, const uint8_t* frame2, const uint8_t* mask2, const vector<double>& squaredScale, const HistogramLayout& layout, int width, double* columnSums, float* out) {
+  int numEdges = layout.tauEdges.size();
+  size_t bandSize = (size_t)numEdges * (width + 1);
+  fill(columnSums, columnSums + layout.bands.size() * bandSize, 0.);
+  for (int y = 0; y < layout.bandsOfRow.size(); y++) {
+    if (layout.bandsOfRow[y].empty()) {
+      continue;
+    }
+    for (int x = 0; x < width; x++) {
+      int p = y * width + x;
+      if (!(framestore::EdgeBit(mask1, p) || framestore::EdgeBit(mask2, p))) {
+        continue;
+      }
+      double sum = 0;
+      for (int c = 0; c < 3; c++) {
+        double d = fabs(frame1[3 * p + c] / 255. - frame2[3 * p + c] / 255.);
+        sum = c == 0 ? d * d : sum + d * d;
+      }
+      // Highest edge at or below sum: the pixel counts for every tau up to it.
+      int k = upper_bound(layout.tauEdges.begin(), layout.tauEdges.end(), sum) - layout.tauEdges.begin() - 1;
+      for (int band : layout.bandsOfRow[y]) {
+        columnSums[band * bandSize + (size_t)k * (width + 1) + x + 1] += squaredScale[p] * sum;
+      }
+    }
+  }
+  // Prefix sums over columns, so a box is one difference.
+  for (size_t b = 0; b < layout.bands.size() * numEdges; b++) {
+    double* sums = columnSums + b * (width + 1);
+    for (int x = 0; x < width; x++) {
+      sums[x + 1] += sums[x];
+    }
+  }
+  for (int v = 0; v < layout.views.size(); v++) {
+    double above = 0;
+    for (int k = numEdges - 1; k >= 0; k--) {
+      for (const HistogramLayout::Box& box : layout.views[v]) {
+        const double* sums = columnSums + box.band * bandSize + (size_t)k * (width + 1);
+        above += sums[box.x1 + 1] - sums[box.x0];
+      }
+      out[v * numEdges + k] = (float)above;
+    }
+  }
+}
+
+// Same recurrence (and floating point order) as computeSummedAreaTable, rounded to float32.
+void ComputeSummedAreaTable(const double* diff, int width, int height, double* summed, float* out) {
+  for (int i = 0; i < height; i++) {
+    const double* above = i > 0 ? summed + (i - 1) * width : NULL;
+    double* current = summed + i * width;
+    for (int j = 0; j < width; j++) {
+      double sumAbove = i > 0 ? above[j] : 0;
+      double sumLeft = j > 0 ? current[j - 1] : 0;
+      double sumLeftAbove = i > 0 && j > 0 ? above[j - 1] : 0;
+      current[j] = diff[i * width + j] + sumAbove + sumLeft - sumLeftAbove;
+      out[i * width + j] = (float)current[j];
+    }
+  }
+}
+
+// .npy header for a C-order float32 array, byte-identical to numpy's: the dict is followed by room for the first dimension to grow
+// to 21 digits (so a row can be extended in place), and the whole header is padded to a multiple of 64 bytes.
+string NpyHeader(const vector<size_t>& shape) {
+  ostringstream dict;
+  dict << "{'descr': '<f4', 'fortran_order': False, 'shape': (";
+  for (size_t i = 0; i < shape.size(); i++) {
+    dict << shape[i] << (shape.size() == 1 ? "," : (i + 1 < shape.size() ? ", " : ""));
+  }
+  dict << "), }";
+  string header = dict.str();
+  header.append(21 - to_string(shape[0]).size(), ' ');
+  size_t total = 10 + header.size() + 1;
+  header.append(64 - total % 64, ' ');
+  header += '\n';
+
+  string prefix("\x93NUMPY\x01\x00", 8);
+  uint16_t length = header.size();
+  prefix.append((const char*)&length, 2);
+  return prefix + header;
+}
+
+bool FileExists(string filename) {
+  struct stat st;
+  return stat(filename.c_str(), &st) == 0;
+}
+
+vector<size_t> RowShape(int numSATs, const FrameSource& source, bool columnProfile, const HistogramLayout* histograms) {
+  if (histograms != NULL) {
+    return {(size_t)numSATs, histograms->views.size(), histograms->tauEdges.size()};
+  }
+  if (columnProfile) {
+    return {(size_t)numSATs, (size_t)source.width};
+  }
+  return {(size_t)numSATs, (size_t)source.height, (size_t)source.width};
+}
+
+// Appends the SATs of frame row against frames firstColumn..numFrames-1 to o, one SAT at a time. With columnProfile, only the bottom
+// row of each SAT is written; with histograms, the histograms instead of the SAT.
+void WriteSATs(int row, int firstColumn, const FrameSource& source, double tau, const vector<double>& squaredScale, bool columnProfile, const HistogramLayout* histograms, ostream* o) {
+  int numFrames = source.numFrames;
+  int height = source.height;
+  int width = source.width;
+  size_t maskSize = (size_t)height * width;
+
+  if (histograms != NULL) {
+    vector<double> columnSums(histograms->bands.size() * histograms->tauEdges.size() * (width + 1));
+    vector<float> out(histograms->views.size() * histograms->tauEdges.size());
+    for (int j = firstColumn; j < numFrames; j++) {
+      ComputeHistograms(source.Frame(row), source.Edges(row), source.Frame(j), source.Edges(j), squaredScale, *histograms, width, columnSums.data(), out.data());
+      o->write((const char*)out.data(), out.size() * sizeof(float));
+    }
+    return;
+  }
+
+  vector<double> diff(maskSize);
+  vector<double> summed(maskSize);
+  vector<float> sat(maskSize);
+  for (int j = firstColumn; j < numFrames; j++) {
+    ComputeFrameDiff(source.Frame(row), source.Edges(row), source.Frame(j), source.Edges(j), tau, squaredScale, diff.data());
+    ComputeSummedAreaTable(diff.data(), width, height, summed.data(), sat.data());
+    if (columnProfile) {
+      o->write((const char*)(sat.data() + (height - 1) * width), width * sizeof(float));
+    }
+    else {
+      o->write((const char*)sat.data(), maskSize * sizeof(float));
+    }
+  }
+}
+
+// Writes {prefix}{row}.npy, of shape (numFrames - row, height, width) or (numFrames - row, width) with columnProfile.
+void ComputeRow(int row, const FrameSource& source, double tau, const vector<double>& squaredScale, string prefix, bool columnProfile, const HistogramLayout* histograms) {
+  // Written under a temporary name and renamed once complete, so a partial file is never taken for a finished row.
+  string filename = prefix + to_string(row) + ".npy";
+  string tmpFilename = filename + ".tmp";
+  ofstream o(tmpFilename, ios::binary);
+  o << NpyHeader(RowShape(source.numFrames - row, source, columnProfile, histograms));
+  WriteSATs(row, row, source, tau, squaredScale, columnProfile, histograms, &o);
+  o.close();
+  if (!o.good() || rename(tmpFilename.c_str(), filename.c_str()) != 0) {
+    unlink(tmpFilename.c_str());
+    throw runtime_error("Unable to write " + filename);
+  }
+}
+
+// Grows {prefix}{row}.npy, computed for a clip of extendFrom frames, to the current frame count: the new SATs are appended after the
+// existing ones and the header is rewritten last, in place. Anything after the old data (from an interrupted extension) is dropped
+// first, so this can be rerun. Returns false if the row was already extended.
+bool ExtendRow(int row, int extendFrom, const FrameSource& source, double tau, const vector<double>& squaredScale, string prefix, bool columnProfile, const HistogramLayout* histograms) {
+  string filename = prefix + to_string(row) + ".npy";
+  fstream f(filename, ios::binary | ios::in | ios::out);
+  if (!f.good()) {
+    throw runtime_error("Unable to open " + filename);
+  }
+  char magic[10];
+  f.read(magic, 10);
+  uint16_t headerLength = *(uint16_t*)(magic + 8);
+  string header(headerLength, ' ');
+  f.read(&header[0], headerLength);
+  size_t shapeStart = header.find("'shape': (");
+  if (!f.good() || memcmp(magic, "\x93NUMPY\x01\x00", 8) != 0 || shapeStart == string::npos) {
+    throw runtime_error("ExtendRow: " + filename + " is not a row written by this engine.");
+  }
+  int numSATs = stoi(header.substr(shapeStart + 10));
+  if (numSATs == source.numFrames - row) {
+    return false;
+  }
+  if (numSATs != extendFrom - row) {
+    throw runtime_error("ExtendRow: " + filename + " has " + to_string(numSATs) + " SATs; expected " + to_string(extendFrom - row) + " for a clip of " + to_string(extendFrom) + " frames.");
+  }
+
+  vector<size_t> shape = RowShape(numSATs, source, columnProfile, histograms);
+  size_t satSize = shape.size() == 3 ? shape[1] * shape[2] : shape[1];
+  size_t dataEnd = 10 + headerLength + numSATs * satSize * sizeof(float);
+  f.close();
+  if (truncate(filename.c_str(), dataEnd) != 0) {
+    throw runtime_error("Unable to truncate " + filename);
+  }
+  string newHeader = NpyHeader(RowShape(source.numFrames - row, source, columnProfile, histograms));
+  if (newHeader.size() != 10 + (size_t)headerLength) {
+    throw runtime_error("ExtendRow: The header of " + filename + " does not have room for the new shape.");
+  }
+
+  f.open(filename, ios::binary | ios::in | ios::out);
+  f.seekp(dataEnd);
+  WriteSATs(row, extendFrom, source, tau, squaredScale, columnProfile, histograms, &f);
+  f.seekp(0);
+  f << newHeader;
+  f.close();
+  if (!f.good()) {
+    throw runtime_error("Unable to write " + filename);
+  }
+  return true;
+}
+
+// Sharded mode (see runShards in preprocess.py). The frame pair triangle is split into tiles of tileSize x tileSize pairs, small enough
+// that the frames of a tile stay in cache. Any number of workers, on this machine or others sharing the directory, claim tiles and
+// write tile_{bi}_{bj}.npy: the histograms (see ComputeHistograms) of frames i in block bi against frames j >= i in block bj, of shape
+// (tileSize, tileSize, numViews, numEdges), zero where i > j. The finished tiles are the checkpoint.
+//
+// A claim is tile_{bi}_{bj}.claim, created exclusively and holding its owner's id. Its owner touches it while working; a claim older
+// than the lease (by the clock of the shard directory's filesystem) belongs to a worker that died and can be taken over. Every claim
+// and failure is logged to tile_{bi}_{bj}.attempts; a tile is given up after maxAttempts claims. runShards starts each run with new logs.
+struct ShardManifest {
+  int numFrames;
+  int tileSize;
+  int maxAttempts;
+  double lease;  // Seconds.
+  string frameStore;
+  string frames;
+  string edges;
+  string layout;
+};
+
+ShardManifest ReadShardManifest(string shardDir) {
+  string filename = shardDir + "/manifest.json";
+  ifstream i(filename);
+  if (!i) {
+    throw runtime_error("Unable to open " + filename);
+  }
+  nlohmann::json j;
+  i >> j;
+  ShardManifest manifest;
+  manifest.numFrames = j["numFrames"].get<int>();
+  manifest.tileSize = j["tileSize"].get<int>();
+  manifest.maxAttempts = j["maxAttempts"].get<int>();
+  manifest.lease = j["lease"].get<double>();
+  manifest.frameStore = j.value("frameStore", "");
+  manifest.frames = j.value("frames", "");
+  manifest.edges = j.value("edges", "");
+  manifest.layout = j["layout"].get<string>();
+  // Relative paths are relative to the shard directory, which other machines may mount elsewhere.
+  for (string* path : {&manifest.frameStore, &manifest.frames, &manifest.edges, &manifest.layout}) {
+    if (!path->empty() && (*path)[0] != '/') {
+      *path = shardDir + "/" + *path;
+    }
+  }
+  return manifest;
+}
+
+// Number of claims logged to a tile's .attempts file (failures are logged too, but only claims count).
+int CountClaims(string filename) {
+  ifstream i(filename);
+  int numClaims = 0;
+  string line;
+  while (getline(i, line)) {
+    numClaims += line.compare(0, 8, "claimed ") == 0;
+  }
+  return numClaims;
+}
+
+bool AppendLine(string filename, string line) {
+  line += "\n";
+  int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  bool written = write(fd, line.data(), line.size()) == (ssize_t)line.size();
+  close(fd);
+  return written;
+}
+
+// Claims of this process, touched by the heartbeat thread so they do not go stale.
+struct HeldClaims {
+  mutex lock;
+  set<string> claims;
+};
+
+// Current time of the filesystem holding shardDir: the mtime of a file touched there now. On a network filesystem, claims are touched
+// by the server's clock, so comparing them with this machine's clock would depend on clock skew.
+bool ShardDirTime(string shardDir, string workerId, time_t* now) {
+  string filename = shardDir + "/clock." + workerId;
+  int fd = open(filename.c_str(), O_WRONLY | O_CREAT, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  close(fd);
+  struct stat st;
+  bool ok = utime(filename.c_str(), NULL) == 0 && stat(filename.c_str(), &st) == 0;
+  unlink(filename.c_str());
+  if (ok) {
+    *now = st.st_mtime;
+  }
+  return ok;
+}
+
+string ReadClaim(string filename) {
+  ifstream i(filename);
+  return string(istreambuf_iterator<char>(i), istreambuf_iterator<char>());
+}
+
+// Puts a claim moved away by ClaimTile or ReleaseTile back, unless a new claim has taken its place.
+void RestoreClaim(string moved, string claim) {
+  link(moved.c_str(), claim.c_str());
+  unlink(moved.c_str());
+}
+
+bool ClaimTile(string shardDir, string base, const ShardManifest& manifest, string workerId, HeldClaims* held) {
+  if (FileExists(base + ".npy") || CountClaims(base + ".attempts") >= manifest.maxAttempts) {
+    return false;
+  }
+  string claim = base + ".claim";
+  int fd = open(claim.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) {
+    struct stat observed;
+    time_t now;
+    if (errno != EEXIST || stat(claim.c_str(), &observed) != 0 || !ShardDirTime(shardDir, workerId, &now) || difftime(now, observed.st_mtime) < manifest.lease) {
+      return false;
+    }
+    // Stale: only one worker can rename it away. Its owner may have touched it, or another worker replaced it, since it was judged
+    // stale; then it goes back.
+    string stale = claim + ".stale." + workerId;
+    if (rename(claim.c_str(), stale.c_str()) != 0) {
+      return false;
+    }
+    struct stat st;
+    if (stat(stale.c_str(), &st) != 0 || st.st_ino != observed.st_ino || st.st_mtime != observed.st_mtime) {
+      RestoreClaim(stale, claim);
+      return false;
+    }
+    unlink(stale.c_str());
+    fd = open(claim.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+      return false;
+    }
+  }
+  bool written = write(fd, workerId.data(), workerId.size()) == (ssize_t)workerId.size();
+  close(fd);
+  if (!written || !AppendLine(base + ".attempts", "claimed " + workerId)) {
+    unlink(claim.c_str());
+    return false;
+  }
+  lock_guard<mutex> guard(held->lock);
+  held->claims.insert(claim);
+  return true;
+}
+
+// Removes the claim if it is still this worker's: after a stall longer than the lease, another worker may have taken the tile over.
+void ReleaseTile(string base, string workerId, HeldClaims* held) {
+  string claim = base + ".claim";
+  {
+    lock_guard<mutex> guard(held->lock);
+    held->claims.erase(claim);
+  }
+  string released = claim + ".released." + workerId;
+  if (rename(claim.c_str(), released.c_str()) != 0) {
+    return;
+  }
+  if (ReadClaim(released) == workerId) {
+    unlink(released.c_str());
+  }
+  else {
+    RestoreClaim(released, claim);
+  }
+}
+
+void ComputeTile(int bi, int bj, string base, const ShardManifest& manifest, const FrameSource& source, const vector<double>& squaredScale, const HistogramLayout& layout, string workerId) {
+  int tileSize = manifest.tileSize;
+  int numViews = layout.views.size();
+  int numEdges = layout.tauEdges.size();
+  string tmpFilename = base + ".npy.tmp." + workerId;
+  ofstream o(tmpFilename, ios::binary);
+  o << NpyHeader({(size_t)tileSize, (size_t)tileSize, (size_t)numViews, (size_t)numEdges});
+  vector<double> columnSums(layout.bands.size() * numEdges * (source.width + 1));
+  vector<float> out(numViews * numEdges);
+  vector<float> zeros(numViews * numEdges, 0);
+  for (int i = bi * tileSize; i < (bi + 1) * tileSize; i++) {
+    for (int j = bj * tileSize; j < (bj + 1) * tileSize; j++) {
+      if (i > j || i >= source.numFrames || j >= source.numFrames) {
+        o.write((const char*)zeros.data(), zeros.size() * sizeof(float));
+        continue;
+      }
+      ComputeHistograms(source.Frame(i), source.Edges(i), source.Frame(j), source.Edges(j), squaredScale, layout, source.width, columnSums.data(), out.data());
+      o.write((const char*)out.data(), out.size() * sizeof(float));
+    }
+  }
+  o.close();
+  if (!o.good() || rename(tmpFilename.c_str(), (base + ".npy").c_str()) != 0) {
+    unlink(tmpFilename.c_str());
+    throw runtime_error("Unable to write " + base + ".npy");
+  }
+}
+
+// Works on tiles until every tile is finished or given up. Returns the number of tiles given up.
+int RunShardWorker(string shardDir, int numThreads, string workerId) {
+  ShardManifest manifest = ReadShardManifest(shardDir);
+  FrameSource source;
+  if (!manifest.frameStore.empty()) {
+    OpenFrameStore(manifest.frameStore, &source);
+  }
+  else {
+    LoadNpyFrames(manifest.frames, manifest.edges, &source);
+  }
+  if (source.numFrames != manifest.numFrames) {
+    throw runtime_error("The manifest in " + shardDir + " is for " + to_string(manifest.numFrames) + " frames; the frames have " + to_string(source.numFrames) + ".");
+  }
+  HistogramLayout layout = ReadHistogramLayout(manifest.layout, source.width, source.height);
+  vector<double> squaredScale = ComputeSquaredScalingMap(source.width, source.height);
+  int numBlocks = (manifest.numFrames + manifest.tileSize - 1) / manifest.tileSize;
+  vector<pair<int, int>> tiles;
+  for (int bi = 0; bi < numBlocks; bi++) {
+    for (int bj = bi; bj < numBlocks; bj++) {
+      tiles.push_back(make_pair(bi, bj));
+    }
+  }
+  cout << "Worker " << workerId << ": " << tiles.size() << " tiles of " << manifest.tileSize << "x" << manifest.tileSize << " frame pairs." << endl;
+
+  // Claims are touched every quarter lease; waiting for tiles claimed by others polls more often.
+  auto poll = chrono::duration<double>(min(1., manifest.lease / 4));
+  HeldClaims held;
+  atomic<bool> finished(false);
+  thread heartbeat([&]() {
+    auto touched = chrono::steady_clock::now();
+    while (!finished) {
+      if (chrono::steady_clock::now() - touched >= chrono::duration<double>(manifest.lease / 4)) {
+        touched = chrono::steady_clock::now();
+        lock_guard<mutex> guard(held.lock);
+        for (const string& claim : held.claims) {
+          utime(claim.c_str(), NULL);
+        }
+      }
+      this_thread::sleep_for(poll);
+    }
+  });
+
+  mutex coutMutex;
+  atomic<int> numComputed(0);
+  vector<thread> workers;
+  for (int t = 0; t < numThreads; t++) {
+    workers.push_back(thread([&, t]() {
+      while (true) {
+        // Start each pass at a different tile per thread, so threads rarely race for the same claim.
+        bool open = false;
+        for (size_t k = 0; k < tiles.size(); k++) {
+          auto tile = tiles[(k + t * tiles.size() / numThreads) % tiles.size()];
+          string base = shardDir + "/tile_" + to_string(tile.first) + "_" + to_string(tile.second);
+          if (FileExists(base + ".npy") || CountClaims(base + ".attempts") >= manifest.maxAttempts) {
+            continue;
+          }
+          open = true;
+          string threadId = workerId + "_" + to_string(t);
+          if (!ClaimTile(shardDir, base, manifest, threadId, &held)) {
+            continue;
+          }
+          auto start = chrono::steady_clock::now();
+          try {
+            ComputeTile(tile.first, tile.second, base, manifest, source, squaredScale, layout, threadId);
+            numComputed++;
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            lock_guard<mutex> guard(coutMutex);
+            cout << "Tile " << tile.first << ", " << tile.second << " done in " << seconds << " s." << endl;
+          }
+          catch (const exception& e) {
+            AppendLine(base + ".attempts", "failed " + threadId + ": " + e.what());
+            lock_guard<mutex> guard(coutMutex);
+            cout << "Tile " << tile.first << ", " << tile.second << " failed: " << e.what() << endl;
+          }
+          ReleaseTile(base, threadId, &held);
+        }
+        if (!open) {
+          break;
+        }
+        // The rest is claimed by other workers: wait in case one of them dies.
+        this_thread::sleep_for(poll);
+      }
+    }));
+  }
+  for (auto& w : workers) {
+    w.join();
+  }
+  finished = true;
+  heartbeat.join();
+
+  int numFailed = 0;
+  for (auto& tile : tiles) {
+    numFailed += !FileExists(shardDir + "/tile_" + to_string(tile.first) + "_" + to_string(tile.second) + ".npy");
+  }
+  cout << "Worker " << workerId << " computed " << numComputed << " tiles. " << numFailed << " tiles were given up." << endl;
+  return numFailed;
+}
+
+int main(int argc, char **argv)
+{
+  options_description desc("Allowed options");
+  desc.add_options()
+  ("help", "Print help message.")
+  ("frameStore", value<string>(), "Frame store written by ingest. Replaces frames and edges.")
+  ("frames", value<string>(), "Decoded frames (.npy, uint8, numFrames x height x width x 3).")
+  ("edges", value<string>(), "Edge masks (.npy, uint8, numFrames x height x width).")
+  ("tau", value<double>(), "Threshold tau: squared pixel differences below it are ignored.")
+  ("outputPrefix", value<string>(), "Row i is written to {outputPrefix}{i}.npy.")
+  ("threads", value<int>()->default_value(0), "Number of rows computed concurrently. 0 uses all cores.")
+  ("extendFrom", value<int>()->default_value(0), "Number of frames the existing rows were computed for. Rows below it are extended in place with the SATs of the frames added since.")
+  ("columnProfile", "Only write the bottom row of each SAT (per-column prefix sums), enough for views spanning the full height.")
+  ("histogramLayout", value<string>(), "Views and tau edges (JSON, see writeHistogramLayout in preprocess.py). Write tau-independent histograms per view instead of SATs; tau is not needed.")
+  ("shardDir", value<string>(), "Work on the tiles of a sharded run (see RunShardWorker) until all are done. Everything else comes from the manifest in this directory.")
+  ("workerId", value<string>(), "Name of this worker in the claims of a sharded run. Defaults to {hostname}_{pid}.")
+  ;
+
+  variables_map vm;
+  store(parse_command_line(argc, argv, desc), vm);
+  notify(vm);
+
+  if (vm.count("help")) {
+    cout << desc << "\n";
+    return 1;
+  }
+
+  if (vm.count("shardDir")) {
+    int numThreads = vm["threads"].as<int>() > 0 ? vm["threads"].as<int>() : max(1, (int)thread::hardware_concurrency());
+    string workerId;
+    if (vm.count("workerId")) {
+      workerId = vm["workerId"].as<string>();
+    }
+    else {
+      char hostname[256] = "";
+      gethostname(hostname, sizeof(hostname) - 1);
+      workerId = string(hostname) + "_" + to_string(getpid());
+    }
+    return RunShardWorker(vm["shardDir"].as<string>(), numThreads, workerId) == 0 ? 0 : 1;
+  }
+
+  if ((vm.count("frameStore") == 0 && (vm.count("frames") == 0 || vm.count("edges") == 0)) || (vm.count("tau") == 0 && vm.count("histogramLayout") == 0) || vm.count("outputPrefix") == 0) {
+    cout << "Need to specify a frame store (or frames and edges), tau (or a histogram layout) and output prefix. Exiting." << "\n";
+    return 1;
+  }
+
+  FrameSource source;
+  if (vm.count("frameStore")) {
+    OpenFrameStore(vm["frameStore"].as<string>(), &source);
+  }
+  else {
+    LoadNpyFrames(vm["frames"].as<string>(), vm["edges"].as<string>(), &source);
+  }
+  int numFrames = source.numFrames;
+  int height = source.height;
+  int width = source.width;
+  cout << "Computing SATs for " << numFrames << " frames of " << width << "x" << height << endl;
+
+  double tau = vm.count("tau") ? vm["tau"].as<double>() : 0;
+  bool columnProfile = vm.count("columnProfile") > 0;
+  unique_ptr<HistogramLayout> histograms;
+  if (vm.count("histogramLayout")) {
+    histograms.reset(new HistogramLayout(ReadHistogramLayout(vm["histogramLayout"].as<string>(), width, height)));
+    cout << "Histograms of " << histograms->views.size() << " views with " << histograms->tauEdges.size() << " tau edges." << endl;
+  }
+  int extendFrom = vm["extendFrom"].as<int>();
+  assert(extendFrom >= 0 && extendFrom <= numFrames);
+  string prefix = vm["outputPrefix"].as<string>();
+  vector<double> squaredScale = ComputeSquaredScalingMap(width, height);
+
+  // Rows get shorter with i, so handing them out in order keeps the threads balanced until the end.
+  int numThreads = vm["threads"].as<int>() > 0 ? vm["threads"].as<int>() : max(1, (int)thread::hardware_concurrency());
+  atomic<int> next(0);
+  mutex coutMutex;
+  string error;  // First failure; the other threads stop after their current row.
+  vector<thread> workers;
+  auto start = chrono::steady_clock::now();
+  for (int t = 0; t < numThreads; t++) {
+    workers.push_back(thread([&]() {
+      for (int row = next++; row < numFrames; row = next++) {
+        try {
+          if (row < extendFrom) {
+            bool extended = ExtendRow(row, extendFrom, source, tau, squaredScale, prefix, columnProfile, histograms.get());
+            lock_guard<mutex> lock(coutMutex);
+            cout << (extended ? "Extended row " : "Row is already extended: ") << row << endl;
+            continue;
+          }
+          if (FileExists(prefix + to_string(row) + ".npy")) {
+            lock_guard<mutex> lock(coutMutex);
+            cout << "Row " << row << " is already computed." << endl;
+            continue;
+          }
+          ComputeRow(row, source, tau, squaredScale, prefix, columnProfile, histograms.get());
+          lock_guard<mutex> lock(coutMutex);
+          cout << "Wrote row " << row << " (" << numFrames - row << " SATs)." << endl;
+        }
+        catch (const exception& e) {
+          lock_guard<mutex> lock(coutMutex);
+          if (error.empty()) {
+            error = e.what();
+          }
+          next = numFrames;
+        }
+      }
+    }));
+  }
+  for (auto& w : workers) {
+    w.join();
+  }
+  if (!error.empty()) {
+    cout << error << " Exiting." << endl;
+    return 1;
+  }
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  long numSATs = (long)numFrames * (numFrames + 1) / 2 - (long)extendFrom * (extendFrom + 1) / 2;
+  cout << "Computed " << numSATs << " SATs in " << seconds << " s." << endl;
+  return 0;
+}